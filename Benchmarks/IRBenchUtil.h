@@ -0,0 +1,67 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <functional>
+#include <sstream>
+#include <string>
+#include <vector>
+
+/*
+ * Helpers shared by the benchmarks: comma separated command line lists and timing.
+ */
+
+//Comma separated integers, empty items are skipped
+static inline std::vector<int> ParseList(const char* arg)
+{
+	std::vector<int> values;
+	std::stringstream ss(arg);
+	std::string item;
+	while (std::getline(ss, item, ',')) {
+		if (!item.empty())
+			values.push_back(atoi(item.c_str()));
+	}
+	return values;
+}
+
+//Comma separated floats, empty items are skipped
+static inline std::vector<float> ParseFloatList(const char* arg)
+{
+	std::vector<float> values;
+	std::stringstream ss(arg);
+	std::string item;
+	while (std::getline(ss, item, ',')) {
+		if (!item.empty())
+			values.push_back(static_cast<float>(atof(item.c_str())));
+	}
+	return values;
+}
+
+//Value at fraction p of the sorted values, 0 for none
+static inline double Percentile(std::vector<double> values, double p)
+{
+	if (values.empty())
+		return 0.0;
+	std::sort(values.begin(), values.end());
+	size_t index = std::min(values.size() - 1, static_cast<size_t>(p * (values.size() - 1) + 0.5));
+	return values[index];
+}
+
+//Median time of body in us, setup runs untimed before every run. A first untimed run warms up caches and allocator
+static inline double TimeUs(int iterations, const std::function<void()>& body, const std::function<void()>& setup = nullptr)
+{
+	std::vector<double> times;
+	if (setup)
+		setup();
+	body();
+	for (int i = 0; i < iterations; i++) {
+		if (setup)
+			setup();
+		auto start = std::chrono::steady_clock::now();
+		body();
+		auto finish = std::chrono::steady_clock::now();
+		times.push_back(std::chrono::duration<double, std::micro>(finish - start).count());
+	}
+	return Percentile(times, 0.5);
+}
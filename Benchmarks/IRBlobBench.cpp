@@ -0,0 +1,172 @@
+// Blob extraction benchmark: labels synthetic threshold masks with cv::connectedComponentsWithStats and with the run
+// based IRBlobLabeller, checks that both report the same components (area, bounding box and centroid) and times them.
+// Besides rendered tool scenes a mask of random pixel noise exercises irregular, diagonally connected components.
+//
+// usage: IRBlobBench [--iterations N] [--frames N] [--spheres N] [--distractors N] [--noise P] [--seed N]
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <tuple>
+#include <vector>
+
+#include <opencv2/core.hpp>
+#include <opencv2/imgproc.hpp>
+
+#include "IRBlobLabeller.h"
+#include "IRThreshold.h"
+#include "IRSyntheticScene.h"
+#include "IRBenchUtil.h"
+
+static std::vector<IRBlob> OpenCVBlobs(const cv::Mat& mask)
+{
+	cv::Mat labels, stats, centroids;
+	int count = cv::connectedComponentsWithStats(mask, labels, stats, centroids, 8);
+	std::vector<IRBlob> blobs;
+	for (int i = 1; i < count; i++) {
+		IRBlob blob;
+		blob.left = stats.at<int32_t>(i, cv::CC_STAT_LEFT);
+		blob.top = stats.at<int32_t>(i, cv::CC_STAT_TOP);
+		blob.width = stats.at<int32_t>(i, cv::CC_STAT_WIDTH);
+		blob.height = stats.at<int32_t>(i, cv::CC_STAT_HEIGHT);
+		blob.area = stats.at<int32_t>(i, cv::CC_STAT_AREA);
+		blob.centroid_x = centroids.at<double>(i, 0);
+		blob.centroid_y = centroids.at<double>(i, 1);
+		blobs.push_back(blob);
+	}
+	return blobs;
+}
+
+static bool SameBlob(const IRBlob& a, const IRBlob& b)
+{
+	return a.left == b.left && a.top == b.top && a.width == b.width && a.height == b.height && a.area == b.area
+		&& std::abs(a.centroid_x - b.centroid_x) < 1e-9 && std::abs(a.centroid_y - b.centroid_y) < 1e-9;
+}
+
+static bool BlobLess(const IRBlob& a, const IRBlob& b)
+{
+	return std::tie(a.top, a.left, a.area, a.width, a.height) < std::tie(b.top, b.left, b.area, b.width, b.height);
+}
+
+struct Comparison
+{
+	size_t mismatches{ 0 };
+	bool order_identical{ true };
+};
+
+static Comparison Compare(std::vector<IRBlob> expected, std::vector<IRBlob> actual)
+{
+	Comparison result;
+	if (expected.size() != actual.size()) {
+		result.mismatches = std::max(expected.size(), actual.size());
+		result.order_identical = false;
+		return result;
+	}
+	for (size_t i = 0; i < expected.size(); i++)
+		result.order_identical &= SameBlob(expected[i], actual[i]);
+	//Different components can share the corner of their bounding box, so the size is part of the sort key too
+	std::sort(expected.begin(), expected.end(), BlobLess);
+	std::sort(actual.begin(), actual.end(), BlobLess);
+	for (size_t i = 0; i < expected.size(); i++)
+		result.mismatches += SameBlob(expected[i], actual[i]) ? 0 : 1;
+	return result;
+}
+
+int main(int argc, char** argv)
+{
+	int iterations = 200;
+	int frames = 20;
+	uint32_t num_spheres = 20;
+	uint32_t num_distractors = 20;
+	double noise = 0.3;
+	uint32_t seed = 1;
+	for (int i = 1; i < argc; i++) {
+		bool has_value = i + 1 < argc;
+		if (strcmp(argv[i], "--iterations") == 0 && has_value) iterations = std::max(1, atoi(argv[++i]));
+		else if (strcmp(argv[i], "--frames") == 0 && has_value) frames = std::max(1, atoi(argv[++i]));
+		else if (strcmp(argv[i], "--spheres") == 0 && has_value) num_spheres = static_cast<uint32_t>(atoi(argv[++i]));
+		else if (strcmp(argv[i], "--distractors") == 0 && has_value) num_distractors = static_cast<uint32_t>(atoi(argv[++i]));
+		else if (strcmp(argv[i], "--noise") == 0 && has_value) noise = atof(argv[++i]);
+		else if (strcmp(argv[i], "--seed") == 0 && has_value) seed = static_cast<uint32_t>(atoi(argv[++i]));
+		else {
+			printf("unknown argument %s\n", argv[i]);
+			return 1;
+		}
+	}
+
+	const uint16_t upperLimit = 256 * 5 + 1;
+	IRSyntheticSceneConfig config;
+	config.num_distractors = num_distractors;
+	config.partial_occlusion = 0.2f;
+	config.pixel_dropout = 0.05f;
+	IRSyntheticScene scene(config, seed);
+
+	//Spheres are rendered as single sphere tools, so the number of reflections does not depend on the tool layout
+	std::vector<IRSyntheticTool> tools;
+	for (uint32_t i = 0; i < num_spheres; i++) {
+		IRSyntheticTool tool;
+		tool.identifier = "sphere" + std::to_string(i);
+		tool.spheres = cv::Mat3f(1, 1);
+		tool.spheres.at<cv::Vec3f>(0, 0) = cv::Vec3f(0, 0, 0);
+		tools.push_back(tool);
+	}
+
+	std::vector<cv::Mat> masks;
+	std::vector<uint16_t> ab(size_t(config.width) * config.height), depth(ab.size());
+	for (int f = 0; f < frames; f++) {
+		scene.Render(tools, scene.RandomPoses(tools), ab.data(), depth.data());
+		cv::Mat mask(config.height, config.width, CV_8UC1);
+		IRThresholdAbImage(ab.data(), mask.ptr<uint8_t>(), ab.size(), upperLimit);
+		masks.push_back(mask);
+	}
+	std::mt19937 rng(seed);
+	std::bernoulli_distribution pixel(noise);
+	cv::Mat noise_mask(config.height, config.width, CV_8UC1);
+	for (int y = 0; y < noise_mask.rows; y++)
+		for (int x = 0; x < noise_mask.cols; x++)
+			noise_mask.at<uint8_t>(y, x) = pixel(rng) ? 255 : 0;
+	//Odd width and a row stride larger than the width
+	cv::Mat padded = cv::Mat::zeros(config.height, config.width + 8, CV_8UC1);
+	cv::Mat odd = padded(cv::Rect(0, 0, config.width - 3, config.height));
+	noise_mask(cv::Rect(0, 0, config.width - 3, config.height)).copyTo(odd);
+
+	IRBlobLabeller labeller;
+	size_t mismatches = 0;
+	bool order_identical = true;
+	size_t total_blobs = 0;
+	for (const cv::Mat& mask : masks) {
+		std::vector<IRBlob> expected = OpenCVBlobs(mask);
+		Comparison comparison = Compare(expected, labeller.Label(mask));
+		mismatches += comparison.mismatches;
+		order_identical &= comparison.order_identical;
+		total_blobs += expected.size();
+	}
+	size_t noise_blobs = 0;
+	bool noise_order_identical = true;
+	for (const cv::Mat* mask : { &noise_mask, &odd }) {
+		std::vector<IRBlob> expected = OpenCVBlobs(*mask);
+		Comparison comparison = Compare(expected, labeller.Label(*mask));
+		mismatches += comparison.mismatches;
+		noise_order_identical &= comparison.order_identical;
+		noise_blobs += expected.size();
+	}
+
+	size_t frame = 0;
+	double opencv_us = TimeUs(iterations, [&]() {
+		cv::Mat labels, stats, centroids;
+		cv::connectedComponentsWithStats(masks[frame++ % masks.size()], labels, stats, centroids, 8);
+	});
+	frame = 0;
+	double labeller_us = TimeUs(iterations, [&]() { labeller.Label(masks[frame++ % masks.size()]); });
+
+	printf("{\"frames\":%d,\"iterations\":%d,\"spheres\":%u,\"distractors\":%u,\"blobs_per_frame\":%.1f,\"noise_blobs\":%llu,"
+		"\"exact\":%s,\"mismatches\":%llu,\"order_identical\":%s,\"noise_order_identical\":%s,"
+		"\"opencv_us\":%.3f,\"labeller_us\":%.3f,\"speedup\":%.2f}\n",
+		frames, iterations, num_spheres, num_distractors, double(total_blobs) / masks.size(), (unsigned long long)noise_blobs,
+		mismatches == 0 ? "true" : "false", (unsigned long long)mismatches, order_identical ? "true" : "false",
+		noise_order_identical ? "true" : "false", opencv_us, labeller_us, opencv_us / labeller_us);
+	return mismatches == 0 ? 0 : 1;
+}
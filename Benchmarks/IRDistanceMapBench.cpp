@@ -0,0 +1,118 @@
+// Distance map benchmark: checks that the vectorized IRDistanceMatrix and the radius sorted sides match the cv::norm
+// and sorted insertion implementation ConstructMap used before, and times both for several numbers of spheres.
+// Distances may differ in the last bits (the kernels compute in float), sides have to come out in the same order
+// apart from sides whose lengths are that close.
+//
+// usage: IRDistanceMapBench [--spheres 20,60,150,300] [--iterations N] [--seed N]
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <opencv2/core.hpp>
+
+#include "IRDistanceMap.h"
+#include "IRBenchUtil.h"
+
+//ConstructMap before the vectorized kernels
+static void ReferenceMap(const cv::Mat3f& spheres_xyz, int num_spheres, cv::Mat& map, std::vector<Side>& ordered_sides)
+{
+	for (int i = 0; i < num_spheres; i++) {
+		for (int j = i; j < num_spheres; j++) {
+			float distance = static_cast<float>(cv::norm(spheres_xyz.at<cv::Vec3f>(i, 0) - spheres_xyz.at<cv::Vec3f>(j, 0)));
+			map.at<float>(i, j) = distance;
+			if (i == j)
+				continue;
+			Side s{ i, j, distance };
+			if (ordered_sides.empty() || distance >= ordered_sides.back().distance)
+				ordered_sides.push_back(s);
+			else if (distance <= ordered_sides.front().distance)
+				ordered_sides.insert(ordered_sides.begin(), s);
+			else
+				ordered_sides.insert(std::upper_bound(ordered_sides.cbegin(), ordered_sides.cend(), s, &Side::compare), s);
+		}
+	}
+}
+
+static void KernelMap(const std::vector<float>& soa, int num_spheres, cv::Mat& map, std::vector<Side>& ordered_sides, std::vector<Side>& scratch)
+{
+	const float* x = soa.data();
+	IRDistanceMatrix(x, x + num_spheres, x + 2 * num_spheres, num_spheres, map.ptr<float>(), map.step / sizeof(float));
+	ordered_sides.clear();
+	for (int i = 0; i < num_spheres; i++)
+		for (int j = i + 1; j < num_spheres; j++)
+			ordered_sides.push_back(Side{ i, j, map.at<float>(i, j) });
+	IRSortSides(ordered_sides, scratch);
+}
+
+int main(int argc, char** argv)
+{
+	std::vector<int> sphere_counts{ 20, 60, 150, 300 };
+	int iterations = 200;
+	uint32_t seed = 1;
+	for (int i = 1; i < argc; i++) {
+		bool has_value = i + 1 < argc;
+		if (strcmp(argv[i], "--spheres") == 0 && has_value) sphere_counts = ParseList(argv[++i]);
+		else if (strcmp(argv[i], "--iterations") == 0 && has_value) iterations = std::max(1, atoi(argv[++i]));
+		else if (strcmp(argv[i], "--seed") == 0 && has_value) seed = static_cast<uint32_t>(atoi(argv[++i]));
+		else {
+			printf("unknown argument %s\n", argv[i]);
+			return 1;
+		}
+	}
+
+	std::mt19937 rng(seed);
+	//Sphere centers in the working volume of the AHAT camera, in mm
+	std::uniform_real_distribution<float> lateral(-300.f, 300.f);
+	std::uniform_real_distribution<float> depth(150.f, 1000.f);
+	bool all_exact = true;
+	for (int num_spheres : sphere_counts) {
+		cv::Mat3f spheres(num_spheres, 1);
+		std::vector<float> soa(3 * size_t(num_spheres));
+		for (int i = 0; i < num_spheres; i++) {
+			cv::Vec3f sphere(lateral(rng), lateral(rng), depth(rng));
+			spheres.at<cv::Vec3f>(i, 0) = sphere;
+			for (int c = 0; c < 3; c++)
+				soa[c * num_spheres + i] = sphere[c];
+		}
+
+		cv::Mat reference_map = cv::Mat::zeros(num_spheres, num_spheres, CV_32F);
+		cv::Mat kernel_map = cv::Mat::zeros(num_spheres, num_spheres, CV_32F);
+		std::vector<Side> reference_sides, kernel_sides, scratch;
+		ReferenceMap(spheres, num_spheres, reference_map, reference_sides);
+		KernelMap(soa, num_spheres, kernel_map, kernel_sides, scratch);
+
+		//Relative difference of the distances, and sides in a different order that are not (almost) equally long
+		double max_error = 0.0;
+		for (int i = 0; i < num_spheres; i++)
+			for (int j = i; j < num_spheres; j++)
+				max_error = std::max(max_error, std::abs(double(reference_map.at<float>(i, j)) - kernel_map.at<float>(i, j)) / std::max(1.f, reference_map.at<float>(i, j)));
+		size_t misordered = reference_sides.size() == kernel_sides.size() ? 0 : std::max(reference_sides.size(), kernel_sides.size());
+		for (size_t i = 0; misordered == 0 && i < reference_sides.size(); i++) {
+			const Side& a = reference_sides[i];
+			const Side& b = kernel_sides[i];
+			bool same = a.id_from == b.id_from && a.id_to == b.id_to;
+			if (!same && std::abs(a.distance - b.distance) > 1e-4f * std::max(1.f, a.distance))
+				misordered++;
+		}
+		bool exact = max_error < 1e-5 && misordered == 0;
+		all_exact &= exact;
+
+		double reference_us = TimeUs(iterations, [&]() {
+			reference_sides.clear();
+			ReferenceMap(spheres, num_spheres, reference_map, reference_sides);
+		});
+		double kernel_us = TimeUs(iterations, [&]() { KernelMap(soa, num_spheres, kernel_map, kernel_sides, scratch); });
+
+		printf("{\"spheres\":%d,\"sides\":%llu,\"kernel\":\"%s\",\"exact\":%s,\"max_relative_error\":%.3g,\"misordered\":%llu,"
+			"\"reference_us\":%.3f,\"kernel_us\":%.3f,\"speedup\":%.2f}\n",
+			num_spheres, (unsigned long long)kernel_sides.size(), IRDistanceKernelName(), exact ? "true" : "false", max_error,
+			(unsigned long long)misordered, reference_us, kernel_us, reference_us / kernel_us);
+	}
+	return all_exact ? 0 : 1;
+}
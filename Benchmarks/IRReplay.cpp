@@ -0,0 +1,86 @@
+// Replays a recorded AHAT session through the tracker, either at the recorded cadence or as fast as possible.
+//
+// usage: IRReplay <recording> [--realtime] [--repeat N] [--first N] [--last N] [--matcher search|hashing] [--search-threads N]
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+
+#include "IRToolTrack.h"
+#include "IRSessionRecording.h"
+
+int main(int argc, char** argv)
+{
+	if (argc < 2) {
+		printf("usage: %s <recording> [--realtime] [--repeat N] [--first N] [--last N] [--matcher search|hashing] [--search-threads N]\n", argv[0]);
+		return 1;
+	}
+	std::string path = argv[1];
+	bool realtime = false;
+	int repeat = 1;
+	uint64_t first = 0;
+	uint64_t last = UINT64_MAX;
+	IRMatcherType matcher = IR_MATCHER_SEARCH;
+	uint32_t search_threads = 0;
+	for (int i = 2; i < argc; i++) {
+		if (strcmp(argv[i], "--realtime") == 0)
+			realtime = true;
+		else if (strcmp(argv[i], "--repeat") == 0 && i + 1 < argc)
+			repeat = std::max(1, atoi(argv[++i]));
+		else if (strcmp(argv[i], "--first") == 0 && i + 1 < argc)
+			first = strtoull(argv[++i], nullptr, 10);
+		else if (strcmp(argv[i], "--last") == 0 && i + 1 < argc)
+			last = strtoull(argv[++i], nullptr, 10);
+		else if (strcmp(argv[i], "--matcher") == 0 && i + 1 < argc)
+			matcher = strcmp(argv[++i], "hashing") == 0 ? IR_MATCHER_TRIANGLE_HASHING : IR_MATCHER_SEARCH;
+		else if (strcmp(argv[i], "--search-threads") == 0 && i + 1 < argc)
+			search_threads = static_cast<uint32_t>(atoi(argv[++i]));
+	}
+
+	IRSessionReplay replay;
+	if (!replay.Open(path)) {
+		printf("Could not open recording %s\n", path.c_str());
+		return 1;
+	}
+	printf("Recording %s: %llu frames, %ux%u\n", path.c_str(), (unsigned long long)replay.GetFrameCount(), replay.GetWidth(), replay.GetHeight());
+
+	IRToolTracker tracker(&replay.GetIntrinsics());
+	tracker.SetMatcher(matcher);
+	tracker.SetSearchThreads(search_threads);
+	int num_tools = replay.AddRecordedTools(tracker);
+	printf("Registered %d recorded tools\n", num_tools);
+	if (num_tools == 0 || !tracker.StartTracking()) {
+		printf("Nothing to track\n");
+		return 1;
+	}
+
+	uint64_t fed = 0;
+	uint64_t processed_before = tracker.GetProcessedFrameCount();
+	auto start = std::chrono::steady_clock::now();
+	for (int r = 0; r < repeat; r++) {
+		fed += replay.Play(tracker, realtime, first, last);
+	}
+	auto finish = std::chrono::steady_clock::now();
+	uint64_t processed = tracker.GetProcessedFrameCount() - processed_before;
+	tracker.StopTracking();
+
+	double seconds = std::chrono::duration<double>(finish - start).count();
+	printf("Fed %llu frames, tracker processed %llu in %.3f s (%s)\n", (unsigned long long)fed, (unsigned long long)processed, seconds, realtime ? "realtime" : "as fast as possible");
+	if (processed > 0) {
+		printf("Throughput: %.1f frames/s, %.3f ms/frame\n", processed / seconds, seconds * 1000.0 / processed);
+	}
+
+	const IRPipelineStats& stats = tracker.GetPipelineStats();
+	printf("%-20s %8s %10s %10s %10s %10s\n", "stage", "samples", "mean ms", "p50 ms", "p99 ms", "max ms");
+	for (uint32_t i = 0; i < IR_STAGE_COUNT; i++) {
+		const IRLatencyHistogram& histogram = stats.GetHistogram(static_cast<IRPipelineStage>(i));
+		if (histogram.GetCount() == 0)
+			continue;
+		printf("%-20s %8llu %10.3f %10.3f %10.3f %10.3f\n", IRPipelineStats::GetStageName(static_cast<IRPipelineStage>(i)),
+			(unsigned long long)histogram.GetCount(), histogram.GetMean() / 1e6, histogram.GetPercentile(0.5) / 1e6,
+			histogram.GetPercentile(0.99) / 1e6, histogram.GetMax() / 1e6);
+	}
+	return 0;
+}
@@ -0,0 +1,188 @@
+// Scaling benchmark on synthetic AHAT frames: sweeps tool count, spheres per tool and spurious blobs and reports
+// per frame tracking cost and accuracy against the rendered ground truth.
+//
+// usage: IRSceneBench [--tools 1,5,10] [--spheres 3,4,6] [--blobs 0,50] [--frames N] [--budget-ms N]
+//                     [--min-visible N] [--occlusion P] [--partial P] [--dropout P] [--noise MM] [--seed N] [--json]
+//                     [--matcher search|hashing] [--search-threads N] [--motion MM] [--spin DEG] [--gate MM]
+//                     [--association MM] [--radii MM,MM]
+//
+// Without --motion every frame places the tools at new random poses, with it the tools move smoothly by MM per frame
+// (and spin by DEG per frame), which is what the prediction gated matching (--gate, 0 disables it) and the association
+// with the previous frame's blobs (--association, 0 disables it) rely on.
+// --radii gives the tools these sphere radii in turn (default 6.5 mm), to mix marker sizes in one scene.
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "IRToolTrack.h"
+#include "IRSyntheticScene.h"
+#include "IRBenchUtil.h"
+
+struct SweepResult
+{
+	int frames{ 0 };
+	double mean_ms{ 0 }, p50_ms{ 0 }, p99_ms{ 0 }, max_ms{ 0 };
+	int trackable{ 0 }, detected{ 0 }, wrong{ 0 };
+	double mean_position_error_mm{ 0 }, mean_rotation_error_deg{ 0 };
+};
+
+static SweepResult RunConfig(int num_tools, int num_spheres, int num_blobs, int frames, double budget_ms, int min_visible,
+	IRSyntheticSceneConfig config, uint32_t seed, IRMatcherType matcher, uint32_t search_threads, float motion, float spin, float gate,
+	float association_gate, const std::vector<float>& radii)
+{
+	config.num_distractors = num_blobs;
+	IRSyntheticScene scene(config, seed);
+
+	std::vector<IRSyntheticTool> tools(num_tools);
+	IRToolTracker tracker(&scene.GetIntrinsics());
+	tracker.SetMatcher(matcher);
+	tracker.SetSearchThreads(search_threads);
+	tracker.SetPredictionGate(gate);
+	tracker.SetAssociationGate(association_gate);
+	for (int i = 0; i < num_tools; i++) {
+		tools[i].identifier = "tool_" + std::to_string(i);
+		tools[i].spheres = scene.RandomToolGeometry(num_spheres);
+		tools[i].sphere_radius = radii[i % radii.size()];
+		tools[i].min_visible_spheres = min_visible > 0 ? std::min(min_visible, num_spheres) : num_spheres;
+		tracker.AddTool(tools[i].spheres, tools[i].sphere_radius, tools[i].identifier, tools[i].min_visible_spheres, 0.3f, 0.6f);
+	}
+
+	std::vector<uint16_t> ab(size_t(config.width) * config.height);
+	std::vector<uint16_t> depth(ab.size());
+	cv::Mat pose = cv::Mat::eye(4, 4, CV_32F);
+
+	SweepResult result;
+	std::vector<double> times;
+	double total_ms = 0.0;
+	std::vector<IRSyntheticPose> poses;
+	for (int f = 0; f < frames && total_ms < budget_ms; f++) {
+		if (motion > 0.f && f > 0)
+			scene.MovePoses(poses, motion, spin);
+		else
+			poses = scene.RandomPoses(tools);
+		std::vector<std::vector<bool>> visible;
+		scene.Render(tools, poses, ab.data(), depth.data(), &visible);
+
+		int64_t timestamp = f + 1;
+		auto start = std::chrono::steady_clock::now();
+		tracker.TrackFrameSync(ab.data(), depth.data(), config.width, config.height, pose, timestamp);
+		auto finish = std::chrono::steady_clock::now();
+		double ms = std::chrono::duration<double, std::milli>(finish - start).count();
+		times.push_back(ms);
+		total_ms += ms;
+
+		const std::vector<IRTrackedTool>& tracked = tracker.GetTools();
+		for (int i = 0; i < num_tools; i++) {
+			int num_visible = static_cast<int>(std::count(visible[i].begin(), visible[i].end(), true));
+			if (num_visible >= static_cast<int>(tools[i].min_visible_spheres))
+				result.trackable++;
+
+			const IRTrackedTool& tool = tracked.at(i);
+			if (tool.timestamp != timestamp)
+				continue;
+			cv::Vec3f position(tool.cur_transform.at<float>(0, 0) * 1000.f, tool.cur_transform.at<float>(1, 0) * 1000.f, tool.cur_transform.at<float>(2, 0) * 1000.f);
+			cv::Vec4f quat(tool.cur_transform.at<float>(3, 0), tool.cur_transform.at<float>(4, 0), tool.cur_transform.at<float>(5, 0), tool.cur_transform.at<float>(6, 0));
+			cv::Vec4f truth = poses[i].Quaternion();
+			double position_error = cv::norm(position - poses[i].t);
+			double rotation_error = 2.0 * std::acos(std::min(1.0, std::abs(static_cast<double>(quat.dot(truth))))) * 180.0 / 3.14159265358979;
+			if (position_error > 5.0 || rotation_error > 5.0) {
+				result.wrong++;
+				continue;
+			}
+			result.detected++;
+			result.mean_position_error_mm += position_error;
+			result.mean_rotation_error_deg += rotation_error;
+		}
+	}
+
+	result.frames = static_cast<int>(times.size());
+	if (result.frames > 0) {
+		result.mean_ms = total_ms / result.frames;
+		result.p50_ms = Percentile(times, 0.5);
+		result.p99_ms = Percentile(times, 0.99);
+		result.max_ms = *std::max_element(times.begin(), times.end());
+	}
+	if (result.detected > 0) {
+		result.mean_position_error_mm /= result.detected;
+		result.mean_rotation_error_deg /= result.detected;
+	}
+	return result;
+}
+
+int main(int argc, char** argv)
+{
+	std::vector<int> tool_counts{ 1, 5, 10, 25, 50, 100 };
+	std::vector<int> sphere_counts{ 3, 4, 6, 8, 12 };
+	std::vector<int> blob_counts{ 0, 50, 150, 300 };
+	int frames = 30;
+	double budget_ms = 5000.0;
+	int min_visible = 0;
+	uint32_t seed = 1;
+	bool json = false;
+	IRMatcherType matcher = IR_MATCHER_SEARCH;
+	uint32_t search_threads = 0;
+	float motion = 0.f, spin = 0.f, gate = 10.f, association_gate = 10.f;
+	std::vector<float> radii{ 6.5f };
+	IRSyntheticSceneConfig config;
+
+	for (int i = 1; i < argc; i++) {
+		bool has_value = i + 1 < argc;
+		if (strcmp(argv[i], "--tools") == 0 && has_value) tool_counts = ParseList(argv[++i]);
+		else if (strcmp(argv[i], "--spheres") == 0 && has_value) sphere_counts = ParseList(argv[++i]);
+		else if (strcmp(argv[i], "--blobs") == 0 && has_value) blob_counts = ParseList(argv[++i]);
+		else if (strcmp(argv[i], "--frames") == 0 && has_value) frames = atoi(argv[++i]);
+		else if (strcmp(argv[i], "--budget-ms") == 0 && has_value) budget_ms = atof(argv[++i]);
+		else if (strcmp(argv[i], "--min-visible") == 0 && has_value) min_visible = atoi(argv[++i]);
+		else if (strcmp(argv[i], "--occlusion") == 0 && has_value) config.sphere_occlusion = static_cast<float>(atof(argv[++i]));
+		else if (strcmp(argv[i], "--partial") == 0 && has_value) config.partial_occlusion = static_cast<float>(atof(argv[++i]));
+		else if (strcmp(argv[i], "--dropout") == 0 && has_value) config.pixel_dropout = static_cast<float>(atof(argv[++i]));
+		else if (strcmp(argv[i], "--noise") == 0 && has_value) config.depth_noise_mm = static_cast<float>(atof(argv[++i]));
+		else if (strcmp(argv[i], "--seed") == 0 && has_value) seed = static_cast<uint32_t>(atoi(argv[++i]));
+		else if (strcmp(argv[i], "--json") == 0) json = true;
+		else if (strcmp(argv[i], "--matcher") == 0 && has_value) matcher = strcmp(argv[++i], "hashing") == 0 ? IR_MATCHER_TRIANGLE_HASHING : IR_MATCHER_SEARCH;
+		else if (strcmp(argv[i], "--search-threads") == 0 && has_value) search_threads = static_cast<uint32_t>(atoi(argv[++i]));
+		else if (strcmp(argv[i], "--motion") == 0 && has_value) motion = static_cast<float>(atof(argv[++i]));
+		else if (strcmp(argv[i], "--spin") == 0 && has_value) spin = static_cast<float>(atof(argv[++i]));
+		else if (strcmp(argv[i], "--gate") == 0 && has_value) gate = static_cast<float>(atof(argv[++i]));
+		else if (strcmp(argv[i], "--association") == 0 && has_value) association_gate = static_cast<float>(atof(argv[++i]));
+		else if (strcmp(argv[i], "--radii") == 0 && has_value) radii = ParseFloatList(argv[++i]);
+		else {
+			printf("unknown argument %s\n", argv[i]);
+			return 1;
+		}
+	}
+
+	if (radii.empty()) {
+		printf("--radii needs at least one radius\n");
+		return 1;
+	}
+
+	if (!json)
+		printf("tools,spheres,blobs,frames,mean_ms,p50_ms,p99_ms,max_ms,trackable,detected,wrong,pos_err_mm,rot_err_deg\n");
+	for (int num_tools : tool_counts) {
+		for (int num_spheres : sphere_counts) {
+			for (int num_blobs : blob_counts) {
+				SweepResult r = RunConfig(num_tools, num_spheres, num_blobs, frames, budget_ms, min_visible, config, seed, matcher, search_threads, motion, spin, gate, association_gate, radii);
+				if (json) {
+					printf("{\"tools\":%d,\"spheres\":%d,\"blobs\":%d,\"frames\":%d,\"mean_ms\":%.4f,\"p50_ms\":%.4f,\"p99_ms\":%.4f,\"max_ms\":%.4f,"
+						"\"trackable\":%d,\"detected\":%d,\"wrong\":%d,\"pos_err_mm\":%.4f,\"rot_err_deg\":%.4f}\n",
+						num_tools, num_spheres, num_blobs, r.frames, r.mean_ms, r.p50_ms, r.p99_ms, r.max_ms,
+						r.trackable, r.detected, r.wrong, r.mean_position_error_mm, r.mean_rotation_error_deg);
+				}
+				else {
+					printf("%d,%d,%d,%d,%.3f,%.3f,%.3f,%.3f,%d,%d,%d,%.3f,%.3f\n",
+						num_tools, num_spheres, num_blobs, r.frames, r.mean_ms, r.p50_ms, r.p99_ms, r.max_ms,
+						r.trackable, r.detected, r.wrong, r.mean_position_error_mm, r.mean_rotation_error_deg);
+				}
+				fflush(stdout);
+			}
+		}
+	}
+	return 0;
+}
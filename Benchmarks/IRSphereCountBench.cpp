@@ -0,0 +1,228 @@
+// Sphere count kernel benchmark: the depth first search and the Kabsch pose of IRToolTracker are compiled for every
+// sphere count from 3 to kMaxFixedKernelSpheres (SearchSubModel<N>, MatchPointsKabschFixed<N>), this times them
+// against the generic kernels on synthetic frames. The fixed search has to produce the same candidates as the generic
+// one and the fixed pose (Horn's quaternion) the same pose as the SVD up to float rounding, the benchmark exits with
+// an error otherwise.
+//
+// usage: IRSphereCountBench [--spheres 3,4,5,6] [--tools N] [--blobs 0,50] [--occluded N] [--fixtures N]
+//                           [--iterations N] [--seed N]
+//
+// --occluded lets every tool miss up to N spheres (min 3 visible), which adds the smaller sub-models to the search.
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "IRToolTrack.h"
+#include "IRSyntheticScene.h"
+#include "IRBenchUtil.h"
+
+static bool SameCandidates(const ToolResultContainer& a, const ToolResultContainer& b)
+{
+	if (a.candidates.size() != b.candidates.size())
+		return false;
+	for (size_t i = 0; i < a.candidates.size(); i++) {
+		const ToolResult& ca = a.candidates[i];
+		const ToolResult& cb = b.candidates[i];
+		if (ca.sphere_ids != cb.sphere_ids || ca.occluded_nodes != cb.occluded_nodes || std::abs(ca.error - cb.error) > 1e-3f)
+			return false;
+	}
+	return true;
+}
+
+struct KernelResult
+{
+	int candidates{ 0 };
+	double search_generic_us{ 0 }, search_fixed_us{ 0 };
+	double kabsch_generic_us{ 0 }, kabsch_fixed_us{ 0 };
+	double max_position_diff_mm{ 0 }, max_rotation_diff_deg{ 0 };
+	bool same_candidates{ true };
+};
+
+//Drives the private kernels of one IRToolTracker, declared friend in IRToolTrack.h
+class IRSphereCountBenchmark
+{
+public:
+	IRSphereCountBenchmark(int num_tools, int num_spheres, int num_blobs, int num_occluded, int num_fixtures, uint32_t seed)
+	{
+		IRSyntheticSceneConfig config;
+		config.num_distractors = num_blobs;
+		m_Scene.reset(new IRSyntheticScene(config, seed));
+		m_Tracker.reset(new IRToolTracker(&m_Scene->GetIntrinsics()));
+
+		std::vector<IRSyntheticTool> tools(num_tools);
+		for (int i = 0; i < num_tools; i++) {
+			tools[i].identifier = "tool_" + std::to_string(i);
+			tools[i].spheres = m_Scene->RandomToolGeometry(num_spheres);
+			tools[i].min_visible_spheres = std::max(3, num_spheres - num_occluded);
+			tools[i].sphere_radius = 6.5f;
+			m_Tracker->AddTool(tools[i].spheres, tools[i].sphere_radius, tools[i].identifier, tools[i].min_visible_spheres, 0.3f, 0.6f);
+		}
+
+		std::vector<uint16_t> ab(size_t(config.width) * config.height), depth(ab.size());
+		for (int f = 0; f < num_fixtures; f++) {
+			m_Scene->Render(tools, m_Scene->RandomPoses(tools), ab.data(), depth.data());
+			AHATFrame* frame = m_Tracker->CopyToPool(ab.data(), depth.data(), config.width, config.height, cv::Mat::eye(4, 4, CV_32F), f);
+			ProcessedAHATFrame processed;
+			bool valid = m_Tracker->ProcessFrame(frame, processed);
+			processed.hololens_pose = processed.hololens_pose.clone();
+			m_Tracker->m_FramePool.Release(frame);
+			if (valid)
+				m_Frames.push_back(std::move(processed));
+		}
+	}
+
+	KernelResult Run(int iterations)
+	{
+		IRToolTracker& tracker = *m_Tracker;
+		KernelResult result;
+		if (m_Frames.empty() || tracker.m_Tools.empty())
+			return result;
+		switch (tracker.m_Tools[0].fixed_spheres) {
+		case 3: return Compare<3>(iterations);
+		case 4: return Compare<4>(iterations);
+		case 5: return Compare<5>(iterations);
+		case 6: return Compare<6>(iterations);
+		default: return result;
+		}
+	}
+
+private:
+	template<int Spheres>
+	KernelResult Compare(int iterations)
+	{
+		IRToolTracker& tracker = *m_Tracker;
+		KernelResult result;
+		size_t num_tools = tracker.m_Tools.size();
+
+		//Candidates of both searches on every frame
+		std::vector<std::vector<ToolResultContainer>> generic(m_Frames.size()), fixed(m_Frames.size());
+		for (size_t f = 0; f < m_Frames.size(); f++) {
+			generic[f].resize(num_tools);
+			fixed[f].resize(num_tools);
+			for (size_t i = 0; i < num_tools; i++) {
+				generic[f][i] = ToolResultContainer{ static_cast<int>(i), std::vector<ToolResult>() };
+				fixed[f][i] = ToolResultContainer{ static_cast<int>(i), std::vector<ToolResult>() };
+				tracker.TrackTool(tracker.m_Tools[i], m_Frames[f], m_SearchStack, generic[f][i], true);
+				tracker.TrackTool(tracker.m_Tools[i], m_Frames[f], m_SearchStack, fixed[f][i]);
+				result.same_candidates = result.same_candidates && SameCandidates(generic[f][i], fixed[f][i]);
+				result.candidates += static_cast<int>(generic[f][i].candidates.size());
+			}
+		}
+
+		//Both poses of every candidate
+		for (const std::vector<ToolResultContainer>& frame_results : generic) {
+			for (const ToolResultContainer& container : frame_results) {
+				const IRTrackedTool& tool = tracker.m_Tools[container.tool_id];
+				const ProcessedAHATFrame& frame = m_Frames[&frame_results - generic.data()];
+				for (const ToolResult& candidate : container.candidates) {
+					cv::Mat pose_generic = tracker.MatchPointsKabschGeneric(tool, frame, candidate.sphere_ids, candidate.occluded_nodes);
+					cv::Mat pose_fixed = tracker.MatchPointsKabschFixed<Spheres>(tool, frame, candidate.sphere_ids, candidate.occluded_nodes);
+					double position_diff = 0.0, quat_diff = 0.0, quat_sum = 0.0;
+					for (int c = 0; c < 3; c++)
+						position_diff += std::pow(1000.0 * (pose_generic.at<float>(c, 0) - pose_fixed.at<float>(c, 0)), 2.0);
+					for (int c = 3; c < 7; c++) {
+						quat_diff += std::pow(pose_generic.at<float>(c, 0) - pose_fixed.at<float>(c, 0), 2.0);
+						quat_sum += std::pow(pose_generic.at<float>(c, 0) + pose_fixed.at<float>(c, 0), 2.0);
+					}
+					//Angle from the chord between the quaternions (q and -q are the same rotation), the acos of their dot
+					//product cannot resolve float rounding
+					double chord = std::sqrt(std::min(quat_diff, quat_sum));
+					double rotation_diff = 4.0 * std::asin(std::min(1.0, chord / 2.0)) * 180.0 / 3.14159265358979;
+					result.max_position_diff_mm = std::max(result.max_position_diff_mm, std::sqrt(position_diff));
+					result.max_rotation_diff_deg = std::max(result.max_rotation_diff_deg, rotation_diff);
+				}
+			}
+		}
+
+		//Per frame over all tools, like the track_tool and kabsch stages of IRStageBench
+		auto search = [&](bool generic_kernels) {
+			for (const ProcessedAHATFrame& frame : m_Frames) {
+				for (size_t i = 0; i < num_tools; i++) {
+					ToolResultContainer container{ static_cast<int>(i), std::vector<ToolResult>() };
+					tracker.TrackTool(tracker.m_Tools[i], frame, m_SearchStack, container, generic_kernels);
+				}
+			}
+		};
+		auto kabsch = [&](auto kernel) {
+			for (size_t f = 0; f < m_Frames.size(); f++) {
+				for (const ToolResultContainer& container : generic[f]) {
+					for (const ToolResult& candidate : container.candidates)
+						(tracker.*kernel)(tracker.m_Tools[container.tool_id], m_Frames[f], candidate.sphere_ids, candidate.occluded_nodes);
+				}
+			}
+		};
+		double frames = static_cast<double>(m_Frames.size());
+		result.search_generic_us = TimeUs(iterations, [&] { search(true); }) / frames;
+		result.search_fixed_us = TimeUs(iterations, [&] { search(false); }) / frames;
+		result.kabsch_generic_us = TimeUs(iterations, [&] { kabsch(&IRToolTracker::MatchPointsKabschGeneric); }) / frames;
+		result.kabsch_fixed_us = TimeUs(iterations, [&] { kabsch(&IRToolTracker::MatchPointsKabschFixed<Spheres>); }) / frames;
+		return result;
+	}
+
+	std::unique_ptr<IRSyntheticScene> m_Scene;
+	std::unique_ptr<IRToolTracker> m_Tracker;
+	std::vector<ProcessedAHATFrame> m_Frames;
+	IRToolTracker::SearchStack m_SearchStack;
+};
+
+int main(int argc, char** argv)
+{
+	std::vector<int> sphere_counts{ 3, 4, 5, 6 };
+	std::vector<int> blob_counts{ 0, 50 };
+	int num_tools = 10;
+	int num_occluded = 0;
+	int fixtures = 8;
+	int iterations = 50;
+	uint32_t seed = 1;
+
+	for (int i = 1; i < argc; i++) {
+		bool has_value = i + 1 < argc;
+		if (strcmp(argv[i], "--spheres") == 0 && has_value) sphere_counts = ParseList(argv[++i]);
+		else if (strcmp(argv[i], "--blobs") == 0 && has_value) blob_counts = ParseList(argv[++i]);
+		else if (strcmp(argv[i], "--tools") == 0 && has_value) num_tools = std::max(1, atoi(argv[++i]));
+		else if (strcmp(argv[i], "--occluded") == 0 && has_value) num_occluded = std::max(0, atoi(argv[++i]));
+		else if (strcmp(argv[i], "--fixtures") == 0 && has_value) fixtures = std::max(1, atoi(argv[++i]));
+		else if (strcmp(argv[i], "--iterations") == 0 && has_value) iterations = std::max(1, atoi(argv[++i]));
+		else if (strcmp(argv[i], "--seed") == 0 && has_value) seed = static_cast<uint32_t>(atoi(argv[++i]));
+		else {
+			printf("unknown argument %s\n", argv[i]);
+			return 1;
+		}
+	}
+
+	bool ok = true;
+	for (int num_spheres : sphere_counts) {
+		if (num_spheres < 3 || num_spheres > static_cast<int>(kMaxFixedKernelSpheres)) {
+			printf("no fixed kernels for %d spheres, they exist for 3 to %u\n", num_spheres, kMaxFixedKernelSpheres);
+			return 1;
+		}
+		for (int num_blobs : blob_counts) {
+			IRSphereCountBenchmark bench(num_tools, num_spheres, num_blobs, num_occluded, fixtures, seed);
+			KernelResult r = bench.Run(iterations);
+			//Horn and the SVD solve the same least squares problem, they differ by float rounding only. Close to half
+			//turns the quaternion of the pose divides by a small component and magnifies it to a few 0.01 degrees
+			bool same_poses = r.max_position_diff_mm < 1e-2 && r.max_rotation_diff_deg < 5e-2;
+			ok = ok && r.same_candidates && same_poses;
+			printf("{\"spheres\":%d,\"tools\":%d,\"blobs\":%d,\"occluded\":%d,\"candidates\":%d,"
+				"\"search_generic_us\":%.2f,\"search_fixed_us\":%.2f,\"search_speedup\":%.2f,"
+				"\"kabsch_generic_us\":%.2f,\"kabsch_fixed_us\":%.2f,\"kabsch_speedup\":%.2f,"
+				"\"same_candidates\":%s,\"max_position_diff_mm\":%.6f,\"max_rotation_diff_deg\":%.6f}\n",
+				num_spheres, num_tools, num_blobs, num_occluded, r.candidates,
+				r.search_generic_us, r.search_fixed_us, r.search_generic_us / std::max(1e-9, r.search_fixed_us),
+				r.kabsch_generic_us, r.kabsch_fixed_us, r.kabsch_generic_us / std::max(1e-9, r.kabsch_fixed_us),
+				r.same_candidates ? "true" : "false", r.max_position_diff_mm, r.max_rotation_diff_deg);
+			fflush(stdout);
+		}
+	}
+	if (!ok) {
+		printf("fixed kernels differ from the generic ones\n");
+		return 1;
+	}
+	return 0;
+}
@@ -0,0 +1,278 @@
+// Per stage micro-benchmarks of the tracking pipeline on synthetic AHAT frames. Every stage of IRToolTracker is timed
+// in isolation on prepared inputs for each combination of tool count and spurious blob count, results are written as
+// one JSON object (or CSV row) per stage and configuration so they can be compared across releases.
+//
+// usage: IRStageBench [--tools 1,5,10] [--spheres N] [--blobs 0,50] [--iterations N] [--fixtures N]
+//                     [--budget-ms N] [--seed N] [--stage name] [--csv] [--radii MM,MM]
+//
+// --radii gives the tools these sphere radii in turn (default 6.5 mm), every distinct radius adds its own back-projection,
+// distance map and ordered sides to the frame.
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "IRToolTrack.h"
+#include "IRSyntheticScene.h"
+#include "IRBenchUtil.h"
+
+struct StageResult
+{
+	std::string stage;
+	int iterations{ 0 };
+	double mean_us{ 0 }, p50_us{ 0 }, p99_us{ 0 }, max_us{ 0 };
+};
+
+//Drives the private stages of one IRToolTracker, declared friend in IRToolTrack.h
+class IRStageBenchmark
+{
+public:
+	IRStageBenchmark(int num_tools, int num_spheres, int num_blobs, int num_fixtures, uint32_t seed, const std::vector<float>& radii)
+	{
+		IRSyntheticSceneConfig config;
+		config.num_distractors = num_blobs;
+		m_Scene.reset(new IRSyntheticScene(config, seed));
+		m_Tracker.reset(new IRToolTracker(&m_Scene->GetIntrinsics()));
+		m_iWidth = config.width;
+		m_iHeight = config.height;
+
+		std::vector<IRSyntheticTool> tools(num_tools);
+		for (int i = 0; i < num_tools; i++) {
+			tools[i].identifier = "tool_" + std::to_string(i);
+			tools[i].spheres = m_Scene->RandomToolGeometry(num_spheres);
+			tools[i].min_visible_spheres = num_spheres;
+			tools[i].sphere_radius = radii[i % radii.size()];
+			m_Tracker->AddTool(tools[i].spheres, tools[i].sphere_radius, tools[i].identifier, tools[i].min_visible_spheres, 0.3f, 0.6f);
+		}
+
+		//Render the fixtures and run every stage once to get the inputs of the following stage
+		for (int f = 0; f < num_fixtures; f++) {
+			Fixture fixture;
+			fixture.ab.resize(size_t(m_iWidth) * m_iHeight);
+			fixture.depth.resize(fixture.ab.size());
+			m_Scene->Render(tools, m_Scene->RandomPoses(tools), fixture.ab.data(), fixture.depth.data());
+
+			m_Tracker->ThresholdAbImage(AbImage(fixture), fixture.mask);
+			fixture.spheres_xyd = m_Tracker->ExtractBlobs(fixture.mask, fixture.depth.data(), m_iWidth);
+			m_fDetectedBlobs += fixture.spheres_xyd.rows;
+
+			AHATFrame* frame = m_Tracker->CopyToPool(fixture.ab.data(), fixture.depth.data(), m_iWidth, m_iHeight, cv::Mat::eye(4, 4, CV_32F), f);
+			fixture.valid = m_Tracker->ProcessFrame(frame, fixture.processed);
+			//The processed frame shares the pose with the pool slot
+			fixture.processed.hololens_pose = fixture.processed.hololens_pose.clone();
+			m_Tracker->m_FramePool.Release(frame);
+			if (fixture.valid) {
+				fixture.raw_results.resize(num_tools);
+				for (int i = 0; i < num_tools; i++) {
+					fixture.raw_results[i] = ToolResultContainer{ i, std::vector<ToolResult>() };
+					m_Tracker->TrackTool(m_Tracker->m_Tools[i], fixture.processed, m_SearchStack, fixture.raw_results[i]);
+				}
+			}
+			m_Fixtures.push_back(std::move(fixture));
+		}
+		m_fDetectedBlobs /= std::max(1, num_fixtures);
+	}
+
+	std::vector<StageResult> Run(int iterations, const std::string& only_stage)
+	{
+		IRToolTracker& tracker = *m_Tracker;
+		std::vector<StageResult> results;
+		auto add = [&](const char* name, const std::function<void(Fixture&)>& setup, const std::function<void(Fixture&)>& body, bool needs_frame) {
+			if (!only_stage.empty() && only_stage != name)
+				return;
+			results.push_back(Measure(name, iterations, setup, body, needs_frame));
+		};
+
+		cv::Mat scratch_mask(m_iHeight, m_iWidth, CV_8UC1);
+		add("threshold", nullptr,
+			[&](Fixture& f) { tracker.ThresholdAbImage(AbImage(f), scratch_mask); }, false);
+
+		add("blob_extraction", nullptr,
+			[&](Fixture& f) { tracker.ExtractBlobs(f.mask, f.depth.data(), m_iWidth); }, false);
+
+		add("project_rays", nullptr,
+			[&](Fixture& f) { tracker.ProjectRays(f.spheres_xyd); }, false);
+
+		//Sphere centers, distance map and ordered sides of every radius along the rays
+		RadiusFrameData scratch_radius;
+		add("construct_map", [&](Fixture& f) { tracker.ProjectRays(f.spheres_xyd); },
+			[&](Fixture& f) {
+				for (size_t c = 0; c < tracker.m_SphereRadii.size(); c++)
+					tracker.BackProjectSpheres(f.spheres_xyd, tracker.m_SphereRadii[c], tracker.m_MaxSideLengths[c], scratch_radius);
+			}, false);
+
+		add("track_tool", nullptr,
+			[&](Fixture& f) {
+				for (size_t i = 0; i < tracker.m_Tools.size(); i++) {
+					ToolResultContainer result{ static_cast<int>(i), std::vector<ToolResult>() };
+					tracker.TrackTool(tracker.m_Tools[i], f.processed, m_SearchStack, result);
+				}
+			}, true);
+
+		//All tools on the tracker's search pool, as TrackFrame runs them
+		std::vector<ToolResultContainer> pool_results(tracker.m_Tools.size());
+		add("parallel_track_tool", nullptr,
+			[&](Fixture& f) {
+				tracker.GetSearchPool().Run(static_cast<int>(tracker.m_Tools.size()), [&](int i, int worker) {
+					pool_results[i] = ToolResultContainer{ i, std::vector<ToolResult>() };
+					tracker.TrackTool(tracker.m_Tools[i], f.processed, tracker.m_SearchStacks[worker], pool_results[i]);
+				});
+			}, true);
+
+		std::vector<ToolResultContainer> matcher_results(tracker.m_Tools.size());
+		add("triangle_matcher", nullptr,
+			[&](Fixture& f) { tracker.m_TriangleMatcher.Match(f.processed, tracker.m_Tools, tracker.m_fToleranceAvg, matcher_results.data()); }, true);
+
+		add("union_segmentation", nullptr,
+			[&](Fixture& f) { tracker.UnionSegmentation(f.raw_results.data(), static_cast<int>(f.raw_results.size()), f.processed); }, true);
+
+		add("kabsch", nullptr,
+			[&](Fixture& f) {
+				for (const ToolResultContainer& container : f.raw_results) {
+					if (container.candidates.empty())
+						continue;
+					const ToolResult& best = *std::min_element(container.candidates.begin(), container.candidates.end(), &ToolResult::compare);
+					tracker.MatchPointsKabsch(tracker.m_Tools[container.tool_id], f.processed, best.sphere_ids, best.occluded_nodes);
+				}
+			}, true);
+
+		//Whole frame including the copy into the frame pool AddFrame makes
+		cv::Mat pose = cv::Mat::eye(4, 4, CV_32F);
+		int64_t timestamp = 0;
+		add("frame", nullptr,
+			[&](Fixture& f) { tracker.TrackFrameSync(f.ab.data(), f.depth.data(), m_iWidth, m_iHeight, pose, ++timestamp); }, false);
+
+		return results;
+	}
+
+	inline float GetDetectedBlobs() const { return m_fDetectedBlobs; }
+
+private:
+	struct Fixture
+	{
+		std::vector<uint16_t> ab;
+		std::vector<uint16_t> depth;
+		cv::Mat mask;
+		cv::Mat3f spheres_xyd;
+		bool valid{ false };
+		ProcessedAHATFrame processed;
+		std::vector<ToolResultContainer> raw_results;
+	};
+
+	cv::Mat AbImage(Fixture& fixture)
+	{
+		return cv::Mat(m_iHeight, m_iWidth, CV_16UC1, fixture.ab.data());
+	}
+
+	StageResult Measure(const char* name, int iterations, const std::function<void(Fixture&)>& setup,
+		const std::function<void(Fixture&)>& body, bool needs_frame)
+	{
+		StageResult result;
+		result.stage = name;
+		std::vector<Fixture*> fixtures;
+		for (Fixture& fixture : m_Fixtures) {
+			if (!needs_frame || fixture.valid)
+				fixtures.push_back(&fixture);
+		}
+		if (fixtures.empty())
+			return result;
+
+		std::vector<double> times;
+		times.reserve(iterations);
+		//First pass over the fixtures warms up caches and allocator
+		for (int i = -static_cast<int>(fixtures.size()); i < iterations; i++) {
+			Fixture& fixture = *fixtures[(i + fixtures.size()) % fixtures.size()];
+			if (setup)
+				setup(fixture);
+			auto start = std::chrono::steady_clock::now();
+			body(fixture);
+			auto finish = std::chrono::steady_clock::now();
+			if (i >= 0)
+				times.push_back(std::chrono::duration<double, std::micro>(finish - start).count());
+		}
+
+		result.iterations = static_cast<int>(times.size());
+		double total = 0.0;
+		for (double t : times)
+			total += t;
+		result.mean_us = total / std::max<size_t>(1, times.size());
+		result.p50_us = Percentile(times, 0.5);
+		result.p99_us = Percentile(times, 0.99);
+		result.max_us = times.empty() ? 0.0 : *std::max_element(times.begin(), times.end());
+		return result;
+	}
+
+	std::unique_ptr<IRSyntheticScene> m_Scene;
+	std::unique_ptr<IRToolTracker> m_Tracker;
+	std::vector<Fixture> m_Fixtures;
+	IRToolTracker::SearchStack m_SearchStack;
+	uint32_t m_iWidth{ 0 }, m_iHeight{ 0 };
+	float m_fDetectedBlobs{ 0 };
+};
+
+int main(int argc, char** argv)
+{
+	std::vector<int> tool_counts{ 1, 5, 10, 25 };
+	std::vector<int> blob_counts{ 0, 50, 150 };
+	int num_spheres = 4;
+	int iterations = 200;
+	int fixtures = 8;
+	double budget_ms = 22.0;
+	uint32_t seed = 1;
+	std::string only_stage;
+	bool csv = false;
+	std::vector<float> radii{ 6.5f };
+
+	for (int i = 1; i < argc; i++) {
+		bool has_value = i + 1 < argc;
+		if (strcmp(argv[i], "--tools") == 0 && has_value) tool_counts = ParseList(argv[++i]);
+		else if (strcmp(argv[i], "--blobs") == 0 && has_value) blob_counts = ParseList(argv[++i]);
+		else if (strcmp(argv[i], "--spheres") == 0 && has_value) num_spheres = atoi(argv[++i]);
+		else if (strcmp(argv[i], "--iterations") == 0 && has_value) iterations = atoi(argv[++i]);
+		else if (strcmp(argv[i], "--fixtures") == 0 && has_value) fixtures = std::max(1, atoi(argv[++i]));
+		else if (strcmp(argv[i], "--budget-ms") == 0 && has_value) budget_ms = atof(argv[++i]);
+		else if (strcmp(argv[i], "--seed") == 0 && has_value) seed = static_cast<uint32_t>(atoi(argv[++i]));
+		else if (strcmp(argv[i], "--stage") == 0 && has_value) only_stage = argv[++i];
+		else if (strcmp(argv[i], "--csv") == 0) csv = true;
+		else if (strcmp(argv[i], "--radii") == 0 && has_value) radii = ParseFloatList(argv[++i]);
+		else {
+			printf("unknown argument %s\n", argv[i]);
+			return 1;
+		}
+	}
+
+	if (radii.empty()) {
+		printf("--radii needs at least one radius\n");
+		return 1;
+	}
+
+	if (csv)
+		printf("stage,tools,spheres,blobs,detected_blobs,iterations,mean_us,p50_us,p99_us,max_us,budget_share\n");
+	for (int num_tools : tool_counts) {
+		for (int num_blobs : blob_counts) {
+			IRStageBenchmark bench(num_tools, num_spheres, num_blobs, fixtures, seed, radii);
+			for (const StageResult& r : bench.Run(iterations, only_stage)) {
+				//Share of the frame budget the stage takes on average
+				double budget_share = r.mean_us / (budget_ms * 1000.0);
+				if (csv) {
+					printf("%s,%d,%d,%d,%.1f,%d,%.3f,%.3f,%.3f,%.3f,%.5f\n", r.stage.c_str(), num_tools, num_spheres, num_blobs,
+						bench.GetDetectedBlobs(), r.iterations, r.mean_us, r.p50_us, r.p99_us, r.max_us, budget_share);
+				}
+				else {
+					printf("{\"stage\":\"%s\",\"tools\":%d,\"spheres\":%d,\"blobs\":%d,\"detected_blobs\":%.1f,\"iterations\":%d,"
+						"\"mean_us\":%.3f,\"p50_us\":%.3f,\"p99_us\":%.3f,\"max_us\":%.3f,\"budget_ms\":%.1f,\"budget_share\":%.5f}\n",
+						r.stage.c_str(), num_tools, num_spheres, num_blobs, bench.GetDetectedBlobs(), r.iterations,
+						r.mean_us, r.p50_us, r.p99_us, r.max_us, budget_ms, budget_share);
+				}
+				fflush(stdout);
+			}
+		}
+	}
+	return 0;
+}
@@ -0,0 +1,242 @@
+#include "IRSyntheticScene.h"
+
+#include <algorithm>
+#include <cmath>
+
+static const float kPi = 3.14159265358979f;
+
+cv::Vec4f IRSyntheticPose::Quaternion() const
+{
+	//Same construction as IRToolTracker::MatchPointsKabsch
+	cv::Vec4f quat;
+	quat[3] = std::sqrt(std::max(0.f, 1.f + R[0] + R[4] + R[8])) / 2.f;
+	quat[0] = std::sqrt(std::max(0.f, 1.f + R[0] - R[4] - R[8])) / 2.f;
+	quat[1] = std::sqrt(std::max(0.f, 1.f - R[0] + R[4] - R[8])) / 2.f;
+	quat[2] = std::sqrt(std::max(0.f, 1.f - R[0] - R[4] + R[8])) / 2.f;
+	quat[0] *= (quat[0] * (R[7] - R[5])) >= 0.f ? 1.f : -1.f;
+	quat[1] *= (quat[1] * (R[2] - R[6])) >= 0.f ? 1.f : -1.f;
+	quat[2] *= (quat[2] * (R[3] - R[1])) >= 0.f ? 1.f : -1.f;
+	return quat;
+}
+
+IRSyntheticScene::IRSyntheticScene(const IRSyntheticSceneConfig& config, uint32_t seed)
+	: m_Config(config), m_Rng(seed)
+{
+}
+
+cv::Mat3f IRSyntheticScene::RandomToolGeometry(uint32_t num_spheres, float min_side, float max_extent)
+{
+	std::uniform_real_distribution<float> unit(-1.f, 1.f);
+	std::vector<cv::Vec3f> spheres;
+	float radius = max_extent / 2.f;
+	int attempts = 0;
+	while (spheres.size() < num_spheres) {
+		//Relax the spacing if the layout does not fit
+		if (++attempts > 2000) {
+			min_side *= 0.9f;
+			attempts = 0;
+		}
+		cv::Vec3f candidate(unit(m_Rng) * radius, unit(m_Rng) * radius, unit(m_Rng) * 5.f);
+		if (candidate[0] * candidate[0] + candidate[1] * candidate[1] > radius * radius)
+			continue;
+		bool too_close = false;
+		for (const cv::Vec3f& sphere : spheres) {
+			if (cv::norm(sphere - candidate) < min_side) {
+				too_close = true;
+				break;
+			}
+		}
+		if (!too_close)
+			spheres.push_back(candidate);
+	}
+
+	cv::Vec3f center(0.f, 0.f, 0.f);
+	for (const cv::Vec3f& sphere : spheres)
+		center += sphere;
+	center /= static_cast<float>(num_spheres);
+
+	cv::Mat3f result = cv::Mat3f(num_spheres, 1);
+	for (uint32_t i = 0; i < num_spheres; i++)
+		result.at<cv::Vec3f>(i, 0) = spheres[i] - center;
+	return result;
+}
+
+std::vector<IRSyntheticPose> IRSyntheticScene::RandomPoses(const std::vector<IRSyntheticTool>& tools)
+{
+	std::uniform_real_distribution<float> unit(0.f, 1.f);
+	std::vector<IRSyntheticPose> poses;
+	std::vector<cv::Vec3f> placed; //image x, image y, radius in pixels
+	float focal = m_Intrinsics.GetFocalLength();
+
+	for (const IRSyntheticTool& tool : tools) {
+		float extent = 0.f;
+		for (int i = 0; i < tool.spheres.rows; i++)
+			extent = std::max(extent, static_cast<float>(cv::norm(tool.spheres.at<cv::Vec3f>(i, 0))) + tool.sphere_radius);
+
+		IRSyntheticPose pose;
+		cv::Vec3f image_circle;
+		for (int attempt = 0; attempt < 50; attempt++) {
+			float depth = m_Config.min_depth + unit(m_Rng) * (m_Config.max_depth - m_Config.min_depth);
+			float radius_px = focal * extent / depth;
+			float margin = radius_px + 4.f;
+			float u = margin + unit(m_Rng) * std::max(1.f, m_Config.width - 2.f * margin);
+			float v = margin + unit(m_Rng) * std::max(1.f, m_Config.height - 2.f * margin);
+			float xy[2];
+			float uv[2] = { u, v };
+			m_Intrinsics.MapImagePointToCameraUnitPlane(uv, xy);
+			pose.t = cv::Vec3f(xy[0] * depth, xy[1] * depth, depth);
+			image_circle = cv::Vec3f(u, v, radius_px);
+
+			bool overlaps = false;
+			for (const cv::Vec3f& other : placed) {
+				float dx = other[0] - u;
+				float dy = other[1] - v;
+				if (std::sqrt(dx * dx + dy * dy) < other[2] + radius_px) {
+					overlaps = true;
+					break;
+				}
+			}
+			if (!overlaps)
+				break;
+		}
+		placed.push_back(image_circle);
+
+		//Random spin around the viewing axis followed by a bounded tilt around an axis in the image plane
+		float spin = unit(m_Rng) * 2.f * kPi;
+		float tilt = unit(m_Rng) * m_Config.max_tilt_degrees * kPi / 180.f;
+		float tilt_axis = unit(m_Rng) * 2.f * kPi;
+		float ax = std::cos(tilt_axis), ay = std::sin(tilt_axis);
+		float c = std::cos(tilt), s = std::sin(tilt), C = 1.f - c;
+		float tilt_R[9] = {
+			c + ax * ax * C, ax * ay * C, ay * s,
+			ax * ay * C, c + ay * ay * C, -ax * s,
+			-ay * s, ax * s, c };
+		float cs = std::cos(spin), ss = std::sin(spin);
+		float spin_R[9] = { cs, -ss, 0, ss, cs, 0, 0, 0, 1 };
+		for (int r = 0; r < 3; r++) {
+			for (int col = 0; col < 3; col++) {
+				pose.R[r * 3 + col] = tilt_R[r * 3 + 0] * spin_R[0 * 3 + col] + tilt_R[r * 3 + 1] * spin_R[1 * 3 + col] + tilt_R[r * 3 + 2] * spin_R[2 * 3 + col];
+			}
+		}
+		poses.push_back(pose);
+	}
+	return poses;
+}
+
+void IRSyntheticScene::RenderDisk(cv::Vec2f center, float radius_px, float depth, bool cut, float cut_angle,
+	uint16_t* pAbImage, uint16_t* pDepth, std::vector<float>& zbuffer)
+{
+	std::uniform_real_distribution<float> unit(0.f, 1.f);
+	float cut_x = std::cos(cut_angle), cut_y = std::sin(cut_angle);
+	int x_min = std::max(0, static_cast<int>(std::floor(center[0] - radius_px)));
+	int x_max = std::min(static_cast<int>(m_Config.width) - 1, static_cast<int>(std::ceil(center[0] + radius_px)));
+	int y_min = std::max(0, static_cast<int>(std::floor(center[1] - radius_px)));
+	int y_max = std::min(static_cast<int>(m_Config.height) - 1, static_cast<int>(std::ceil(center[1] + radius_px)));
+	for (int y = y_min; y <= y_max; y++) {
+		for (int x = x_min; x <= x_max; x++) {
+			float dx = x + 0.5f - center[0];
+			float dy = y + 0.5f - center[1];
+			if (dx * dx + dy * dy > radius_px * radius_px)
+				continue;
+			if (cut && dx * cut_x + dy * cut_y > 0.f)
+				continue;
+			size_t idx = size_t(y) * m_Config.width + x;
+			if (depth >= zbuffer[idx])
+				continue;
+			zbuffer[idx] = depth;
+			if (m_Config.pixel_dropout > 0.f && unit(m_Rng) < m_Config.pixel_dropout)
+				continue;
+			pAbImage[idx] = m_Config.sphere_ab;
+			pDepth[idx] = static_cast<uint16_t>(std::clamp(depth, 0.f, 4090.f));
+		}
+	}
+}
+
+void IRSyntheticScene::MovePoses(std::vector<IRSyntheticPose>& poses, float speed_mm, float spin_degrees)
+{
+	std::normal_distribution<float> normal(0.f, 1.f);
+	if (m_Velocities.size() != poses.size()) {
+		m_Velocities.assign(poses.size(), cv::Vec3f());
+		m_Spins.assign(poses.size(), 0.f);
+		for (size_t i = 0; i < poses.size(); i++) {
+			m_Velocities[i] = cv::Vec3f(normal(m_Rng), normal(m_Rng), 0.3f * normal(m_Rng));
+			m_Spins[i] = normal(m_Rng) < 0.f ? -1.f : 1.f;
+		}
+	}
+
+	//Half of the view so the tools stay inside the image
+	float max_x = 0.5f * m_Config.width / 2.f / m_Intrinsics.GetFocalLength();
+	float max_y = 0.5f * m_Config.height / 2.f / m_Intrinsics.GetFocalLength();
+	float spin = spin_degrees * kPi / 180.f;
+	for (size_t i = 0; i < poses.size(); i++) {
+		IRSyntheticPose& pose = poses[i];
+		cv::Vec3f& velocity = m_Velocities[i];
+		velocity += cv::Vec3f(normal(m_Rng), normal(m_Rng), 0.3f * normal(m_Rng)) * 0.05f;
+		float norm = static_cast<float>(cv::norm(velocity));
+		if (norm > 0.f)
+			velocity *= speed_mm / norm;
+
+		cv::Vec3f t = pose.t + velocity;
+		if (t[2] < m_Config.min_depth || t[2] > m_Config.max_depth)
+			velocity[2] = -velocity[2];
+		if (std::abs(t[0]) > max_x * t[2])
+			velocity[0] = t[0] > 0.f ? -std::abs(velocity[0]) : std::abs(velocity[0]);
+		if (std::abs(t[1]) > max_y * t[2])
+			velocity[1] = t[1] > 0.f ? -std::abs(velocity[1]) : std::abs(velocity[1]);
+		pose.t += velocity;
+
+		float c = std::cos(spin * m_Spins[i]), s = std::sin(spin * m_Spins[i]);
+		float R[9];
+		std::copy(pose.R, pose.R + 9, R);
+		for (int col = 0; col < 3; col++) {
+			pose.R[0 * 3 + col] = c * R[0 * 3 + col] - s * R[1 * 3 + col];
+			pose.R[1 * 3 + col] = s * R[0 * 3 + col] + c * R[1 * 3 + col];
+		}
+	}
+}
+
+void IRSyntheticScene::Render(const std::vector<IRSyntheticTool>& tools, const std::vector<IRSyntheticPose>& poses,
+	uint16_t* pAbImage, uint16_t* pDepth, std::vector<std::vector<bool>>* visible)
+{
+	std::uniform_real_distribution<float> unit(0.f, 1.f);
+	std::normal_distribution<float> depth_noise(0.f, std::max(1e-6f, m_Config.depth_noise_mm));
+	size_t num_pixels = size_t(m_Config.width) * m_Config.height;
+
+	for (size_t i = 0; i < num_pixels; i++) {
+		pAbImage[i] = static_cast<uint16_t>(m_Config.background_ab + unit(m_Rng) * m_Config.background_ab_noise);
+		pDepth[i] = m_Config.background_depth;
+	}
+	std::vector<float> zbuffer(num_pixels, 1e9f);
+	float focal = m_Intrinsics.GetFocalLength();
+
+	if (visible != nullptr)
+		visible->assign(tools.size(), std::vector<bool>());
+
+	for (size_t t = 0; t < tools.size() && t < poses.size(); t++) {
+		const IRSyntheticTool& tool = tools[t];
+		if (visible != nullptr)
+			visible->at(t).assign(tool.spheres.rows, false);
+		for (int i = 0; i < tool.spheres.rows; i++) {
+			if (m_Config.sphere_occlusion > 0.f && unit(m_Rng) < m_Config.sphere_occlusion)
+				continue;
+			cv::Vec3f center = poses[t].Apply(tool.spheres.at<cv::Vec3f>(i, 0));
+			if (center[2] <= tool.sphere_radius)
+				continue;
+			//The sensor measures the radial distance to the sphere surface facing the camera
+			float distance = static_cast<float>(cv::norm(center)) - tool.sphere_radius;
+			float radius_px = focal * tool.sphere_radius / center[2] * m_Config.reflection_fraction;
+			bool cut = m_Config.partial_occlusion > 0.f && unit(m_Rng) < m_Config.partial_occlusion;
+			RenderDisk(m_Intrinsics.Project(center), radius_px, distance + depth_noise(m_Rng), cut, unit(m_Rng) * 2.f * kPi,
+				pAbImage, pDepth, zbuffer);
+			if (visible != nullptr)
+				visible->at(t)[i] = true;
+		}
+	}
+
+	for (uint32_t i = 0; i < m_Config.num_distractors; i++) {
+		cv::Vec2f center(unit(m_Rng) * m_Config.width, unit(m_Rng) * m_Config.height);
+		float radius_px = m_Config.distractor_min_radius_px + unit(m_Rng) * (m_Config.distractor_max_radius_px - m_Config.distractor_min_radius_px);
+		float distance = m_Config.min_depth + unit(m_Rng) * (m_Config.max_depth - m_Config.min_depth);
+		RenderDisk(center, radius_px, distance, false, 0.f, pAbImage, pDepth, zbuffer);
+	}
+}
@@ -0,0 +1,118 @@
+#pragma once
+
+#include <vector>
+#include <string>
+#include <random>
+#include <cstdint>
+
+#include <opencv2/core.hpp>
+
+#include "IRCameraIntrinsics.h"
+
+//Ideal pinhole model, defaults roughly match the AHAT sensor
+class IRPinholeIntrinsics : public IRCameraIntrinsics
+{
+public:
+	IRPinholeIntrinsics(float fx = 216.f, float fy = 216.f, float cx = 256.f, float cy = 256.f) : m_fx(fx), m_fy(fy), m_cx(cx), m_cy(cy) {}
+
+	bool MapImagePointToCameraUnitPlane(float(&uv)[2], float(&xy)[2]) override {
+		xy[0] = (uv[0] - m_cx) / m_fx;
+		xy[1] = (uv[1] - m_cy) / m_fy;
+		return true;
+	}
+
+	//Continuous image coordinates (pixel centers at +0.5) of a camera space point
+	inline cv::Vec2f Project(const cv::Vec3f& p) const {
+		return cv::Vec2f(m_fx * p[0] / p[2] + m_cx, m_fy * p[1] / p[2] + m_cy);
+	}
+
+	inline float GetFocalLength() const { return 0.5f * (m_fx + m_fy); }
+
+private:
+	float m_fx, m_fy, m_cx, m_cy;
+};
+
+//Rigid transform from tool to camera space in mm, the same convention the tracker reports poses in
+struct IRSyntheticPose
+{
+	float R[9]{ 1, 0, 0, 0, 1, 0, 0, 0, 1 };
+	cv::Vec3f t{};
+
+	inline cv::Vec3f Apply(const cv::Vec3f& p) const {
+		return cv::Vec3f(R[0] * p[0] + R[1] * p[1] + R[2] * p[2] + t[0],
+			R[3] * p[0] + R[4] * p[1] + R[5] * p[2] + t[1],
+			R[6] * p[0] + R[7] * p[1] + R[8] * p[2] + t[2]);
+	}
+	//Quaternion (x, y, z, w) in the same convention as IRToolTracker::GetToolTransform
+	cv::Vec4f Quaternion() const;
+};
+
+struct IRSyntheticTool
+{
+	std::string identifier;
+	cv::Mat3f spheres;
+	float sphere_radius{ 6.5f };
+	uint32_t min_visible_spheres{ 3 };
+};
+
+struct IRSyntheticSceneConfig
+{
+	uint32_t width{ 512 };
+	uint32_t height{ 512 };
+	//Tool placement
+	float min_depth{ 250.f };
+	float max_depth{ 550.f };
+	float max_tilt_degrees{ 50.f };
+	//Fraction of the sphere silhouette that shows up as a bright reflection
+	float reflection_fraction{ 0.8f };
+	//Sensor noise
+	float depth_noise_mm{ 1.f };
+	uint16_t background_ab{ 300 };
+	uint16_t background_ab_noise{ 200 };
+	uint16_t sphere_ab{ 3000 };
+	uint16_t background_depth{ 1200 };
+	//Probability that a sphere is fully occluded / cut in half by an occluder
+	float sphere_occlusion{ 0.f };
+	float partial_occlusion{ 0.f };
+	//Probability that a single bright pixel drops out
+	float pixel_dropout{ 0.f };
+	//Spurious reflections
+	uint32_t num_distractors{ 0 };
+	float distractor_min_radius_px{ 1.8f };
+	float distractor_max_radius_px{ 7.f };
+};
+
+//Renders registered tool geometries at known poses into synthetic AB and depth frames
+class IRSyntheticScene
+{
+public:
+	IRSyntheticScene(const IRSyntheticSceneConfig& config, uint32_t seed = 1);
+
+	//Random marker layout with num_spheres spheres inside a disk of max_extent mm, all sides at least min_side mm long
+	cv::Mat3f RandomToolGeometry(uint32_t num_spheres, float min_side = 20.f, float max_extent = 120.f);
+
+	//Random poses facing the camera, spread so that the tools overlap as little as possible in the image
+	std::vector<IRSyntheticPose> RandomPoses(const std::vector<IRSyntheticTool>& tools);
+
+	//Moves every pose by its own velocity of speed_mm per frame and spins it by spin_degrees per frame around the viewing
+	//axis, velocities change direction slowly and tools bounce off the edges of the view and the depth range
+	void MovePoses(std::vector<IRSyntheticPose>& poses, float speed_mm, float spin_degrees);
+
+	//Renders one frame, visible[i][j] reports whether sphere j of tool i was rendered at all
+	void Render(const std::vector<IRSyntheticTool>& tools, const std::vector<IRSyntheticPose>& poses,
+		uint16_t* pAbImage, uint16_t* pDepth, std::vector<std::vector<bool>>* visible = nullptr);
+
+	inline IRPinholeIntrinsics& GetIntrinsics() { return m_Intrinsics; }
+	inline const IRSyntheticSceneConfig& GetConfig() const { return m_Config; }
+
+private:
+	void RenderDisk(cv::Vec2f center, float radius_px, float depth, bool cut, float cut_angle,
+		uint16_t* pAbImage, uint16_t* pDepth, std::vector<float>& zbuffer);
+
+	IRSyntheticSceneConfig m_Config;
+	IRPinholeIntrinsics m_Intrinsics;
+	std::mt19937 m_Rng;
+	//Per tool velocity of MovePoses
+	std::vector<cv::Vec3f> m_Velocities;
+	std::vector<float> m_Spins;
+};
@@ -0,0 +1,87 @@
+// AB threshold kernel benchmark: checks that the vectorized IRThresholdAbImage produces the same mask as the scalar
+// reference bit for bit and times both against the forEach + convertTo implementation ProcessFrame used before.
+//
+// usage: IRThresholdBench [--iterations N] [--width N] [--height N] [--seed N]
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <numeric>
+#include <random>
+#include <vector>
+
+#include <opencv2/core.hpp>
+
+#include "IRThreshold.h"
+#include "IRBenchUtil.h"
+
+int main(int argc, char** argv)
+{
+	int iterations = 500;
+	int width = 512, height = 512;
+	uint32_t seed = 1;
+	for (int i = 1; i < argc; i++) {
+		bool has_value = i + 1 < argc;
+		if (strcmp(argv[i], "--iterations") == 0 && has_value) iterations = std::max(1, atoi(argv[++i]));
+		else if (strcmp(argv[i], "--width") == 0 && has_value) width = atoi(argv[++i]);
+		else if (strcmp(argv[i], "--height") == 0 && has_value) height = atoi(argv[++i]);
+		else if (strcmp(argv[i], "--seed") == 0 && has_value) seed = static_cast<uint32_t>(atoi(argv[++i]));
+		else {
+			printf("unknown argument %s\n", argv[i]);
+			return 1;
+		}
+	}
+
+	const uint16_t lowerLimit = 256 * 5;
+	const uint16_t upperLimit = lowerLimit + 1;
+	size_t count = size_t(width) * height;
+
+	//Mostly values around the threshold, plus the ends of the range
+	std::mt19937 rng(seed);
+	std::uniform_int_distribution<int> near(lowerLimit - 4, upperLimit + 4);
+	std::uniform_int_distribution<int> any(0, 65535);
+	std::vector<uint16_t> ab(count);
+	for (size_t i = 0; i < count; i++)
+		ab[i] = static_cast<uint16_t>(i % 3 == 0 ? any(rng) : near(rng));
+	ab[0] = 0;
+	ab[count - 1] = 65535;
+
+	//Bit exactness, also for odd lengths and unaligned starts that exercise the scalar tail
+	std::vector<uint8_t> reference(count), kernel(count);
+	size_t mismatches = 0;
+	for (uint16_t threshold : { (uint16_t)0, (uint16_t)1, upperLimit, (uint16_t)32768, (uint16_t)65535 }) {
+		IRThresholdAbImageReference(ab.data(), reference.data(), count, threshold);
+		IRThresholdAbImage(ab.data(), kernel.data(), count, threshold);
+		mismatches += count - std::inner_product(reference.begin(), reference.end(), kernel.begin(), size_t(0), std::plus<size_t>(), std::equal_to<uint8_t>());
+	}
+	for (size_t offset = 1; offset < 40; offset += 3) {
+		size_t length = std::min(count - offset, size_t(1000) + offset);
+		IRThresholdAbImageReference(ab.data() + offset, reference.data(), length, upperLimit);
+		IRThresholdAbImage(ab.data() + offset, kernel.data(), length, upperLimit);
+		mismatches += length - std::inner_product(reference.begin(), reference.begin() + length, kernel.begin(), size_t(0), std::plus<size_t>(), std::equal_to<uint8_t>());
+	}
+
+	//Previous ProcessFrame implementation, in place on a copy of the AB image
+	cv::Mat ab_image(height, width, CV_16UC1, ab.data());
+	cv::Mat legacy;
+	double legacy_us = TimeUs(iterations, [&]() {
+		legacy.forEach<ushort>(
+			[&](ushort& ir, const int*) -> void {
+				ir = (std::clamp(ir, lowerLimit, upperLimit) - lowerLimit) / (upperLimit - lowerLimit) * 255;
+			}
+		);
+		legacy.convertTo(legacy, CV_8UC1);
+	}, [&]() { legacy = ab_image.clone(); });
+	IRThresholdAbImage(ab.data(), kernel.data(), count, upperLimit);
+	mismatches += memcmp(legacy.ptr<uint8_t>(), kernel.data(), count) != 0 ? 1 : 0;
+
+	double reference_us = TimeUs(iterations, [&]() { IRThresholdAbImageReference(ab.data(), reference.data(), count, upperLimit); });
+	double kernel_us = TimeUs(iterations, [&]() { IRThresholdAbImage(ab.data(), kernel.data(), count, upperLimit); });
+
+	printf("{\"kernel\":\"%s\",\"width\":%d,\"height\":%d,\"iterations\":%d,\"bit_exact\":%s,\"mismatches\":%llu,"
+		"\"legacy_us\":%.3f,\"reference_us\":%.3f,\"kernel_us\":%.3f,\"speedup_vs_legacy\":%.2f}\n",
+		IRThresholdKernelName(), width, height, iterations, mismatches == 0 ? "true" : "false", (unsigned long long)mismatches,
+		legacy_us, reference_us, kernel_us, legacy_us / kernel_us);
+	return mismatches == 0 ? 0 : 1;
+}
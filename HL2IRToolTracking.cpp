@@ -210,6 +210,8 @@ namespace winrt::HL2IRToolTracking::implementation
                     continue;
                 }
                 lastTs = timestamp.HostTicks;
+                // Acquire time does not include waiting for the sensor
+                uint64_t acquireStart = IRPipelineStats::Now();
 
                 // process sensor frame
                 pDepthSensorFrame->GetResolution(&resolution);
@@ -259,6 +261,18 @@ namespace winrt::HL2IRToolTracking::implementation
 
                 winrt::Windows::Foundation::Numerics::float4x4 depthToWorld_float4x4;
                 XMStoreFloat4x4(&depthToWorld_float4x4, depthToWorld);
+                pHL2IRTracking->m_pipelineStats.RecordSince(IR_STAGE_SENSOR_ACQUIRE, acquireStart);
+
+                // ------------------------------- Session recording -------------------------------
+                {
+                    std::lock_guard<std::mutex> recordingLock(pHL2IRTracking->m_recordingMutex);
+                    if (pHL2IRTracking->m_sessionRecorder.IsOpen())
+                    {
+                        // Same layout as the pose handed to the tool tracker
+                        cv::Mat depthToWorldRecord = cv::Mat(4, 4, CV_32F, &depthToWorld_float4x4).t();
+                        pHL2IRTracking->m_sessionRecorder.AppendFrame(pAbImage, pDepth, depthToWorldRecord.ptr<float>(), pHL2IRTracking->m_latestShortDepthTimestamp);
+                    }
+                }
 
 
 
@@ -285,6 +299,7 @@ namespace winrt::HL2IRToolTracking::implementation
                     *pFloatContainer++ = depthToWorld_float4x4.m43;
                 }
 
+                uint64_t textureStart = IRPipelineStats::Now();
                 if (!pHL2IRTracking->m_LUTGenerated_short)
                 {
                     float uv[2];
@@ -324,6 +339,13 @@ namespace winrt::HL2IRToolTracking::implementation
                     memcpy(pHL2IRTracking->m_lut_short, lutTable.data(), lutTable.size() * sizeof(float));
                     pHL2IRTracking->m_lutLength_short = lutTable.size();
                     pHL2IRTracking->m_LUTGenerated_short = true;
+
+                    // Hand the tracker the unit plane version of the table, so it does not sample the sensor itself
+                    if (pHL2IRTracking->m_IRToolTracker != nullptr)
+                    {
+                        std::vector<float> unitPlaneLut = pHL2IRTracking->ShortThrowUnitPlaneLut();
+                        pHL2IRTracking->m_IRToolTracker->SetUnitPlaneLut(unitPlaneLut.data(), resolution.Width, resolution.Height);
+                    }
                 }
                 else
                 {
@@ -382,6 +404,7 @@ namespace winrt::HL2IRToolTracking::implementation
                 //OutputDebugString(std::wstring(funcoutput.begin(), funcoutput.end()).c_str());
 
                 pHL2IRTracking->m_shortAbImageTextureUpdated = true;
+                pHL2IRTracking->m_pipelineStats.RecordSince(IR_STAGE_TEXTURE_CONVERSION, textureStart);
 
 
                 
@@ -545,6 +568,17 @@ namespace winrt::HL2IRToolTracking::implementation
         return m_IRToolTracker->IsTracking();
     }
 
+    void HL2IRTracking::InitializeToolTracker()
+    {
+        m_IRToolTracker = new IRToolTracker(&m_depthIntrinsics, &m_pipelineStats);
+        // The depth sensor loop hands the table to a tracker that exists when it builds it, a later tracker gets it here
+        if (m_LUTGenerated_short && m_lutLength_short == 512 * 512 * 3)
+        {
+            std::vector<float> unitPlaneLut = ShortThrowUnitPlaneLut();
+            m_IRToolTracker->SetUnitPlaneLut(unitPlaneLut.data(), 512, 512);
+        }
+    }
+
     bool HL2IRTracking::AddToolDefinition(int sphere_count, array_view<const float> sphere_positions, float sphere_radius, hstring identifier)
     {
         return AddToolDefinition(sphere_count, sphere_positions, sphere_radius, identifier, sphere_count, 0.3f, 0.6f);
@@ -560,7 +594,7 @@ namespace winrt::HL2IRToolTracking::implementation
         if (m_IRToolTracker == nullptr)
         {
             OutputDebugString(L"On Device Tracking First Initialization\n");
-            m_IRToolTracker = new IRToolTracker(this);
+            InitializeToolTracker();
         }
         //Minimum required spheres for a tool is 3
         if (sphere_count < 3) {
@@ -599,7 +633,7 @@ namespace winrt::HL2IRToolTracking::implementation
         if (m_IRToolTracker == nullptr)
         {
             OutputDebugString(L"On Device Tracking First Initialization\n");
-            m_IRToolTracker = new IRToolTracker(this);
+            InitializeToolTracker();
         }
         //Start the depth camera
         StartDepthSensorLoop();
@@ -640,6 +674,13 @@ namespace winrt::HL2IRToolTracking::implementation
         return tempBuffer;
     }
 
+    float HL2IRTracking::GetToolBranchingFactor(hstring identifier)
+    {
+        if (m_IRToolTracker == nullptr)
+            return 0.f;
+        return m_IRToolTracker->GetToolBranchingFactor(to_string(identifier));
+    }
+
     float* HL2IRTracking::EncodeXMFloat4x4(XMFLOAT4X4 mat)
     {
         //Create Quaternion
@@ -715,4 +756,74 @@ namespace winrt::HL2IRToolTracking::implementation
         }
         return SUCCEEDED(m_pDepthCameraSensor->MapImagePointToCameraUnitPlane(uv, xy));
     }
+
+    bool HL2IRTracking::StartSessionRecording(hstring path)
+    {
+        if (!m_pDepthCameraSensor) InitializeDepthSensor();
+
+        std::vector<IRToolDefinition> tools;
+        if (m_IRToolTracker != nullptr)
+        {
+            tools = m_IRToolTracker->GetToolDefinitions();
+        }
+
+        // AHAT frames are always 512x512. The table is built before taking the recording lock, the depth sensor loop
+        // takes it for every frame and sampling the sensor makes one call per pixel
+        IRLutCameraIntrinsics lut;
+        if (m_LUTGenerated_short && m_lutLength_short == 512 * 512 * 3)
+        {
+            std::vector<float> unitPlaneLut = ShortThrowUnitPlaneLut();
+            lut = IRLutCameraIntrinsics(unitPlaneLut.data(), 512, 512);
+        }
+        else
+        {
+            lut = IRLutCameraIntrinsics::Sample(m_depthIntrinsics, 512, 512);
+        }
+
+        std::lock_guard<std::mutex> l(m_recordingMutex);
+        if (!m_sessionRecorder.Open(to_string(path), 512, 512, lut, tools))
+        {
+            OutputDebugString(L"Could not open session recording\n");
+            return false;
+        }
+        OutputDebugString(L"Session recording started\n");
+        return true;
+    }
+
+    std::vector<float> HL2IRTracking::ShortThrowUnitPlaneLut()
+    {
+        size_t numPixels = size_t(m_lutLength_short) / 3;
+        std::vector<float> unitPlaneLut(numPixels * 2);
+        for (size_t i = 0; i < numPixels; i++)
+        {
+            const float* ray = m_lut_short + i * 3;
+            // Pixels that could not be mapped have z = 0
+            unitPlaneLut[i * 2] = ray[2] > 0.f ? ray[0] / ray[2] : 0.f;
+            unitPlaneLut[i * 2 + 1] = ray[2] > 0.f ? ray[1] / ray[2] : 0.f;
+        }
+        return unitPlaneLut;
+    }
+
+    void HL2IRTracking::StopSessionRecording()
+    {
+        std::lock_guard<std::mutex> l(m_recordingMutex);
+        m_sessionRecorder.Close();
+    }
+
+    bool HL2IRTracking::IsRecordingSession()
+    {
+        std::lock_guard<std::mutex> l(m_recordingMutex);
+        return m_sessionRecorder.IsOpen();
+    }
+
+    com_array<float> HL2IRTracking::GetPipelineStats()
+    {
+        std::vector<float> summary = m_pipelineStats.Summary();
+        return com_array<float>(summary.begin(), summary.end());
+    }
+
+    bool ResearchModeDepthIntrinsics::MapImagePointToCameraUnitPlane(float(&uv)[2], float(&xy)[2])
+    {
+        return m_pResearchMode->DepthMapImagePointToCameraUnitPlane(uv, xy);
+    }
 }
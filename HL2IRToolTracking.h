@@ -30,9 +30,25 @@
 #include <Eigen/Eigen>
 
 #include "IRToolTrack.h"
+#include "IRCameraIntrinsics.h"
+#include "IRSessionRecording.h"
+#include "IRPipelineStats.h"
 
 namespace winrt::HL2IRToolTracking::implementation
 {
+    struct HL2IRTracking;
+
+    // Camera model of the AHAT sensor, forwards to the research mode API for the tracker
+    class ResearchModeDepthIntrinsics : public IRCameraIntrinsics
+    {
+    public:
+        ResearchModeDepthIntrinsics(HL2IRTracking* pResearchMode) : m_pResearchMode(pResearchMode) {}
+        bool MapImagePointToCameraUnitPlane(float(&uv)[2], float(&xy)[2]) override;
+
+    private:
+        HL2IRTracking* m_pResearchMode;
+    };
+
     struct HL2IRTracking : HL2IRTrackingT<HL2IRTracking>
     {
 
@@ -88,6 +104,7 @@ namespace winrt::HL2IRToolTracking::implementation
         void StopToolTracking();
 
         com_array<float> GetToolTransform(hstring identifier);
+        float GetToolBranchingFactor(hstring identifier);
         com_array<float> GetDepthToWorldTransform();
         com_array<uint8_t> GetShortAbImageTextureBuffer();
         com_array<uint8_t> GetDepthMapTextureBuffer();
@@ -95,6 +112,14 @@ namespace winrt::HL2IRToolTracking::implementation
         bool ShortAbImageTextureUpdated();
         bool DepthMapImagePointToCameraUnitPlane(float (&uv)[2], float (&xy)[2]);
 
+        //Raw AHAT session recording for offline replay
+        bool StartSessionRecording(hstring path);
+        void StopSessionRecording();
+        bool IsRecordingSession();
+
+        //Per stage latency statistics, see IRPipelineStats::Summary for the layout
+        com_array<float> GetPipelineStats();
+
     private:
         float* m_lut_short = nullptr;
         int m_lutLength_short = 0;
@@ -130,6 +155,10 @@ namespace winrt::HL2IRToolTracking::implementation
 
 
         static void DepthSensorLoop(HL2IRTracking* pHL2IRTracking);
+        //Unit plane xy of every short throw pixel (see IRLutCameraIntrinsics), only once m_LUTGenerated_short is set
+        std::vector<float> ShortThrowUnitPlaneLut();
+        //Creates m_IRToolTracker, with the unit plane lut if the short throw table exists already
+        void InitializeToolTracker();
         static void CamAccessOnComplete(ResearchModeSensorConsent consent);
         static void ImuAccessOnComplete(ResearchModeSensorConsent consent);
         std::string MatrixToString(DirectX::XMFLOAT4X4 mat);
@@ -161,6 +190,10 @@ namespace winrt::HL2IRToolTracking::implementation
         
         long long m_latestShortDepthTimestamp = 0;
 
+        ResearchModeDepthIntrinsics m_depthIntrinsics{ this };
+        IRPipelineStats m_pipelineStats;
+        IRSessionRecorder m_sessionRecorder;
+        std::mutex m_recordingMutex;
         IRToolTracker* m_IRToolTracker = nullptr;
         long long m_latestTrackedFrame = 0;
     };
@@ -0,0 +1,63 @@
+#pragma once
+
+#include <cstdint>
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+/*
+ * Bit helpers for the sphere correspondence search.
+ *
+ * Sets of tool spheres fit into one 64 bit mask (see kMaxToolSpheres), sets of frame spheres into an IRNodeSet of
+ * fixed width. Membership is a single bit test and the elements of a set are visited in ascending order by
+ * repeatedly taking the lowest set bit.
+ */
+
+//Index of the lowest set bit, value must not be 0
+static inline uint32_t IRLowestBit(uint64_t value)
+{
+#if defined(_MSC_VER)
+	unsigned long index;
+	_BitScanForward64(&index, value);
+	return static_cast<uint32_t>(index);
+#else
+	return static_cast<uint32_t>(__builtin_ctzll(value));
+#endif
+}
+
+static inline uint32_t IRBitCount(uint64_t value)
+{
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+	return static_cast<uint32_t>(__popcnt64(value));
+#elif defined(_MSC_VER)
+	//ARM64 has no __popcnt64
+	value = value - ((value >> 1) & 0x5555555555555555ull);
+	value = (value & 0x3333333333333333ull) + ((value >> 2) & 0x3333333333333333ull);
+	value = (value + (value >> 4)) & 0x0F0F0F0F0F0F0F0Full;
+	return static_cast<uint32_t>((value * 0x0101010101010101ull) >> 56);
+#else
+	return static_cast<uint32_t>(__builtin_popcountll(value));
+#endif
+}
+
+//Mask of the bits [0, count), count at most 64
+static inline uint64_t IRLowBits(uint32_t count)
+{
+	return count >= 64 ? ~0ull : (1ull << count) - 1;
+}
+
+//Fixed size set of node ids [0, Bits)
+template<uint32_t Bits>
+struct IRNodeSet
+{
+	static constexpr uint32_t kWords = (Bits + 63) / 64;
+	uint64_t words[kWords];
+
+	inline void Clear() {
+		for (uint32_t w = 0; w < kWords; w++)
+			words[w] = 0;
+	}
+	inline void Insert(uint32_t id) { words[id >> 6] |= 1ull << (id & 63); }
+	inline bool Contains(uint32_t id) const { return (words[id >> 6] >> (id & 63)) & 1; }
+};
@@ -0,0 +1,40 @@
+#include "IRBlobGrid.h"
+
+void IRBlobGrid::Build(const cv::Mat3f& spheres_xyd, float cell_size)
+{
+	int num_blobs = spheres_xyd.rows;
+	m_iCols = m_iRows = 0;
+	if (num_blobs == 0 || !(cell_size > 0.f))
+		return;
+
+	float max_x, max_y;
+	m_fMinX = max_x = spheres_xyd.at<cv::Vec3f>(0, 0)[0];
+	m_fMinY = max_y = spheres_xyd.at<cv::Vec3f>(0, 0)[1];
+	for (int i = 1; i < num_blobs; i++) {
+		const cv::Vec3f& xyd = spheres_xyd.at<cv::Vec3f>(i, 0);
+		m_fMinX = std::min(m_fMinX, xyd[0]);
+		max_x = std::max(max_x, xyd[0]);
+		m_fMinY = std::min(m_fMinY, xyd[1]);
+		max_y = std::max(max_y, xyd[1]);
+	}
+	m_fCellSize = std::max(cell_size, std::max(max_x - m_fMinX, max_y - m_fMinY) / (kMaxCells - 1));
+	m_iCols = Cell(max_x, m_fMinX) + 1;
+	m_iRows = Cell(max_y, m_fMinY) + 1;
+
+	//Counting sort of the blobs by cell: count, sum up to the end of every cell, then fill every cell from its end
+	int num_cells = m_iCols * m_iRows;
+	m_CellStart.assign(size_t(num_cells) + 1, 0);
+	m_BlobCells.resize(num_blobs);
+	for (int i = 0; i < num_blobs; i++) {
+		const cv::Vec3f& xyd = spheres_xyd.at<cv::Vec3f>(i, 0);
+		int cell = Cell(xyd[1], m_fMinY) * m_iCols + Cell(xyd[0], m_fMinX);
+		m_BlobCells[i] = cell;
+		m_CellStart[cell]++;
+	}
+	for (int cell = 1; cell < num_cells; cell++)
+		m_CellStart[cell] += m_CellStart[cell - 1];
+	m_CellStart[num_cells] = num_blobs;
+	m_Ids.resize(num_blobs);
+	for (int i = num_blobs - 1; i >= 0; i--)
+		m_Ids[--m_CellStart[m_BlobCells[i]]] = i;
+}
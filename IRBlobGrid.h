@@ -0,0 +1,56 @@
+#pragma once
+
+#include <vector>
+#include <cmath>
+#include <algorithm>
+
+#include <opencv2/core.hpp>
+
+/*
+ * Uniform grid over the unit plane positions of a frame's blobs (the xy of ProcessedAHATFrame::spheres_xyd).
+ *
+ * The blob ids are stored sorted by cell, with the first id of every cell in a prefix sum, so building the grid is a
+ * counting sort and a query only visits the blobs in the cells overlapping its square. Used to find the blobs close to
+ * where a tool's blobs were in the previous frame without looking at every blob of the frame.
+ */
+class IRBlobGrid
+{
+public:
+	//cell_size in unit plane coordinates, grown if the blobs would need more than kMaxCells cells per axis
+	void Build(const cv::Mat3f& spheres_xyd, float cell_size);
+
+	//Calls visit(id) for every blob in the cells overlapping the square of half width radius around x, y.
+	//Blobs further than radius away may be visited too.
+	template<typename Visit>
+	void ForEachNear(float x, float y, float radius, Visit visit) const
+	{
+		if (m_iCols == 0)
+			return;
+		int col_begin = std::max(0, Cell(x - radius, m_fMinX));
+		int col_end = std::min(m_iCols - 1, Cell(x + radius, m_fMinX));
+		int row_begin = std::max(0, Cell(y - radius, m_fMinY));
+		int row_end = std::min(m_iRows - 1, Cell(y + radius, m_fMinY));
+		for (int row = row_begin; row <= row_end; row++) {
+			for (int cell = row * m_iCols + col_begin; cell <= row * m_iCols + col_end; cell++) {
+				for (int i = m_CellStart[cell]; i < m_CellStart[cell + 1]; i++)
+					visit(m_Ids[i]);
+			}
+		}
+	}
+
+	static constexpr int kMaxCells = 128;
+
+private:
+	inline int Cell(float value, float min) const {
+		//Clamp before converting, far away queries would overflow the int
+		return static_cast<int>(std::floor(std::min(std::max((value - min) / m_fCellSize, -1.f), float(kMaxCells))));
+	}
+
+	float m_fCellSize{ 1.f };
+	float m_fMinX{ 0.f }, m_fMinY{ 0.f };
+	int m_iCols{ 0 }, m_iRows{ 0 };
+	//Blobs of cell c are m_Ids[m_CellStart[c]] to m_Ids[m_CellStart[c + 1] - 1]
+	std::vector<int> m_CellStart;
+	std::vector<int> m_Ids;
+	std::vector<int> m_BlobCells;
+};
@@ -0,0 +1,122 @@
+#include "IRBlobLabeller.h"
+
+#include <algorithm>
+#include <cstring>
+
+const std::vector<IRBlob>& IRBlobLabeller::Label(const cv::Mat& mask)
+{
+	return Label(mask.ptr<uint8_t>(), mask.cols, mask.rows, static_cast<size_t>(mask.step));
+}
+
+const std::vector<IRBlob>& IRBlobLabeller::Label(const uint8_t* pMask, int width, int height, size_t stride)
+{
+	m_Runs.clear();
+	m_Parents.clear();
+	m_Blobs.clear();
+
+	int prev_begin = 0, prev_end = 0;
+	for (int y = 0; y < height; y++) {
+		const uint8_t* row = pMask + y * stride;
+		int cur_begin = static_cast<int>(m_Runs.size());
+
+		//Collect the runs of this row, the mask is mostly empty so skip 8 background pixels at a time
+		int x = 0;
+		while (x < width) {
+			while (x + 8 <= width) {
+				uint64_t word;
+				memcpy(&word, row + x, sizeof(word));
+				if (word != 0)
+					break;
+				x += 8;
+			}
+			while (x < width && row[x] == 0)
+				x++;
+			if (x >= width)
+				break;
+			int start = x;
+			while (x < width && row[x] != 0)
+				x++;
+			m_Parents.push_back(static_cast<int>(m_Runs.size()));
+			m_Runs.push_back(Run{ y, start, x });
+		}
+		int cur_end = static_cast<int>(m_Runs.size());
+
+		//Merge with the runs of the previous row that touch including diagonals, both lists are sorted by x
+		if (prev_end > prev_begin && m_Runs[prev_begin].y == y - 1) {
+			int p = prev_begin;
+			for (int r = cur_begin; r < cur_end; r++) {
+				const Run& run = m_Runs[r];
+				while (p < prev_end && m_Runs[p].end < run.start)
+					p++;
+				for (int q = p; q < prev_end && m_Runs[q].start <= run.end; q++) {
+					int a = FindRoot(q);
+					int b = FindRoot(r);
+					//The earlier run stays the root, so roots are the first run of their component in raster order
+					if (a < b)
+						m_Parents[b] = a;
+					else if (b < a)
+						m_Parents[a] = b;
+				}
+			}
+		}
+		if (cur_end > cur_begin) {
+			prev_begin = cur_begin;
+			prev_end = cur_end;
+		}
+	}
+
+	//Sum up the runs per component, every root comes before the other runs of its component
+	size_t num_runs = m_Runs.size();
+	m_BlobIndex.resize(num_runs);
+	m_SumX.clear();
+	m_SumY.clear();
+	m_Right.clear();
+	m_Bottom.clear();
+	for (size_t i = 0; i < num_runs; i++) {
+		const Run& run = m_Runs[i];
+		int root = FindRoot(static_cast<int>(i));
+		int length = run.end - run.start;
+		if (root == static_cast<int>(i)) {
+			m_BlobIndex[i] = static_cast<int>(m_Blobs.size());
+			IRBlob blob;
+			blob.left = run.start;
+			blob.top = run.y;
+			m_Blobs.push_back(blob);
+			m_SumX.push_back(0);
+			m_SumY.push_back(0);
+			m_Right.push_back(run.end - 1);
+			m_Bottom.push_back(run.y);
+		}
+		int index = m_BlobIndex[root];
+		IRBlob& blob = m_Blobs[index];
+		blob.area += length;
+		blob.left = std::min(blob.left, run.start);
+		m_Right[index] = std::max(m_Right[index], run.end - 1);
+		m_Bottom[index] = run.y;
+		m_SumX[index] += static_cast<int64_t>(length) * (run.start + run.end - 1) / 2;
+		m_SumY[index] += static_cast<int64_t>(length) * run.y;
+	}
+
+	for (size_t i = 0; i < m_Blobs.size(); i++) {
+		IRBlob& blob = m_Blobs[i];
+		blob.width = m_Right[i] - blob.left + 1;
+		blob.height = m_Bottom[i] - blob.top + 1;
+		blob.centroid_x = static_cast<double>(m_SumX[i]) / blob.area;
+		blob.centroid_y = static_cast<double>(m_SumY[i]) / blob.area;
+	}
+	return m_Blobs;
+}
+
+int IRBlobLabeller::FindRoot(int run)
+{
+	int root = run;
+	while (m_Parents[root] != root)
+		root = m_Parents[root];
+	//Path compression
+	while (m_Parents[run] != root) {
+		int next = m_Parents[run];
+		m_Parents[run] = root;
+		run = next;
+	}
+	return root;
+}
@@ -0,0 +1,57 @@
+#pragma once
+
+#include <vector>
+#include <cstdint>
+
+#include <opencv2/core.hpp>
+
+//Statistics of one 8-connected component, same values as cv::connectedComponentsWithStats reports
+struct IRBlob
+{
+	int left{ 0 };
+	int top{ 0 };
+	int width{ 0 };
+	int height{ 0 };
+	int area{ 0 };
+	double centroid_x{ 0 };
+	double centroid_y{ 0 };
+};
+
+/*
+ * Sparse connected component labelling of the threshold mask.
+ *
+ * Every row is scanned into runs of foreground pixels (skipping empty 8 pixel words at once), runs that touch a
+ * run of the previous row (8-connectivity) are merged with union-find, and area, bounding box and centroid are
+ * accumulated per run and summed per component. Only the runs are stored, no full size label image is written.
+ * Blobs are returned in raster order of their first pixel, components of the background are not reported.
+ * The buffers are kept between calls, so labelling does not allocate once they have grown to the frame's needs.
+ */
+class IRBlobLabeller
+{
+public:
+	//Labels the non zero pixels of an 8 bit mask
+	const std::vector<IRBlob>& Label(const cv::Mat& mask);
+
+	const std::vector<IRBlob>& Label(const uint8_t* pMask, int width, int height, size_t stride);
+
+	inline const std::vector<IRBlob>& GetBlobs() const { return m_Blobs; }
+
+private:
+	struct Run
+	{
+		int y;
+		int start;	//First pixel
+		int end;	//One past the last pixel
+	};
+
+	int FindRoot(int run);
+
+	std::vector<Run> m_Runs;
+	std::vector<int> m_Parents;
+	std::vector<IRBlob> m_Blobs;
+	std::vector<int64_t> m_SumX;
+	std::vector<int64_t> m_SumY;
+	std::vector<int> m_Right;
+	std::vector<int> m_Bottom;
+	std::vector<int> m_BlobIndex;
+};
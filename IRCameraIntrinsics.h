@@ -0,0 +1,92 @@
+#pragma once
+
+#include <vector>
+#include <cstdint>
+#include <cmath>
+#include <algorithm>
+
+//Camera model of the AHAT depth sensor as seen by the tracker.
+//On the HoloLens this forwards to the research mode sensor, offline it can be backed by a recorded or synthetic model.
+class IRCameraIntrinsics
+{
+public:
+	virtual ~IRCameraIntrinsics() = default;
+
+	//Maps a depth image point (pixel centers at +0.5) onto the camera unit plane (z = 1)
+	virtual bool MapImagePointToCameraUnitPlane(float(&uv)[2], float(&xy)[2]) = 0;
+};
+
+//Camera model backed by a per pixel unit plane lookup table, sub-pixel points are bilinearly interpolated
+class IRLutCameraIntrinsics : public IRCameraIntrinsics
+{
+public:
+	IRLutCameraIntrinsics() = default;
+
+	IRLutCameraIntrinsics(const float* lut_xy, uint32_t width, uint32_t height) {
+		SetLut(lut_xy, width, height);
+	}
+
+	//Samples another camera model at every pixel center, pixels that cannot be mapped end up at (0, 0)
+	static IRLutCameraIntrinsics Sample(IRCameraIntrinsics& intrinsics, uint32_t width, uint32_t height) {
+		IRLutCameraIntrinsics result;
+		result.m_iWidth = width;
+		result.m_iHeight = height;
+		result.m_Lut.resize(size_t(width) * height * 2);
+		float* pLut = result.m_Lut.data();
+		for (uint32_t y = 0; y < height; y++) {
+			for (uint32_t x = 0; x < width; x++) {
+				float uv[2] = { x + 0.5f, y + 0.5f };
+				float xy[2] = { 0.f, 0.f };
+				if (!intrinsics.MapImagePointToCameraUnitPlane(uv, xy)) {
+					xy[0] = 0.f;
+					xy[1] = 0.f;
+				}
+				*pLut++ = xy[0];
+				*pLut++ = xy[1];
+			}
+		}
+		return result;
+	}
+
+	void SetLut(const float* lut_xy, uint32_t width, uint32_t height) {
+		m_iWidth = width;
+		m_iHeight = height;
+		m_Lut.assign(lut_xy, lut_xy + size_t(width) * height * 2);
+	}
+
+	bool MapImagePointToCameraUnitPlane(float(&uv)[2], float(&xy)[2]) override {
+		if (m_Lut.empty())
+			return false;
+		Interpolate(uv[0], uv[1], xy);
+		return true;
+	}
+
+	//Same as MapImagePointToCameraUnitPlane without the virtual call, the table must not be empty
+	inline void Interpolate(float image_u, float image_v, float(&xy)[2]) const {
+		//Lut entries are stored at pixel centers
+		float u = std::clamp(image_u - 0.5f, 0.f, float(m_iWidth - 1));
+		float v = std::clamp(image_v - 0.5f, 0.f, float(m_iHeight - 1));
+		uint32_t x0 = std::min(uint32_t(u), m_iWidth - 2);
+		uint32_t y0 = std::min(uint32_t(v), m_iHeight - 2);
+		float fx = u - x0;
+		float fy = v - y0;
+		const float* p00 = &m_Lut[(size_t(y0) * m_iWidth + x0) * 2];
+		const float* p10 = p00 + 2;
+		const float* p01 = p00 + size_t(m_iWidth) * 2;
+		const float* p11 = p01 + 2;
+		for (int i = 0; i < 2; i++) {
+			float top = p00[i] + (p10[i] - p00[i]) * fx;
+			float bottom = p01[i] + (p11[i] - p01[i]) * fx;
+			xy[i] = top + (bottom - top) * fy;
+		}
+	}
+
+	inline const float* GetLut() const { return m_Lut.data(); }
+	inline uint32_t GetWidth() const { return m_iWidth; }
+	inline uint32_t GetHeight() const { return m_iHeight; }
+
+private:
+	std::vector<float> m_Lut;
+	uint32_t m_iWidth = 0;
+	uint32_t m_iHeight = 0;
+};
@@ -0,0 +1,113 @@
+#include "IRDistanceMap.h"
+
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+
+#if defined(__aarch64__) || defined(_M_ARM64)
+#define IR_DISTANCE_NEON 1
+#include <arm_neon.h>
+#elif defined(__AVX__)
+#define IR_DISTANCE_AVX 1
+#include <immintrin.h>
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define IR_DISTANCE_SSE2 1
+#include <emmintrin.h>
+#endif
+
+void IRDistanceMatrix(const float* x, const float* y, const float* z, int count, float* map, size_t map_step)
+{
+	for (int i = 0; i < count; i++) {
+		float* row = map + i * map_step;
+		row[i] = 0.f;
+		int j = i + 1;
+#if IR_DISTANCE_NEON
+		const float32x4_t xi = vdupq_n_f32(x[i]), yi = vdupq_n_f32(y[i]), zi = vdupq_n_f32(z[i]);
+		for (; j + 4 <= count; j += 4) {
+			float32x4_t dx = vsubq_f32(vld1q_f32(x + j), xi);
+			float32x4_t dy = vsubq_f32(vld1q_f32(y + j), yi);
+			float32x4_t dz = vsubq_f32(vld1q_f32(z + j), zi);
+			float32x4_t sum = vfmaq_f32(vfmaq_f32(vmulq_f32(dx, dx), dy, dy), dz, dz);
+			vst1q_f32(row + j, vsqrtq_f32(sum));
+		}
+#elif IR_DISTANCE_AVX
+		const __m256 xi = _mm256_set1_ps(x[i]), yi = _mm256_set1_ps(y[i]), zi = _mm256_set1_ps(z[i]);
+		for (; j + 8 <= count; j += 8) {
+			__m256 dx = _mm256_sub_ps(_mm256_loadu_ps(x + j), xi);
+			__m256 dy = _mm256_sub_ps(_mm256_loadu_ps(y + j), yi);
+			__m256 dz = _mm256_sub_ps(_mm256_loadu_ps(z + j), zi);
+			__m256 sum = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(dx, dx), _mm256_mul_ps(dy, dy)), _mm256_mul_ps(dz, dz));
+			_mm256_storeu_ps(row + j, _mm256_sqrt_ps(sum));
+		}
+#elif IR_DISTANCE_SSE2
+		const __m128 xi = _mm_set1_ps(x[i]), yi = _mm_set1_ps(y[i]), zi = _mm_set1_ps(z[i]);
+		for (; j + 4 <= count; j += 4) {
+			__m128 dx = _mm_sub_ps(_mm_loadu_ps(x + j), xi);
+			__m128 dy = _mm_sub_ps(_mm_loadu_ps(y + j), yi);
+			__m128 dz = _mm_sub_ps(_mm_loadu_ps(z + j), zi);
+			__m128 sum = _mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, dx), _mm_mul_ps(dy, dy)), _mm_mul_ps(dz, dz));
+			_mm_storeu_ps(row + j, _mm_sqrt_ps(sum));
+		}
+#endif
+		for (; j < count; j++) {
+			float dx = x[j] - x[i], dy = y[j] - y[i], dz = z[j] - z[i];
+			row[j] = std::sqrt(dx * dx + dy * dy + dz * dz);
+		}
+	}
+}
+
+static inline uint32_t SortKey(const Side& side)
+{
+	uint32_t key;
+	memcpy(&key, &side.distance, sizeof(key));
+	return key;
+}
+
+void IRSortSides(std::vector<Side>& sides, std::vector<Side>& scratch)
+{
+	size_t count = sides.size();
+	if (count < 2)
+		return;
+	scratch.resize(count);
+
+	//One histogram per byte of the key, counted in a single pass
+	uint32_t histograms[4][256] = {};
+	for (const Side& side : sides) {
+		uint32_t key = SortKey(side);
+		for (int pass = 0; pass < 4; pass++)
+			histograms[pass][(key >> (8 * pass)) & 0xFF]++;
+	}
+
+	Side* from = sides.data();
+	Side* to = scratch.data();
+	for (int pass = 0; pass < 4; pass++) {
+		uint32_t* histogram = histograms[pass];
+		//All keys share this byte, the pass would not move anything
+		if (histogram[(SortKey(from[0]) >> (8 * pass)) & 0xFF] == count)
+			continue;
+		uint32_t offset = 0;
+		for (int bucket = 0; bucket < 256; bucket++) {
+			uint32_t bucket_count = histogram[bucket];
+			histogram[bucket] = offset;
+			offset += bucket_count;
+		}
+		for (size_t i = 0; i < count; i++)
+			to[histogram[(SortKey(from[i]) >> (8 * pass)) & 0xFF]++] = from[i];
+		std::swap(from, to);
+	}
+	if (from != sides.data())
+		sides.swap(scratch);
+}
+
+const char* IRDistanceKernelName()
+{
+#if IR_DISTANCE_NEON
+	return "neon";
+#elif IR_DISTANCE_AVX
+	return "avx";
+#elif IR_DISTANCE_SSE2
+	return "sse2";
+#else
+	return "scalar";
+#endif
+}
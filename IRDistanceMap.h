@@ -0,0 +1,25 @@
+#pragma once
+
+#include <vector>
+#include <cstddef>
+
+#include "IRStructs.h"
+
+/*
+ * Kernels of IRToolTracker::ConstructMap.
+ *
+ * IRDistanceMatrix reads the points as separate x, y and z arrays and computes one row of the upper triangle at a
+ * time, several columns per instruction with NEON on ARM64, AVX or SSE2 on x86 depending on what the translation
+ * unit is compiled for. IRSortSides orders the sides with an LSD radix sort on the bits of their length (lengths are
+ * never negative, so the bit patterns sort like the values), which is linear in the number of sides and keeps sides
+ * of equal length in the order they were generated.
+ */
+
+//Writes the distance between points i and j to map[i * map_step + j] for all j >= i, the lower triangle is not touched
+void IRDistanceMatrix(const float* x, const float* y, const float* z, int count, float* map, size_t map_step);
+
+//Sorts sides by ascending distance, scratch is resized to the number of sides and can be kept between calls
+void IRSortSides(std::vector<Side>& sides, std::vector<Side>& scratch);
+
+//Instruction set IRDistanceMatrix was compiled for
+const char* IRDistanceKernelName();
@@ -0,0 +1,117 @@
+#pragma once
+
+#include <mutex>
+#include <condition_variable>
+#include <cstdint>
+
+#include <opencv2/core.hpp>
+
+#include "IRStructs.h"
+#include "IRPipelineStats.h"
+
+/*
+ * Triple buffer of preallocated AHAT frames shared by one producer (the sensor thread) and one consumer (the
+ * tracking thread). At any time one slot can be written, one can hold the latest complete frame and one can be
+ * processed, so the producer always finds a free slot without waiting for the tracker. Publishing a new frame
+ * while the previous one is still pending drops the older one, the tracker always gets the most recent frame.
+ * The consumer blocks in WaitRead until a frame is published, so it wakes up as soon as the frame is available.
+ * Buffers are only allocated when a slot is first used or the frame size changes.
+ */
+class IRFramePool
+{
+public:
+	static constexpr int kNumSlots = 3;
+
+	//Producer: slot to fill, nullptr if the producer already holds a slot
+	AHATFrame* AcquireWrite(uint32_t width, uint32_t height) {
+		int index = -1;
+		{
+			std::lock_guard<std::mutex> lock(m_Mutex);
+			for (int i = 0; i < kNumSlots; i++) {
+				if (m_SlotState[i] == SlotState::Free) {
+					m_SlotState[i] = SlotState::Writing;
+					index = i;
+					break;
+				}
+			}
+		}
+		if (index < 0)
+			return nullptr;
+
+		//The slot belongs to the producer now, (re)allocate outside the lock
+		AHATFrame& frame = m_Slots[index];
+		if (frame.depthWidth != width || frame.depthHeight != height || frame.pDepth == nullptr) {
+			frame.cvAbImage.create(height, width, CV_16UC1);
+			frame.cvMask.create(height, width, CV_8UC1);
+			m_DepthBuffers[index] = cv::Mat(height, width, CV_16UC1);
+			frame.pDepth = m_DepthBuffers[index].ptr<uint16_t>();
+			frame.depthWidth = width;
+			frame.depthHeight = height;
+		}
+		return &frame;
+	}
+
+	//Producer: hands a filled slot to the consumer, replacing a frame that was not picked up yet
+	void Publish(AHATFrame* frame) {
+		{
+			std::lock_guard<std::mutex> lock(m_Mutex);
+			if (m_iPending >= 0)
+				m_SlotState[m_iPending] = SlotState::Free;
+			m_iPending = SlotIndex(frame);
+			m_SlotState[m_iPending] = SlotState::Pending;
+			m_iPublishTime[m_iPending] = IRPipelineStats::Now();
+		}
+		m_Published.notify_one();
+	}
+
+	//Consumer: blocks until a frame is published, returns nullptr if woken up by Interrupt instead.
+	//pPublishTime receives the IRPipelineStats::Now() time the frame was published at.
+	AHATFrame* WaitRead(uint64_t* pPublishTime = nullptr) {
+		std::unique_lock<std::mutex> lock(m_Mutex);
+		m_Published.wait(lock, [this] { return m_iPending >= 0 || m_bInterrupted; });
+		if (m_bInterrupted) {
+			m_bInterrupted = false;
+			return nullptr;
+		}
+		return TakePending(pPublishTime);
+	}
+
+	//Wakes up a consumer blocked in WaitRead, or makes its next call return right away
+	void Interrupt() {
+		{
+			std::lock_guard<std::mutex> lock(m_Mutex);
+			m_bInterrupted = true;
+		}
+		m_Published.notify_all();
+	}
+
+	//Either side: gives a slot back without publishing it
+	void Release(AHATFrame* frame) {
+		std::lock_guard<std::mutex> lock(m_Mutex);
+		m_SlotState[SlotIndex(frame)] = SlotState::Free;
+	}
+
+private:
+	enum class SlotState { Free, Writing, Pending, Reading };
+
+	inline int SlotIndex(const AHATFrame* frame) const { return static_cast<int>(frame - m_Slots); }
+
+	//Needs m_Mutex and a pending frame
+	AHATFrame* TakePending(uint64_t* pPublishTime) {
+		int index = m_iPending;
+		m_iPending = -1;
+		m_SlotState[index] = SlotState::Reading;
+		if (pPublishTime != nullptr)
+			*pPublishTime = m_iPublishTime[index];
+		return &m_Slots[index];
+	}
+
+	AHATFrame m_Slots[kNumSlots]{};
+	cv::Mat m_DepthBuffers[kNumSlots];
+	SlotState m_SlotState[kNumSlots]{ SlotState::Free, SlotState::Free, SlotState::Free };
+	uint64_t m_iPublishTime[kNumSlots]{};
+	int m_iPending = -1;
+	bool m_bInterrupted = false;
+	std::mutex m_Mutex;
+	std::condition_variable m_Published;
+};
@@ -0,0 +1,161 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <vector>
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+/*
+ * Always on per stage latency statistics of the tracking pipeline.
+ *
+ * Every stage owns a log-linear histogram (HDR histogram style): values below 2 * kHistogramSubBuckets ns are
+ * counted exactly, above that every power of two is split into kHistogramSubBuckets buckets, which bounds the
+ * relative error of a reported percentile to 1 / kHistogramSubBuckets (~3%) over the whole range up to
+ * 2^(kHistogramMaxBits + 1) ns (~137 s). Longer values are counted in the last bucket.
+ * Recording is a handful of relaxed atomic increments so the sensor and tracking threads never block on a reader,
+ * readers take a snapshot of the counters which may be off by the samples recorded while reading.
+ */
+
+enum IRPipelineStage : uint32_t
+{
+	//HoloLens side, depth sensor thread
+	IR_STAGE_SENSOR_ACQUIRE = 0,	//Frame buffers, timestamp and depth to world pose after the sensor returned a frame
+	IR_STAGE_TEXTURE_CONVERSION,	//AB and depth preview textures
+	IR_STAGE_ADDFRAME_COPY,			//Copy of the frame handed to the tracker
+	//Tracking thread
+	IR_STAGE_HANDOFF,				//From publishing a frame in AddFrame until the tracking thread picked it up
+	IR_STAGE_THRESHOLD,
+	IR_STAGE_CCL,					//Connected components, blob filtering and unit plane mapping
+	IR_STAGE_MAP_BUILD,				//Back-projection, distance maps and start side matching for every sphere radius
+	IR_STAGE_SEARCH,				//TrackTool for all tools
+	IR_STAGE_UNION,					//UnionSegmentation without Kabsch and publish
+	IR_STAGE_KABSCH,
+	IR_STAGE_PUBLISH,				//Writing the new tool transforms
+	IR_STAGE_FRAME,					//Whole frame on the tracking thread
+	IR_STAGE_COUNT
+};
+
+constexpr uint32_t kHistogramSubBucketBits = 5;
+constexpr uint32_t kHistogramSubBuckets = 1 << kHistogramSubBucketBits;
+constexpr uint32_t kHistogramMaxBits = 36;
+constexpr uint32_t kHistogramBuckets = (kHistogramMaxBits - kHistogramSubBucketBits + 2) * kHistogramSubBuckets;
+
+//Number of values per stage returned by IRPipelineStats::Summary
+constexpr uint32_t kPipelineStatsValuesPerStage = 5;
+
+class IRLatencyHistogram
+{
+public:
+	IRLatencyHistogram() {
+		for (auto& count : m_Counts)
+			count.store(0, std::memory_order_relaxed);
+	}
+
+	inline void Record(uint64_t ns) {
+		m_Counts[BucketIndex(ns)].fetch_add(1, std::memory_order_relaxed);
+		m_iCount.fetch_add(1, std::memory_order_relaxed);
+		m_iSum.fetch_add(ns, std::memory_order_relaxed);
+		uint64_t max = m_iMax.load(std::memory_order_relaxed);
+		while (ns > max && !m_iMax.compare_exchange_weak(max, ns, std::memory_order_relaxed)) {}
+	}
+
+	inline uint64_t GetCount() const { return m_iCount.load(std::memory_order_relaxed); }
+	inline uint64_t GetMax() const { return m_iMax.load(std::memory_order_relaxed); }
+	inline double GetMean() const {
+		uint64_t count = GetCount();
+		return count == 0 ? 0.0 : static_cast<double>(m_iSum.load(std::memory_order_relaxed)) / count;
+	}
+
+	//Value in ns below which the fraction p of the samples lies, reported as the middle of its bucket
+	uint64_t GetPercentile(double p) const {
+		uint32_t counts[kHistogramBuckets];
+		uint64_t total = 0;
+		for (uint32_t i = 0; i < kHistogramBuckets; i++) {
+			counts[i] = m_Counts[i].load(std::memory_order_relaxed);
+			total += counts[i];
+		}
+		if (total == 0)
+			return 0;
+		uint64_t rank = static_cast<uint64_t>(p * (total - 1)) + 1;
+		uint64_t seen = 0;
+		for (uint32_t i = 0; i < kHistogramBuckets; i++) {
+			seen += counts[i];
+			if (seen >= rank)
+				return (BucketLowerBound(i) + BucketLowerBound(i + 1) - 1) / 2;
+		}
+		return GetMax();
+	}
+
+	static inline uint32_t BucketIndex(uint64_t ns) {
+		if (ns < 2 * kHistogramSubBuckets)
+			return static_cast<uint32_t>(ns);
+		uint32_t shift = HighestBit(ns) - kHistogramSubBucketBits;
+		uint32_t index = (shift + 1) * kHistogramSubBuckets + static_cast<uint32_t>(ns >> shift) - kHistogramSubBuckets;
+		return index < kHistogramBuckets ? index : kHistogramBuckets - 1;
+	}
+
+	static inline uint64_t BucketLowerBound(uint32_t index) {
+		if (index < 2 * kHistogramSubBuckets)
+			return index;
+		uint32_t shift = index / kHistogramSubBuckets - 1;
+		return static_cast<uint64_t>(index % kHistogramSubBuckets + kHistogramSubBuckets) << shift;
+	}
+
+private:
+	static inline uint32_t HighestBit(uint64_t value) {
+#if defined(_MSC_VER)
+		unsigned long index;
+		_BitScanReverse64(&index, value);
+		return static_cast<uint32_t>(index);
+#else
+		return 63 - static_cast<uint32_t>(__builtin_clzll(value));
+#endif
+	}
+
+	std::atomic<uint32_t> m_Counts[kHistogramBuckets];
+	std::atomic<uint64_t> m_iCount{ 0 };
+	std::atomic<uint64_t> m_iSum{ 0 };
+	std::atomic<uint64_t> m_iMax{ 0 };
+};
+
+class IRPipelineStats
+{
+public:
+	static inline uint64_t Now() {
+		return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count());
+	}
+
+	inline void Record(IRPipelineStage stage, uint64_t ns) { m_Histograms[stage].Record(ns); }
+	//Records the time passed since start, a value from Now()
+	inline void RecordSince(IRPipelineStage stage, uint64_t start) { Record(stage, Now() - start); }
+
+	inline const IRLatencyHistogram& GetHistogram(IRPipelineStage stage) const { return m_Histograms[stage]; }
+
+	static const char* GetStageName(IRPipelineStage stage) {
+		static const char* names[IR_STAGE_COUNT] = { "sensor_acquire", "texture_conversion", "addframe_copy", "handoff", "threshold", "ccl",
+			"map_build", "search", "union", "kabsch", "publish", "frame" };
+		return stage < IR_STAGE_COUNT ? names[stage] : "unknown";
+	}
+
+	//kPipelineStatsValuesPerStage values per stage in IRPipelineStage order: sample count, mean, p50, p99 and max in ms
+	std::vector<float> Summary() const {
+		std::vector<float> summary;
+		summary.reserve(IR_STAGE_COUNT * kPipelineStatsValuesPerStage);
+		for (uint32_t i = 0; i < IR_STAGE_COUNT; i++) {
+			const IRLatencyHistogram& histogram = m_Histograms[i];
+			summary.push_back(static_cast<float>(histogram.GetCount()));
+			summary.push_back(static_cast<float>(histogram.GetMean() / 1e6));
+			summary.push_back(static_cast<float>(histogram.GetPercentile(0.5) / 1e6));
+			summary.push_back(static_cast<float>(histogram.GetPercentile(0.99) / 1e6));
+			summary.push_back(static_cast<float>(histogram.GetMax() / 1e6));
+		}
+		return summary;
+	}
+
+private:
+	IRLatencyHistogram m_Histograms[IR_STAGE_COUNT];
+};
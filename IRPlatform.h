@@ -0,0 +1,22 @@
+#pragma once
+
+#include <string>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <cstdio>
+#endif
+
+//Debug output that goes to the debugger on Windows and to stderr everywhere else
+inline void IRDebugOutput(const std::string& message)
+{
+#ifdef _WIN32
+	OutputDebugStringA(message.c_str());
+#else
+	fputs(message.c_str(), stderr);
+#endif
+}
@@ -0,0 +1,188 @@
+#include "IRSearchOrder.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <numeric>
+
+//Distance between two spheres, the distance maps are only filled above the diagonal
+static inline float SideLength(const cv::Mat& map, int a, int b)
+{
+	return a < b ? map.at<float>(a, b) : map.at<float>(b, a);
+}
+
+namespace {
+	//Partial matches after a search step, each the model tool followed by the model sphere taken at every step
+	struct PartialMatches
+	{
+		int stride{ 0 };
+		std::vector<int16_t> entries;
+
+		inline size_t Count() const { return stride == 0 ? 0 : entries.size() / stride; }
+	};
+}
+
+//Model sides matching the start side, in both directions like the search tries them
+static void StartMatches(float side, const std::vector<const cv::Mat*>& models, float tolerance, PartialMatches& result)
+{
+	result.stride = 3;
+	result.entries.clear();
+	for (int m = 0; m < static_cast<int>(models.size()); m++) {
+		const cv::Mat& model = *models[m];
+		for (int p = 0; p < model.rows; p++) {
+			for (int q = p + 1; q < model.rows; q++) {
+				if (std::abs(model.at<float>(p, q) - side) > tolerance)
+					continue;
+				int16_t forward[3] = { static_cast<int16_t>(m), static_cast<int16_t>(p), static_cast<int16_t>(q) };
+				int16_t backward[3] = { static_cast<int16_t>(m), static_cast<int16_t>(q), static_cast<int16_t>(p) };
+				result.entries.insert(result.entries.end(), forward, forward + 3);
+				result.entries.insert(result.entries.end(), backward, backward + 3);
+			}
+		}
+	}
+}
+
+//Extends the partial matches of the tool spheres in order by tool sphere next, stops once limit matches are found
+static void ExtendMatches(const cv::Mat& map, const std::vector<const cv::Mat*>& models, float tolerance, const std::vector<int>& order,
+	int next, const PartialMatches& partials, size_t limit, PartialMatches& result)
+{
+	int num_steps = partials.stride - 1;
+	result.stride = partials.stride + 1;
+	result.entries.clear();
+	for (size_t i = 0; i < partials.Count() && result.Count() < limit; i++) {
+		const int16_t* partial = &partials.entries[i * partials.stride];
+		const cv::Mat& model = *models[partial[0]];
+		for (int r = 0; r < model.rows; r++) {
+			bool matches = true;
+			for (int j = 0; j < num_steps && matches; j++) {
+				int taken = partial[1 + j];
+				matches = taken != r && std::abs(SideLength(model, taken, r) - SideLength(map, order[j], next)) <= tolerance;
+			}
+			if (!matches)
+				continue;
+			result.entries.insert(result.entries.end(), partial, partial + partials.stride);
+			result.entries.push_back(static_cast<int16_t>(r));
+		}
+	}
+}
+
+IRSearchOrder IROptimizeSearchOrder(const cv::Mat& map, const std::vector<const cv::Mat*>& model_maps, float tolerance)
+{
+	IRSearchOrder best;
+	int num_spheres = map.rows;
+	best.spheres.resize(num_spheres);
+	std::iota(best.spheres.begin(), best.spheres.end(), 0);
+	if (num_spheres < 2)
+		return best;
+
+	float longest_side = 0.f;
+	for (const cv::Mat* model : model_maps) {
+		for (int p = 0; p < model->rows; p++) {
+			for (int q = p + 1; q < model->rows; q++)
+				longest_side = std::max(longest_side, model->at<float>(p, q));
+		}
+	}
+
+	//Every later step keeps at least the true correspondence, so a start side with c matches costs at least
+	//c + num_spheres - 2 and needs no greedy pass if that is not below the best cost
+	struct StartSide { int a, b; float length; size_t matches; size_t spurious; };
+	std::vector<StartSide> start_sides;
+	for (int a = 0; a < num_spheres; a++) {
+		for (int b = a + 1; b < num_spheres; b++) {
+			float length = map.at<float>(a, b);
+			size_t matches = 0;
+			for (const cv::Mat* model : model_maps) {
+				for (int p = 0; p < model->rows; p++) {
+					for (int q = p + 1; q < model->rows; q++)
+						matches += std::abs(model->at<float>(p, q) - length) <= tolerance ? 2 : 0;
+				}
+			}
+			float relative = longest_side > 0.f ? length / longest_side : 0.f;
+			size_t spurious = static_cast<size_t>(kIRSpuriousStartSides * relative * relative + 0.5f);
+			start_sides.push_back(StartSide{ a, b, length, matches, spurious });
+		}
+	}
+	//Short to long, the first start side of equal cost is kept
+	std::stable_sort(start_sides.begin(), start_sides.end(), [](const StartSide& s1, const StartSide& s2) { return s1.length < s2.length; });
+
+	size_t best_cost = std::numeric_limits<size_t>::max();
+	size_t best_total = 0;
+	std::vector<int> order;
+	PartialMatches partials, extended, best_extended;
+	for (const StartSide& side : start_sides) {
+		if (side.matches + side.spurious + num_spheres - 2 >= best_cost)
+			continue;
+		order.assign({ side.a, side.b });
+		StartMatches(side.length, model_maps, tolerance, partials);
+		size_t total = partials.Count();
+		//Greedy, an order that can no longer beat the best one is dropped
+		while (static_cast<int>(order.size()) < num_spheres && total + side.spurious < best_cost) {
+			int best_next = -1;
+			size_t best_count = best_cost - side.spurious - total;
+			for (int next = 0; next < num_spheres; next++) {
+				if (std::find(order.begin(), order.end(), next) != order.end())
+					continue;
+				ExtendMatches(map, model_maps, tolerance, order, next, partials, best_count, extended);
+				if (best_next < 0 || extended.Count() < best_count) {
+					best_next = next;
+					best_count = extended.Count();
+					std::swap(extended, best_extended);
+				}
+			}
+			order.push_back(best_next);
+			std::swap(partials, best_extended);
+			total += best_count;
+		}
+		if (static_cast<int>(order.size()) == num_spheres && total + side.spurious < best_cost) {
+			best_cost = total + side.spurious;
+			best_total = total;
+			best.spheres = order;
+		}
+	}
+	best.branching_factor = static_cast<float>(best_total) / static_cast<float>(num_spheres - 1);
+	return best;
+}
+
+//Extends the partial permutation of spheres [0, size) by every sphere that keeps the sides to all of them
+static void ExtendSymmetry(const cv::Mat& map, std::vector<int>& permutation, uint64_t used, IRToolSymmetries& result)
+{
+	int num_spheres = map.rows;
+	int size = static_cast<int>(permutation.size());
+	if (size == num_spheres) {
+		result.permutations.push_back(permutation);
+		return;
+	}
+	for (int image = 0; image < num_spheres; image++) {
+		if (used & (1ull << image))
+			continue;
+		bool keeps_sides = true;
+		for (int a = 0; a < size && keeps_sides; a++)
+			keeps_sides = std::abs(SideLength(map, a, size) - SideLength(map, permutation[a], image)) <= kIRSymmetryTolerance;
+		if (!keeps_sides)
+			continue;
+		permutation.push_back(image);
+		ExtendSymmetry(map, permutation, used | (1ull << image), result);
+		permutation.pop_back();
+	}
+}
+
+IRToolSymmetries IRFindToolSymmetries(const cv::Mat& map)
+{
+	IRToolSymmetries result;
+	int num_spheres = map.rows;
+	result.lower_spheres.assign(num_spheres, 0ull);
+	std::vector<int> permutation;
+	permutation.reserve(num_spheres);
+	ExtendSymmetry(map, permutation, 0ull, result);
+
+	for (const std::vector<int>& p : result.permutations) {
+		//The identity moves no sphere
+		int first_moved = 0;
+		while (first_moved < num_spheres && p[first_moved] == first_moved)
+			first_moved++;
+		if (first_moved < num_spheres)
+			result.lower_spheres[p[first_moved]] |= 1ull << first_moved;
+	}
+	return result;
+}
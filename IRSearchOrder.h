@@ -0,0 +1,65 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#include <opencv2/core.hpp>
+
+/*
+ * Order in which the depth first search of IRToolTracker::TrackTool visits the spheres of a tool.
+ *
+ * The search starts at the frame sides matching the side between the tool's first two spheres and then adds one tool
+ * sphere at a time, every frame sphere it takes has to match the sides to all spheres before it. How many partial
+ * matches the search goes through depends on that order: a start side with a common length is found all over the
+ * frame, a sphere whose sides only differ little from another sphere's keeps several branches alive.
+ *
+ * The order is chosen against a model frame holding the spheres of every tool of the same sphere radius. For every
+ * possible start side the remaining spheres are added greedily, always the one that the fewest partial matches of the
+ * model frame can be extended by, and the start side with the lowest cost wins: the partial matches of all steps plus
+ * an estimate of the spurious frame sides of its length, from blobs that are not tools and from spheres of different
+ * tools. The number of point pairs at a distance grows with its square, so the estimate is
+ * kIRSpuriousStartSides * (length / longest tool side)^2 and short start sides are preferred unless their length is
+ * common among the tools.
+ */
+
+//Spurious start candidates assumed for a start side as long as the longest tool side. Tuned with IRStageBench on
+//4 and 6 sphere tools among 0 to 100 spurious blobs, the search time changes little between 16 and 256.
+constexpr float kIRSpuriousStartSides = 64.f;
+
+struct IRSearchOrder
+{
+	//Index in the given distance map of the sphere visited at every search step
+	std::vector<int> spheres;
+	//Partial matches of the model frame per search step, without the spurious sides. The true correspondence alone
+	//gives 2 at the start side (it is tried in both directions) and 1 at every later step, every other match adds to it.
+	float branching_factor{ 0.f };
+};
+
+//map: distance map of the tool, filled above the diagonal. model_maps: the distance maps of all tools of its radius
+//class, including map itself. Sides within tolerance match.
+IRSearchOrder IROptimizeSearchOrder(const cv::Mat& map, const std::vector<const cv::Mat*>& model_maps, float tolerance);
+
+/*
+ * Symmetries of a tool: the permutations of its spheres that keep every side length, e.g. the rotations and mirror
+ * images of a square. A match of a symmetric tool composed with any of them is another match on the same frame spheres,
+ * the search would find every one of them and UnionSegmentation only keeps the first.
+ *
+ * Only one match per group of equivalent ones has to be found, the one whose frame spheres in tool sphere order are
+ * lexicographically smallest. A permutation p changes a match f first at its lowest moved sphere i, so f is the
+ * smallest of f and f o p exactly if f(i) < f(p(i)). The search checks this as soon as both spheres are matched.
+ */
+
+//Side lengths closer than this are the same in a symmetry. Tool definitions that are symmetric by design only differ
+//by float rounding, a tool that is symmetric within the match tolerance would lose matches its permuted version misses
+constexpr float kIRSymmetryTolerance = 1e-3f;
+
+struct IRToolSymmetries
+{
+	//Permutations keeping the side lengths including the identity, sphere a goes to permutations[p][a]
+	std::vector<std::vector<int>> permutations;
+	//Per sphere b the bit mask of spheres a < b whose frame sphere has to be lower than the frame sphere of b
+	std::vector<uint64_t> lower_spheres;
+};
+
+//map: distance map of the tool, filled above the diagonal
+IRToolSymmetries IRFindToolSymmetries(const cv::Mat& map);
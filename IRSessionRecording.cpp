@@ -0,0 +1,497 @@
+#include "IRSessionRecording.h"
+#include "IRToolTrack.h"
+
+#include <chrono>
+#include <cstring>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+static const char kRecordingMagic[8] = { 'I', 'R', 'S', 'R', 'E', 'C', '0', '1' };
+
+static inline uint64_t AlignUp(uint64_t value, uint64_t alignment)
+{
+	return (value + alignment - 1) / alignment * alignment;
+}
+
+// ------------------------------- Mapped file -------------------------------
+
+IRMappedFile::~IRMappedFile()
+{
+	Close();
+}
+
+#ifdef _WIN32
+
+static std::wstring ToWidePath(const std::string& path)
+{
+	int length = MultiByteToWideChar(CP_UTF8, 0, path.c_str(), -1, nullptr, 0);
+	std::wstring wide(length > 0 ? length - 1 : 0, L'\0');
+	if (length > 1)
+		MultiByteToWideChar(CP_UTF8, 0, path.c_str(), -1, &wide[0], length);
+	return wide;
+}
+
+bool IRMappedFile::OpenRead(const std::string& path)
+{
+	Close();
+	HANDLE hFile = CreateFile2(ToWidePath(path).c_str(), GENERIC_READ, FILE_SHARE_READ, OPEN_EXISTING, nullptr);
+	if (hFile == INVALID_HANDLE_VALUE)
+		return false;
+	LARGE_INTEGER size{};
+	if (!GetFileSizeEx(hFile, &size) || size.QuadPart == 0) {
+		CloseHandle(hFile);
+		return false;
+	}
+	HANDLE hMapping = CreateFileMappingFromApp(hFile, nullptr, PAGE_READONLY, 0, nullptr);
+	if (hMapping == nullptr) {
+		CloseHandle(hFile);
+		return false;
+	}
+	void* pView = MapViewOfFileFromApp(hMapping, FILE_MAP_READ, 0, 0);
+	if (pView == nullptr) {
+		CloseHandle(hMapping);
+		CloseHandle(hFile);
+		return false;
+	}
+	m_hFile = hFile;
+	m_hMapping = hMapping;
+	m_pView = static_cast<uint8_t*>(pView);
+	m_iViewSize = size.QuadPart;
+	m_iSize = size.QuadPart;
+	m_bWritable = false;
+	return true;
+}
+
+bool IRMappedFile::OpenWrite(const std::string& path)
+{
+	Close();
+	HANDLE hFile = CreateFile2(ToWidePath(path).c_str(), GENERIC_READ | GENERIC_WRITE, 0, CREATE_ALWAYS, nullptr);
+	if (hFile == INVALID_HANDLE_VALUE)
+		return false;
+	m_hFile = hFile;
+	m_iSize = 0;
+	m_bWritable = true;
+	return true;
+}
+
+uint8_t* IRMappedFile::MapWindow(uint64_t offset, uint64_t size)
+{
+	if (!m_bWritable || offset % kRecordingAlignment != 0)
+		return nullptr;
+	Unmap();
+	uint64_t end = offset + size;
+	if (end > m_iSize) {
+		m_iSize = end;
+	}
+	//A mapping object that is larger than the file grows the file
+	HANDLE hMapping = CreateFileMappingFromApp(m_hFile, nullptr, PAGE_READWRITE, m_iSize, nullptr);
+	if (hMapping == nullptr)
+		return nullptr;
+	void* pView = MapViewOfFileFromApp(hMapping, FILE_MAP_WRITE, offset, size);
+	if (pView == nullptr) {
+		CloseHandle(hMapping);
+		return nullptr;
+	}
+	m_hMapping = hMapping;
+	m_pView = static_cast<uint8_t*>(pView);
+	m_iViewSize = size;
+	return m_pView;
+}
+
+bool IRMappedFile::Truncate(uint64_t size)
+{
+	if (!m_bWritable)
+		return false;
+	Unmap();
+	FILE_END_OF_FILE_INFO info{};
+	info.EndOfFile.QuadPart = size;
+	m_iSize = size;
+	return SetFileInformationByHandle(m_hFile, FileEndOfFileInfo, &info, sizeof(info)) != 0;
+}
+
+void IRMappedFile::Unmap()
+{
+	if (m_pView != nullptr) {
+		if (m_bWritable)
+			FlushViewOfFile(m_pView, 0);
+		UnmapViewOfFile(m_pView);
+		m_pView = nullptr;
+		m_iViewSize = 0;
+	}
+	if (m_hMapping != nullptr) {
+		CloseHandle(m_hMapping);
+		m_hMapping = nullptr;
+	}
+}
+
+void IRMappedFile::Close()
+{
+	Unmap();
+	if (m_hFile != nullptr) {
+		CloseHandle(m_hFile);
+		m_hFile = nullptr;
+	}
+	m_iSize = 0;
+	m_bWritable = false;
+}
+
+#else
+
+bool IRMappedFile::OpenRead(const std::string& path)
+{
+	Close();
+	int fd = open(path.c_str(), O_RDONLY);
+	if (fd < 0)
+		return false;
+	struct stat st {};
+	if (fstat(fd, &st) != 0 || st.st_size == 0) {
+		close(fd);
+		return false;
+	}
+	void* pView = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	if (pView == MAP_FAILED) {
+		close(fd);
+		return false;
+	}
+	m_iFd = fd;
+	m_pView = static_cast<uint8_t*>(pView);
+	m_iViewSize = st.st_size;
+	m_iSize = st.st_size;
+	m_bWritable = false;
+	return true;
+}
+
+bool IRMappedFile::OpenWrite(const std::string& path)
+{
+	Close();
+	int fd = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0)
+		return false;
+	m_iFd = fd;
+	m_iSize = 0;
+	m_bWritable = true;
+	return true;
+}
+
+uint8_t* IRMappedFile::MapWindow(uint64_t offset, uint64_t size)
+{
+	if (!m_bWritable || offset % kRecordingAlignment != 0)
+		return nullptr;
+	Unmap();
+	uint64_t end = offset + size;
+	if (end > m_iSize) {
+		if (ftruncate(m_iFd, end) != 0)
+			return nullptr;
+		m_iSize = end;
+	}
+	void* pView = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, m_iFd, offset);
+	if (pView == MAP_FAILED)
+		return nullptr;
+	m_pView = static_cast<uint8_t*>(pView);
+	m_iViewSize = size;
+	return m_pView;
+}
+
+bool IRMappedFile::Truncate(uint64_t size)
+{
+	if (!m_bWritable)
+		return false;
+	Unmap();
+	m_iSize = size;
+	return ftruncate(m_iFd, size) == 0;
+}
+
+void IRMappedFile::Unmap()
+{
+	if (m_pView != nullptr) {
+		munmap(m_pView, m_iViewSize);
+		m_pView = nullptr;
+		m_iViewSize = 0;
+	}
+}
+
+void IRMappedFile::Close()
+{
+	Unmap();
+	if (m_iFd >= 0) {
+		close(m_iFd);
+		m_iFd = -1;
+	}
+	m_iSize = 0;
+	m_bWritable = false;
+}
+
+#endif
+
+// ------------------------------- Recorder -------------------------------
+
+bool IRSessionRecorder::Open(const std::string& path, uint32_t width, uint32_t height, const IRLutCameraIntrinsics& lut, const std::vector<IRToolDefinition>& tools)
+{
+	Close();
+	if (lut.GetWidth() != width || lut.GetHeight() != height)
+		return false;
+	if (!m_File.OpenWrite(path))
+		return false;
+
+	uint64_t image_size = uint64_t(width) * height * sizeof(uint16_t);
+	uint64_t lut_size = uint64_t(width) * height * 2 * sizeof(float);
+	uint64_t tools_size = 0;
+	for (const IRToolDefinition& tool : tools) {
+		tools_size += sizeof(IRRecordedToolHeader) + uint64_t(tool.spheres_xyz.rows) * 3 * sizeof(float);
+	}
+
+	m_Header = IRRecordingHeader{};
+	memcpy(m_Header.magic, kRecordingMagic, sizeof(kRecordingMagic));
+	m_Header.version = kRecordingVersion;
+	m_Header.width = width;
+	m_Header.height = height;
+	m_Header.frames_per_chunk = kRecordingFramesPerChunk;
+	m_Header.frame_stride = AlignUp(sizeof(IRRecordedFrameHeader) + 2 * image_size, 64);
+	m_Header.chunk_stride = AlignUp(m_Header.frame_stride * kRecordingFramesPerChunk, kRecordingAlignment);
+	m_Header.lut_offset = AlignUp(sizeof(IRRecordingHeader), 64);
+	m_Header.tools_offset = m_Header.lut_offset + lut_size;
+	m_Header.num_tools = static_cast<uint32_t>(tools.size());
+	m_Header.first_chunk_offset = AlignUp(m_Header.tools_offset + tools_size, kRecordingAlignment);
+	m_Header.frame_count = 0;
+
+	uint8_t* pHeader = m_File.MapWindow(0, m_Header.first_chunk_offset);
+	if (pHeader == nullptr) {
+		m_File.Close();
+		return false;
+	}
+	memcpy(pHeader, &m_Header, sizeof(m_Header));
+
+	memcpy(pHeader + m_Header.lut_offset, lut.GetLut(), lut_size);
+
+	uint8_t* pTool = pHeader + m_Header.tools_offset;
+	for (const IRToolDefinition& tool : tools) {
+		uint num_spheres = static_cast<uint>(tool.spheres_xyz.rows);
+		IRRecordedToolHeader tool_header{};
+		strncpy(tool_header.identifier, tool.identifier.c_str(), sizeof(tool_header.identifier) - 1);
+		tool_header.num_spheres = num_spheres;
+		tool_header.min_visible_spheres = tool.min_visible_spheres;
+		tool_header.sphere_radius = tool.sphere_radius;
+		tool_header.lowpass_rotation = tool.lowpass_factor_rotation;
+		tool_header.lowpass_position = tool.lowpass_factor_position;
+		memcpy(pTool, &tool_header, sizeof(tool_header));
+		pTool += sizeof(tool_header);
+		float* pSpheres = reinterpret_cast<float*>(pTool);
+		for (uint i = 0; i < num_spheres; i++) {
+			cv::Vec3f sphere = tool.spheres_xyz.at<cv::Vec3f>(i, 0);
+			*pSpheres++ = sphere[0];
+			*pSpheres++ = sphere[1];
+			*pSpheres++ = sphere[2];
+		}
+		pTool += num_spheres * 3 * sizeof(float);
+	}
+
+	m_pChunk = nullptr;
+	m_iMappedChunk = -1;
+	m_iFrameCount = 0;
+	m_bOpen = true;
+	return true;
+}
+
+bool IRSessionRecorder::AppendFrame(const uint16_t* pAbImage, const uint16_t* pDepth, const float* depth_to_world, int64_t timestamp)
+{
+	if (!m_bOpen)
+		return false;
+
+	int64_t chunk = static_cast<int64_t>(m_iFrameCount / m_Header.frames_per_chunk);
+	if (chunk != m_iMappedChunk) {
+		m_pChunk = m_File.MapWindow(m_Header.first_chunk_offset + chunk * m_Header.chunk_stride, m_Header.chunk_stride);
+		if (m_pChunk == nullptr) {
+			m_iMappedChunk = -1;
+			return false;
+		}
+		m_iMappedChunk = chunk;
+	}
+
+	uint64_t image_size = uint64_t(m_Header.width) * m_Header.height * sizeof(uint16_t);
+	uint8_t* pRecord = m_pChunk + (m_iFrameCount % m_Header.frames_per_chunk) * m_Header.frame_stride;
+
+	IRRecordedFrameHeader frame_header{};
+	frame_header.magic = kRecordingFrameMagic;
+	frame_header.index = static_cast<uint32_t>(m_iFrameCount);
+	frame_header.timestamp = timestamp;
+	memcpy(frame_header.depth_to_world, depth_to_world, sizeof(frame_header.depth_to_world));
+	memcpy(pRecord, &frame_header, sizeof(frame_header));
+	memcpy(pRecord + sizeof(IRRecordedFrameHeader), pAbImage, image_size);
+	memcpy(pRecord + sizeof(IRRecordedFrameHeader) + image_size, pDepth, image_size);
+
+	m_iFrameCount++;
+	return true;
+}
+
+void IRSessionRecorder::Close()
+{
+	if (!m_bOpen)
+		return;
+	m_bOpen = false;
+
+	//Store the final frame count in the header and cut off the unused part of the last chunk
+	m_Header.frame_count = m_iFrameCount;
+	uint8_t* pHeader = m_File.MapWindow(0, sizeof(IRRecordingHeader));
+	if (pHeader != nullptr) {
+		memcpy(pHeader, &m_Header, sizeof(m_Header));
+	}
+	uint64_t last_chunk = m_iFrameCount / m_Header.frames_per_chunk;
+	uint64_t frames_in_last_chunk = m_iFrameCount % m_Header.frames_per_chunk;
+	m_File.Truncate(m_Header.first_chunk_offset + last_chunk * m_Header.chunk_stride + frames_in_last_chunk * m_Header.frame_stride);
+	m_File.Close();
+	m_pChunk = nullptr;
+	m_iMappedChunk = -1;
+}
+
+// ------------------------------- Replay -------------------------------
+
+//The strides and offsets of the header are used as divisors and to index into the mapping, a truncated or corrupt
+//recording must not make any of them point outside the file
+static bool ValidHeader(const IRRecordingHeader& header, const uint8_t* pData, uint64_t file_size)
+{
+	if (header.first_chunk_offset > file_size || header.width == 0 || header.height == 0 || header.width > 65536 || header.height > 65536)
+		return false;
+	uint64_t image_size = uint64_t(header.width) * header.height * sizeof(uint16_t);
+	uint64_t lut_size = uint64_t(header.width) * header.height * 2 * sizeof(float);
+	if (header.frames_per_chunk == 0 || header.frame_stride < sizeof(IRRecordedFrameHeader) + 2 * image_size
+		|| header.chunk_stride / header.frames_per_chunk < header.frame_stride)
+		return false;
+	if (header.lut_offset < sizeof(IRRecordingHeader) || header.lut_offset > header.first_chunk_offset
+		|| lut_size > header.first_chunk_offset - header.lut_offset || header.tools_offset > header.first_chunk_offset)
+		return false;
+
+	//Tool definitions are variable length, all of them have to end before the first chunk
+	uint64_t offset = header.tools_offset;
+	for (uint32_t i = 0; i < header.num_tools; i++) {
+		if (header.first_chunk_offset - offset < sizeof(IRRecordedToolHeader))
+			return false;
+		IRRecordedToolHeader tool_header{};
+		memcpy(&tool_header, pData + offset, sizeof(tool_header));
+		offset += sizeof(tool_header);
+		if ((header.first_chunk_offset - offset) / (3 * sizeof(float)) < tool_header.num_spheres)
+			return false;
+		offset += uint64_t(tool_header.num_spheres) * 3 * sizeof(float);
+	}
+	return true;
+}
+
+bool IRSessionReplay::Open(const std::string& path)
+{
+	Close();
+	if (!m_File.OpenRead(path))
+		return false;
+	if (m_File.Size() < sizeof(IRRecordingHeader)) {
+		Close();
+		return false;
+	}
+	memcpy(&m_Header, m_File.Data(), sizeof(m_Header));
+	if (memcmp(m_Header.magic, kRecordingMagic, sizeof(kRecordingMagic)) != 0 || m_Header.version != kRecordingVersion
+		|| !ValidHeader(m_Header, m_File.Data(), m_File.Size())) {
+		Close();
+		return false;
+	}
+
+	m_Intrinsics.SetLut(reinterpret_cast<const float*>(m_File.Data() + m_Header.lut_offset), m_Header.width, m_Header.height);
+
+	//Recordings that were not closed properly have no frame count, recover every complete frame with a valid magic
+	uint64_t payload = m_File.Size() - m_Header.first_chunk_offset;
+	uint64_t full_chunks = payload / m_Header.chunk_stride;
+	uint64_t max_frames = full_chunks * m_Header.frames_per_chunk + std::min<uint64_t>((payload % m_Header.chunk_stride) / m_Header.frame_stride, m_Header.frames_per_chunk);
+	m_iFrameCount = m_Header.frame_count > 0 ? std::min(m_Header.frame_count, max_frames) : 0;
+	if (m_Header.frame_count == 0) {
+		while (m_iFrameCount < max_frames) {
+			uint64_t chunk = m_iFrameCount / m_Header.frames_per_chunk;
+			const uint8_t* pRecord = m_File.Data() + m_Header.first_chunk_offset + chunk * m_Header.chunk_stride
+				+ (m_iFrameCount % m_Header.frames_per_chunk) * m_Header.frame_stride;
+			const IRRecordedFrameHeader* pFrameHeader = reinterpret_cast<const IRRecordedFrameHeader*>(pRecord);
+			if (pFrameHeader->magic != kRecordingFrameMagic || pFrameHeader->index != m_iFrameCount)
+				break;
+			m_iFrameCount++;
+		}
+	}
+	return true;
+}
+
+void IRSessionReplay::Close()
+{
+	m_File.Close();
+	m_Header = IRRecordingHeader{};
+	m_iFrameCount = 0;
+}
+
+IRRecordedFrame IRSessionReplay::GetFrame(uint64_t index) const
+{
+	IRRecordedFrame frame{};
+	if (index >= m_iFrameCount)
+		return frame;
+	uint64_t chunk = index / m_Header.frames_per_chunk;
+	const uint8_t* pRecord = m_File.Data() + m_Header.first_chunk_offset + chunk * m_Header.chunk_stride
+		+ (index % m_Header.frames_per_chunk) * m_Header.frame_stride;
+	const IRRecordedFrameHeader* pFrameHeader = reinterpret_cast<const IRRecordedFrameHeader*>(pRecord);
+	uint64_t image_size = uint64_t(m_Header.width) * m_Header.height * sizeof(uint16_t);
+
+	frame.timestamp = pFrameHeader->timestamp;
+	frame.depth_to_world = pFrameHeader->depth_to_world;
+	frame.pAbImage = reinterpret_cast<const uint16_t*>(pRecord + sizeof(IRRecordedFrameHeader));
+	frame.pDepth = reinterpret_cast<const uint16_t*>(pRecord + sizeof(IRRecordedFrameHeader) + image_size);
+	return frame;
+}
+
+int IRSessionReplay::AddRecordedTools(IRToolTracker& tracker) const
+{
+	int added = 0;
+	const uint8_t* pTool = m_File.Data() + m_Header.tools_offset;
+	for (uint32_t i = 0; i < m_Header.num_tools; i++) {
+		IRRecordedToolHeader tool_header{};
+		memcpy(&tool_header, pTool, sizeof(tool_header));
+		pTool += sizeof(tool_header);
+		cv::Mat3f spheres = cv::Mat3f(tool_header.num_spheres, 1);
+		const float* pSpheres = reinterpret_cast<const float*>(pTool);
+		for (uint32_t j = 0; j < tool_header.num_spheres; j++) {
+			spheres.at<cv::Vec3f>(j, 0) = cv::Vec3f(pSpheres[0], pSpheres[1], pSpheres[2]);
+			pSpheres += 3;
+		}
+		pTool += tool_header.num_spheres * 3 * sizeof(float);
+		tool_header.identifier[sizeof(tool_header.identifier) - 1] = '\0';
+		if (tracker.AddTool(spheres, tool_header.sphere_radius, tool_header.identifier, tool_header.min_visible_spheres,
+			tool_header.lowpass_rotation, tool_header.lowpass_position)) {
+			added++;
+		}
+	}
+	return added;
+}
+
+uint64_t IRSessionReplay::Play(IRToolTracker& tracker, bool realtime, uint64_t first, uint64_t last) const
+{
+	last = std::min(last, m_iFrameCount);
+	if (first >= last)
+		return 0;
+
+	auto start = std::chrono::steady_clock::now();
+	int64_t first_timestamp = GetFrame(first).timestamp;
+	uint64_t fed = 0;
+
+	for (uint64_t i = first; i < last && tracker.IsTracking(); i++) {
+		IRRecordedFrame frame = GetFrame(i);
+		if (realtime) {
+			//Timestamps are in 100 ns ticks
+			auto due = start + std::chrono::nanoseconds((frame.timestamp - first_timestamp) * 100);
+			std::this_thread::sleep_until(due);
+		}
+		uint64_t processed = tracker.GetProcessedFrameCount();
+		cv::Mat pose(4, 4, CV_32F, const_cast<float*>(frame.depth_to_world));
+		tracker.AddFrame(const_cast<uint16_t*>(frame.pAbImage), const_cast<uint16_t*>(frame.pDepth), m_Header.width, m_Header.height, pose, frame.timestamp);
+		fed++;
+		if (!realtime) {
+			while (tracker.GetProcessedFrameCount() == processed && tracker.IsTracking()) {
+				std::this_thread::yield();
+			}
+		}
+	}
+	return fed;
+}
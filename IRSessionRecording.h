@@ -0,0 +1,163 @@
+#pragma once
+
+#include <vector>
+#include <string>
+#include <cstdint>
+
+#include "IRStructs.h"
+#include "IRCameraIntrinsics.h"
+
+class IRToolTracker;
+
+/*
+ * AHAT session recordings
+ *
+ * Layout of a recording file (little endian):
+ *   [IRRecordingHeader][unit plane lut: width*height*2 floats][tool definitions]   padded to kRecordingAlignment
+ *   [chunk 0][chunk 1]...                                                          every chunk is padded to kRecordingAlignment
+ * A chunk holds frames_per_chunk frame records of frame_stride bytes:
+ *   [IRRecordedFrameHeader][AB image: width*height uint16][depth: width*height uint16]
+ *
+ * The recorder maps one chunk at a time while writing, the replay maps the whole file read only
+ * and hands out pointers into the mapping.
+ */
+
+constexpr uint64_t kRecordingAlignment = 64 * 1024; //Allocation granularity on Windows, multiple of the page size elsewhere
+constexpr uint32_t kRecordingVersion = 1;
+constexpr uint32_t kRecordingFrameMagic = 0x4D524649; //"IFRM"
+constexpr uint32_t kRecordingFramesPerChunk = 16;
+
+struct IRRecordingHeader
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t width;
+	uint32_t height;
+	uint32_t frames_per_chunk;
+	uint64_t frame_stride;
+	uint64_t chunk_stride;
+	uint64_t lut_offset;
+	uint64_t tools_offset;
+	uint32_t num_tools;
+	uint32_t reserved;
+	uint64_t first_chunk_offset;
+	uint64_t frame_count;
+};
+
+struct IRRecordedToolHeader
+{
+	char identifier[64];
+	uint32_t num_spheres;
+	uint32_t min_visible_spheres;
+	float sphere_radius;
+	float lowpass_rotation;
+	float lowpass_position;
+	uint32_t reserved;
+	//followed by num_spheres * 3 floats (mm)
+};
+
+struct IRRecordedFrameHeader
+{
+	uint32_t magic;
+	uint32_t index;
+	int64_t timestamp;
+	float depth_to_world[16];
+	uint8_t padding[48];
+};
+
+//View of one recorded frame, all pointers point into the file mapping
+struct IRRecordedFrame
+{
+	int64_t timestamp{ 0 };
+	const float* depth_to_world{ nullptr };
+	const uint16_t* pAbImage{ nullptr };
+	const uint16_t* pDepth{ nullptr };
+};
+
+//Thin wrapper around a memory mapped file, either mapped read only as a whole or written through a movable window
+class IRMappedFile
+{
+public:
+	IRMappedFile() = default;
+	IRMappedFile(const IRMappedFile&) = delete;
+	IRMappedFile& operator=(const IRMappedFile&) = delete;
+	~IRMappedFile();
+
+	bool OpenRead(const std::string& path);
+	bool OpenWrite(const std::string& path);
+
+	//Maps [offset, offset + size) for writing, growing the file if needed. Offset has to be a multiple of kRecordingAlignment.
+	uint8_t* MapWindow(uint64_t offset, uint64_t size);
+	bool Truncate(uint64_t size);
+	void Close();
+
+	inline const uint8_t* Data() const { return m_pView; }
+	inline uint64_t Size() const { return m_iSize; }
+
+private:
+	void Unmap();
+
+	uint8_t* m_pView = nullptr;
+	uint64_t m_iViewSize = 0;
+	uint64_t m_iSize = 0;
+	bool m_bWritable = false;
+#ifdef _WIN32
+	void* m_hFile = nullptr;
+	void* m_hMapping = nullptr;
+#else
+	int m_iFd = -1;
+#endif
+};
+
+class IRSessionRecorder
+{
+public:
+	//Creates a new recording of the camera model lut (width x height) and the currently registered tools. Sampling a
+	//camera model can take long, callers build the lut before they block the frame producer
+	bool Open(const std::string& path, uint32_t width, uint32_t height, const IRLutCameraIntrinsics& lut, const std::vector<IRToolDefinition>& tools);
+	//Appends one raw AHAT frame, depth_to_world is the row major 4x4 pose that is handed to IRToolTracker::AddFrame
+	bool AppendFrame(const uint16_t* pAbImage, const uint16_t* pDepth, const float* depth_to_world, int64_t timestamp);
+	void Close();
+
+	inline bool IsOpen() const { return m_bOpen; }
+	inline uint64_t GetFrameCount() const { return m_iFrameCount; }
+
+	~IRSessionRecorder() { Close(); }
+
+private:
+	IRMappedFile m_File;
+	IRRecordingHeader m_Header{};
+	uint8_t* m_pChunk = nullptr;
+	int64_t m_iMappedChunk = -1;
+	uint64_t m_iFrameCount = 0;
+	bool m_bOpen = false;
+};
+
+class IRSessionReplay
+{
+public:
+	bool Open(const std::string& path);
+	void Close();
+
+	inline uint64_t GetFrameCount() const { return m_iFrameCount; }
+	inline uint32_t GetWidth() const { return m_Header.width; }
+	inline uint32_t GetHeight() const { return m_Header.height; }
+	IRRecordedFrame GetFrame(uint64_t index) const;
+
+	//Camera model recorded with the session, use it to construct the IRToolTracker for replay
+	inline IRLutCameraIntrinsics& GetIntrinsics() { return m_Intrinsics; }
+
+	//Registers the tools that were defined when the recording was started
+	int AddRecordedTools(IRToolTracker& tracker) const;
+
+	//Feeds frames [first, last) to the tracker. With realtime the recorded cadence is reproduced,
+	//otherwise the next frame is handed over as soon as the tracker finished the previous one.
+	//Returns the number of frames that were fed.
+	uint64_t Play(IRToolTracker& tracker, bool realtime, uint64_t first = 0, uint64_t last = UINT64_MAX) const;
+
+private:
+	IRMappedFile m_File;
+	IRRecordingHeader m_Header{};
+	IRLutCameraIntrinsics m_Intrinsics;
+	uint64_t m_iFrameCount = 0;
+};
@@ -2,9 +2,9 @@
 
 #include <vector>
 #include <map>
+#include <string>
 #include <thread>
 #include <cstdint>
-#include <wrl.h>
 
 #include <opencv2/core.hpp>
 #include <opencv2/video/tracking.hpp>
@@ -27,13 +27,43 @@ struct Side
 };
 
 
+//Start side of a tool in the side length index, see IRToolTracker::BuildSideIndex
+struct IndexedSide
+{
+	float distance{ 0 };
+	int tool{ 0 };		//Index in the tracker's tools
+	int range{ 0 };		//Entry in ProcessedAHATFrame::start_side_ranges, shared by the sub-models starting at this side
+};
+
+//Frame sides [begin, end) of the distance ordered sides of a frame
+struct SideRange
+{
+	int begin{ 0 };
+	int end{ 0 };
+};
+
+
 struct AHATFrame {
-	long long timestamp;
+	long long timestamp{ 0 };
 	cv::Mat hololens_pose;
 	cv::Mat cvAbImage;
-	UINT16* pDepth;
-	UINT32 depthWidth;
-	UINT32 depthHeight;
+	//Thresholded AB image, 8 bit
+	cv::Mat cvMask;
+	uint16_t* pDepth{ nullptr };
+	uint32_t depthWidth{ 0 };
+	uint32_t depthHeight{ 0 };
+};
+
+//Frame spheres back-projected for one sphere radius, see IRTrackedTool::radius_class
+struct RadiusFrameData
+{
+	float sphere_radius{ 0 };
+	cv::Mat3f spheres_xyz;
+	std::vector<Side> ordered_sides;
+	cv::Mat map;
+	//Per sphere the set of spheres it has an ordered side with, neighbour_words words per sphere
+	std::vector<uint64_t> neighbours;
+	int neighbour_words{ 0 };
 };
 
 struct ProcessedAHATFrame
@@ -42,19 +72,21 @@ struct ProcessedAHATFrame
 	cv::Mat hololens_pose;
 	uint num_spheres;
 	cv::Mat3f spheres_xyd;
-	std::map<float, cv::Mat3f> spheres_xyz_per_mm;
-	std::map<float, std::vector<Side>> ordered_sides_per_mm;
-	std::map<float, cv::Mat> map_per_mm;
+	//Indexed by radius class, the entries are overwritten by the next frame so their buffers are reused
+	std::vector<RadiusFrameData> per_radius;
+	//Frame sides matching the start side of every sub-model of every tool, and per tool whether any was found at all
+	std::vector<SideRange> start_side_ranges;
+	std::vector<uint8_t> tool_has_start_side;
 };
 
 struct EnvFrame
 {
-	UINT8* pLFImage;
-	UINT8* pRFImage;
+	uint8_t* pLFImage;
+	uint8_t* pRFImage;
 	float* pLFExtr;
 	float* pRFExtr;
-	INT64 tsLF;
-	INT64 tsRF;
+	int64_t tsLF;
+	int64_t tsRF;
 
 	~EnvFrame() {
 		if (pLFImage != nullptr) {
@@ -86,17 +118,18 @@ struct ToolResult
 	float error{ 0 };
 	std::vector<int> occluded_nodes;
 	float dist_to_prev{ 0 };
-	static bool compare(ToolResult a, ToolResult b)
+	//Strict weak ordering for std::sort: fewest occluded spheres first, then closest to the previous pose, then lowest error
+	static bool compare(const ToolResult& a, const ToolResult& b)
 	{
 		if (a.occluded_nodes.size() < b.occluded_nodes.size()) {
 			return true;
 		}
-		else if (a.occluded_nodes.size() < b.occluded_nodes.size()) {
+		else if (a.occluded_nodes.size() > b.occluded_nodes.size()) {
 			return false;
 		}
 		//Results have same amount of spheres visisble
-		if (a.dist_to_prev < b.dist_to_prev) {
-			return true;
+		if (a.dist_to_prev != b.dist_to_prev) {
+			return a.dist_to_prev < b.dist_to_prev;
 		}
 		if (a.error < b.error) {
 			return true;
@@ -113,24 +146,83 @@ struct ToolResultContainer
 
 
 
+//Largest number of spheres of a tool, sets of tool spheres are 64 bit masks. AddTool rejects larger tools
+//(IR_ADD_TOOL_TOO_MANY_SPHERES), the search entries are sized from the sub-model they search
+constexpr uint kMaxToolSpheres = 64;
+//Largest number of spheres used from a frame, the search keeps the visited frame spheres in sets of this size
+constexpr uint kMaxFrameSpheres = 512;
+//Largest sphere count the search and pose kernels are compiled for, see IRTrackedTool::fixed_spheres
+constexpr uint kMaxFixedKernelSpheres = 6;
+//Largest number of visible subsets a tool is split into sub-models for, tools that may miss more of their spheres are
+//searched as a whole with the occluded spheres found during the search (IRToolTracker::SearchOccluded)
+constexpr uint kMaxToolSubModels = 1024;
+
+//Subset of the spheres of a tool that the search matches on its own, the tool with the other spheres occluded
+struct IRToolSubModel
+{
+	//Tool spheres in the order the search visits them
+	std::vector<int8_t> spheres;
+	int num_spheres{ 0 };
+	//Bit per tool sphere that is not part of the sub-model
+	uint64_t occluded{ 0 };
+	//Sides between the sub-model's spheres, indexed by their position in spheres and filled above the diagonal
+	cv::Mat map;
+	//Sphere count the search kernel is compiled for, see IRTrackedTool::fixed_spheres
+	int fixed_spheres{ 0 };
+	//Entry in ProcessedAHATFrame::start_side_ranges of the side between its first two spheres
+	int start_side_range{ 0 };
+	//Per position the positions before it that have to be matched to a lower frame sphere, see IRToolSymmetries
+	std::vector<uint64_t> symmetry_lower_spheres;
+};
+
+//Tool as it was passed to IRToolTracker::AddTool, without any tracking state
+struct IRToolDefinition
+{
+	std::string identifier;
+	//sphere positions relative to tool origin in mm, in the order of AddTool
+	cv::Mat3f spheres_xyz;
+	float sphere_radius{ 0.f };
+	uint min_visible_spheres{ 3 };
+	float lowpass_factor_rotation{ 0.f };
+	float lowpass_factor_position{ 0.f };
+};
+
 struct IRTrackedTool
 {
 	//Name of tool for easier access
 	std::string identifier;
 
-	//Sphere count, min 3, max n
+	//Sphere count, min 3, max kMaxToolSpheres
 	uint num_spheres;
 
 	//Minimum visible spheres, min 3, max num_spheres
 	uint min_visible_spheres;
 
-	//sphere positions relative to tool origin
+	//sphere positions relative to tool origin, in search order (see IRSearchOrder)
 	cv::Mat3f spheres_xyz;
+	//Index in the spheres passed to AddTool of every sphere of spheres_xyz
+	std::vector<int> search_order;
+	//Partial matches per search step the tool is estimated to cause, see IRSearchOrder::branching_factor
+	float branching_factor{ 0.f };
 	float sphere_radius;
+	//Tools with the same sphere radius share the class, ProcessedAHATFrame::per_radius[radius_class] has their frame spheres
+	int radius_class{ 0 };
 
 	//distances between spheres
 	std::vector<Side> ordered_sides;
 	cv::Mat map;
+	//Every visible subset of at least min_visible_spheres spheres, largest first. Built by IRToolTracker::BuildSideIndex
+	std::vector<IRToolSubModel> sub_models;
+	//More than kMaxToolSubModels visible subsets, the tool has no sub-models and is searched by IRToolTracker::SearchOccluded
+	bool search_occluded{ false };
+	//Entry in ProcessedAHATFrame::start_side_ranges of the side between spheres a < b at [a * num_spheres + b], -1 where
+	//SearchOccluded does not start. Only set if search_occluded
+	std::vector<int> start_side_ranges;
+	//Sphere count the search and pose kernels of the tool are compiled for (3 to kMaxFixedKernelSpheres), 0 for the
+	//generic ones. Set by IRToolTracker::BuildSideIndex
+	int fixed_spheres{ 0 };
+	//Permutations of the spheres keeping all sides, 1 for a tool without symmetries (see IRToolSymmetries)
+	int num_symmetries{ 1 };
 
 	//Kalman filtering
 	std::vector<IRToolKalmanFilter> sphere_kalman_filters;
@@ -145,5 +237,10 @@ struct IRTrackedTool
 	std::vector<cv::Vec3f> unfiltered_sphere_positions;
 	long long timestamp{ 0 };
 
-	bool tracking_finished = true;
+	//Pose before cur_transform, the two give the velocity for predicting the next pose
+	cv::Mat prev_transform = cv::Mat::zeros(8, 1, CV_32F);
+	long long prev_timestamp{ 0 };
+
+	//Frame sphere of every tool sphere in the frame cur_transform was found in, -1 if occluded
+	std::vector<int16_t> frame_spheres;
 };
\ No newline at end of file
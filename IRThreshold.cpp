@@ -0,0 +1,88 @@
+#include "IRThreshold.h"
+
+#include <algorithm>
+
+#if defined(__ARM_NEON) || defined(_M_ARM64)
+#define IR_THRESHOLD_NEON 1
+#include <arm_neon.h>
+#elif defined(__AVX2__)
+#define IR_THRESHOLD_AVX2 1
+#include <immintrin.h>
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define IR_THRESHOLD_SSE2 1
+#include <emmintrin.h>
+#endif
+
+static inline void ThresholdScalar(const uint16_t* pAbImage, uint8_t* pMask, size_t count, uint16_t threshold)
+{
+	for (size_t i = 0; i < count; i++)
+		pMask[i] = pAbImage[i] >= threshold ? 255 : 0;
+}
+
+void IRThresholdAbImage(const uint16_t* pAbImage, uint8_t* pMask, size_t count, uint16_t threshold)
+{
+	size_t i = 0;
+	if (threshold == 0) {
+		//Every pixel passes, the saturating subtraction below needs threshold > 0
+		std::fill(pMask, pMask + count, static_cast<uint8_t>(255));
+		return;
+	}
+#if IR_THRESHOLD_NEON
+	const uint16x8_t limit = vdupq_n_u16(threshold);
+	for (; i + 16 <= count; i += 16) {
+		uint16x8_t lo = vcgeq_u16(vld1q_u16(pAbImage + i), limit);
+		uint16x8_t hi = vcgeq_u16(vld1q_u16(pAbImage + i + 8), limit);
+		vst1q_u8(pMask + i, vcombine_u8(vmovn_u16(lo), vmovn_u16(hi)));
+	}
+#elif IR_THRESHOLD_AVX2
+	//v >= threshold <=> saturated threshold - v == 0
+	const __m256i limit = _mm256_set1_epi16(static_cast<short>(threshold));
+	const __m256i zero = _mm256_setzero_si256();
+	for (; i + 32 <= count; i += 32) {
+		__m256i lo = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(pAbImage + i));
+		__m256i hi = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(pAbImage + i + 16));
+		lo = _mm256_cmpeq_epi16(_mm256_subs_epu16(limit, lo), zero);
+		hi = _mm256_cmpeq_epi16(_mm256_subs_epu16(limit, hi), zero);
+		//Packing works per 128 bit lane, restore the pixel order afterwards
+		__m256i packed = _mm256_permute4x64_epi64(_mm256_packs_epi16(lo, hi), 0xD8);
+		_mm256_storeu_si256(reinterpret_cast<__m256i*>(pMask + i), packed);
+	}
+#elif IR_THRESHOLD_SSE2
+	//v >= threshold <=> saturated threshold - v == 0
+	const __m128i limit = _mm_set1_epi16(static_cast<short>(threshold));
+	const __m128i zero = _mm_setzero_si128();
+	for (; i + 16 <= count; i += 16) {
+		__m128i lo = _mm_loadu_si128(reinterpret_cast<const __m128i*>(pAbImage + i));
+		__m128i hi = _mm_loadu_si128(reinterpret_cast<const __m128i*>(pAbImage + i + 8));
+		lo = _mm_cmpeq_epi16(_mm_subs_epu16(limit, lo), zero);
+		hi = _mm_cmpeq_epi16(_mm_subs_epu16(limit, hi), zero);
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(pMask + i), _mm_packs_epi16(lo, hi));
+	}
+#endif
+	ThresholdScalar(pAbImage + i, pMask + i, count - i, threshold);
+}
+
+void IRThresholdAbImageReference(const uint16_t* pAbImage, uint8_t* pMask, size_t count, uint16_t threshold)
+{
+	//Per pixel formula of the original forEach + convertTo implementation with upperLimit = lowerLimit + 1
+	uint16_t upperLimit = threshold;
+	uint16_t lowerLimit = threshold > 0 ? threshold - 1 : 0;
+	for (size_t i = 0; i < count; i++) {
+		uint16_t ir = pAbImage[i];
+		int value = upperLimit == lowerLimit ? 255 : (std::clamp(ir, lowerLimit, upperLimit) - lowerLimit) / (upperLimit - lowerLimit) * 255;
+		pMask[i] = static_cast<uint8_t>(value);
+	}
+}
+
+const char* IRThresholdKernelName()
+{
+#if IR_THRESHOLD_NEON
+	return "neon";
+#elif IR_THRESHOLD_AVX2
+	return "avx2";
+#elif IR_THRESHOLD_SSE2
+	return "sse2";
+#else
+	return "scalar";
+#endif
+}
@@ -0,0 +1,19 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+/*
+ * Binarization of the AB image: pMask[i] = pAbImage[i] >= threshold ? 255 : 0
+ *
+ * IRThresholdAbImage reads the 16 bit AB buffer once and writes the 8 bit mask directly, vectorized with NEON on
+ * ARM, AVX2 or SSE2 on x86 depending on what the translation unit is compiled for. IRThresholdAbImageReference is
+ * the clamp based per pixel formula the tracker used before and produces the same mask.
+ */
+
+void IRThresholdAbImage(const uint16_t* pAbImage, uint8_t* pMask, size_t count, uint16_t threshold);
+
+void IRThresholdAbImageReference(const uint16_t* pAbImage, uint8_t* pMask, size_t count, uint16_t threshold);
+
+//Instruction set IRThresholdAbImage was compiled for
+const char* IRThresholdKernelName();
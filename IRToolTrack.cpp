@@ -1,16 +1,22 @@
 #include "IRToolTrack.h"
-#include "HL2IRToolTracking.h"
+#include "IRThreshold.h"
+#include "IRDistanceMap.h"
 
-#include "opencv2/highgui.hpp"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <limits>
+#include <numeric>
+#include <cstring>
 
-#define DEBUG_OUTPUT FALSE
-#define DEBUG_TIME FALSE
-#define DEBUG_NO_FILTER FALSE
-#define DEBUG_OUTPUT_OCCL FALSE
+#define DEBUG_OUTPUT 0
+#define DEBUG_TIME 0
+#define DEBUG_NO_FILTER 0
+#define DEBUG_OUTPUT_OCCL 0
 
 
-#define DISABLE_LOWPASS TRUE
-#define DISABLE_KALMAN TRUE
+#define DISABLE_LOWPASS 1
+#define DISABLE_KALMAN 1
 
 
 
@@ -18,7 +24,7 @@ cv::Mat IRToolTracker::GetToolTransform(std::string identifier)
 {
 #if DEBUG_OUTPUT
 	std::string funcoutput = "GetToolTransform for " + identifier + "\n";
-	OutputDebugString(std::wstring(funcoutput.begin(), funcoutput.end()).c_str());
+	IRDebugOutput(funcoutput);
 #endif
 	if (m_Tools.size() == 0 || m_ToolIndexMapping.count(identifier) == 0)
 		return cv::Mat::zeros(8, 1, CV_32F);
@@ -34,21 +40,34 @@ cv::Mat IRToolTracker::GetToolTransform(std::string identifier)
 	return transform;
 }
 
+std::vector<IRToolDefinition> IRToolTracker::GetToolDefinitions()
+{
+	std::lock_guard<std::mutex> lock(m_MutexToolDefinitions);
+	return m_ToolDefinitions;
+}
+
+float IRToolTracker::GetToolBranchingFactor(std::string identifier)
+{
+	if (m_ToolIndexMapping.count(identifier) == 0)
+		return 0.f;
+	return m_Tools.at(m_ToolIndexMapping.at(identifier)).branching_factor;
+}
+
 cv::Mat IRToolTracker::GetDepthToWorldTransform()
 {
 	//std::string funcoutput = "Getting Depth To World pose:\n";
-	//OutputDebugString(std::wstring(funcoutput.begin(), funcoutput.end()).c_str());
+	//IRDebugOutput(funcoutput);
 
 	/*if (th == nullptr)
 	{
 		std::string funcoutput = "Current frame is null\n";
-		OutputDebugString(std::wstring(funcoutput.begin(), funcoutput.end()).c_str());
+		IRDebugOutput(funcoutput);
 		return cv::Mat::zeros(4, 4, CV_32F);
 	}*/
 
 
 	//funcoutput = "XPOS:" + std::to_string(depthToWorldPose.at<double>(0,3)) + "\n";
-	//OutputDebugString(std::wstring(funcoutput.begin(), funcoutput.end()).c_str());
+	//IRDebugOutput(funcoutput);
 	return this->depthToWorldPose;
 	
 	
@@ -57,268 +76,607 @@ cv::Mat IRToolTracker::GetDepthToWorldTransform()
 void IRToolTracker::TrackTools()
 {
 #if DEBUG_OUTPUT
-	OutputDebugString(L"TrackTools\n");
+	IRDebugOutput("TrackTools\n");
 #endif
 	while (!m_bShouldStop) {
 #if DEBUG_TIME
 		auto start = std::chrono::high_resolution_clock::now();
 #endif
 		m_bIsCurrentlyTracking = true;
-		m_MutexCurFrame.lock();
-		if (m_CurrentFrame == nullptr) {
-			m_MutexCurFrame.unlock();
-			Sleep(5);
+		//Sleeps until AddFrame publishes a frame or StopTracking interrupts the wait
+		uint64_t publish_time = 0;
+		AHATFrame* rawFrame = m_FramePool.WaitRead(&publish_time);
+		if (rawFrame == nullptr) {
 			continue;
 		}
-		
-		//Copy pointer to frame
-		AHATFrame* rawFrame = m_CurrentFrame;
-		m_CurrentFrame = nullptr;
-		m_MutexCurFrame.unlock();
+		m_pStats->RecordSince(IR_STAGE_HANDOFF, publish_time);
 
-		int current_num_tools = m_Tools.size();
-		ToolResultContainer* raw_results = new ToolResultContainer[current_num_tools];
+		TrackFrame(rawFrame);
+		m_FramePool.Release(rawFrame);
+		m_iProcessedFrames++;
 
-		ProcessedAHATFrame processedFrame;
+#if DEBUG_TIME
+		auto finish = std::chrono::high_resolution_clock::now();
+		std::string my_str = "Tool Tracking loop ran for ";
+		my_str += std::to_string((std::chrono::duration_cast<std::chrono::nanoseconds>(finish - start).count() / 1000000.f)) += " ms.\n";
+		IRDebugOutput(my_str);
+#endif
+	}
+	m_bIsCurrentlyTracking = false;
+}
 
-		if (!ProcessFrame(rawFrame, processedFrame)) {
-			continue;
-		}
-		
+bool IRToolTracker::TrackFrame(AHATFrame* rawFrame)
+{
+	uint64_t frame_start = IRPipelineStats::Now();
+	int current_num_tools = m_Tools.size();
 
-		//std::vector<std::thread> tool_track_threads(current_num_tools);
+	ProcessedAHATFrame& processedFrame = m_ProcessedFrame;
+	//Blobs of the last frame with enough blobs, ProcessFrame replaces them
+	cv::Mat3f prev_spheres_xyd = processedFrame.spheres_xyd;
 
-		for (int i = 0; i < current_num_tools; i++) {
-			IRTrackedTool tool = m_Tools.at(i);
-			if (!tool.tracking_finished)
-				continue;
+	if (!ProcessFrame(rawFrame, processedFrame)) {
+		//No tool was found in this frame, the next one must not take the tools of the frame before as found
+		m_iLastSearchedTimestamp = rawFrame->timestamp;
+		m_pStats->RecordSince(IR_STAGE_FRAME, frame_start);
+		return false;
+	}
+
+	uint64_t search_start = IRPipelineStats::Now();
 
-			ToolResultContainer result{ i, std::vector<ToolResult>() };
-			
-			//tool_track_threads.at(i) = std::thread(&IRToolTracker::TrackTool, this, tool, processedFrame, result);
-			TrackTool(tool, processedFrame, result);
-			raw_results[i] = result;
+	ToolResultContainer* raw_results = new ToolResultContainer[current_num_tools];
 
-			//ProcessEnvFrame(processedFrame, result);
+	if (m_Matcher == IR_MATCHER_TRIANGLE_HASHING) {
+		m_TriangleMatcher.Match(processedFrame, m_Tools, m_fToleranceAvg, raw_results);
+	}
+	else {
+		//Tools are searched in parallel, every tool writes its own result so UnionSegmentation gets the candidates in
+		//tool order whichever worker found them
+		IRWorkerPool& pool = GetSearchPool();
+		float gate = m_fPredictionGate;
+		float association_gate = m_fAssociationGate;
+		if (association_gate > 0.f) {
+			//Cells as wide as the gate at 30 cm, closer blobs look at a few more cells
+			m_BlobGrid.Build(processedFrame.spheres_xyd, association_gate / 300.f);
 		}
+		pool.Run(current_num_tools, [&](int i, int worker) {
+			raw_results[i] = ToolResultContainer{ i, std::vector<ToolResult>() };
+			const IRTrackedTool& tool = m_Tools[i];
+			bool found_before = tool.timestamp != 0 && tool.timestamp == m_iLastSearchedTimestamp;
+			if (found_before && association_gate > 0.f
+				&& MatchAssociated(tool, prev_spheres_xyd, processedFrame, association_gate, raw_results[i])) {
+				return;
+			}
+			if (found_before && gate > 0.f && MatchPredicted(tool, processedFrame, gate, raw_results[i])) {
+				return;
+			}
+			if (!processedFrame.tool_has_start_side[i]) {
+				//None of the tool's start sides is in the frame, the search could not find anything
+				return;
+			}
+			TrackTool(tool, processedFrame, m_SearchStacks[worker], raw_results[i]);
+		});
+	}
+	m_iLastSearchedTimestamp = processedFrame.timestamp;
 
-		//for (auto & thread : tool_track_threads) {
-		//	thread.join();
-		//}
-		UnionSegmentation(raw_results, current_num_tools, processedFrame);
+	m_pStats->RecordSince(IR_STAGE_SEARCH, search_start);
 
-		delete[] raw_results;
-		//TODO: make sure i didnt create a memory leak here
+	UnionSegmentation(raw_results, current_num_tools, processedFrame);
 
-#if DEBUG_TIME
-		auto finish = std::chrono::high_resolution_clock::now();
-		std::string my_str = "Tool Tracking loop ran for ";
-		my_str += std::to_string((std::chrono::duration_cast<std::chrono::nanoseconds>(finish - start).count() / 1000000.f)) += " ms.\n";
-		std::wstring stemp = std::wstring(my_str.begin(), my_str.end());
-		LPCWSTR my2 = stemp.c_str();
-		OutputDebugString(my2);
-#endif
+	delete[] raw_results;
+	m_pStats->RecordSince(IR_STAGE_FRAME, frame_start);
+	return true;
+}
+
+bool IRToolTracker::TrackFrameSync(void* pAbImage, void* pDepth, uint32_t depthWidth, uint32_t depthHeight, cv::Mat _pose, int64_t _timestamp)
+{
+	if (m_bIsCurrentlyTracking)
+		return false;
+	AHATFrame* frame = CopyToPool(pAbImage, pDepth, depthWidth, depthHeight, _pose, _timestamp);
+	if (frame == nullptr)
+		return false;
+	bool result = TrackFrame(frame);
+	m_FramePool.Release(frame);
+	m_iProcessedFrames++;
+	return result;
+}
+
+AHATFrame* IRToolTracker::CopyToPool(void* pAbImage, void* pDepth, uint32_t depthWidth, uint32_t depthHeight, cv::Mat _pose, int64_t _timestamp)
+{
+	//Sample the camera model here on the producer thread, the tracking thread only interpolates the table
+	std::shared_ptr<const IRLutCameraIntrinsics> lut = GetUnitPlaneLut();
+	if (lut == nullptr || lut->GetWidth() != depthWidth || lut->GetHeight() != depthHeight) {
+		lut = std::make_shared<const IRLutCameraIntrinsics>(IRLutCameraIntrinsics::Sample(*m_pIntrinsics, depthWidth, depthHeight));
+		std::lock_guard<std::mutex> lock(m_MutexUnitPlaneLut);
+		m_pUnitPlaneLut = lut;
 	}
-	m_bIsCurrentlyTracking = false;
+
+	uint64_t copy_start = IRPipelineStats::Now();
+	AHATFrame* frame = m_FramePool.AcquireWrite(depthWidth, depthHeight);
+	if (frame == nullptr)
+		return nullptr;
+
+	//The AB image has the same resolution as the depth image
+	frame->timestamp = _timestamp;
+	_pose.copyTo(frame->hololens_pose);
+	memcpy(frame->cvAbImage.data, pAbImage, depthWidth * depthHeight * sizeof(uint16_t));
+	memcpy(frame->pDepth, pDepth, depthWidth * depthHeight * sizeof(uint16_t));
+	m_pStats->RecordSince(IR_STAGE_ADDFRAME_COPY, copy_start);
+	return frame;
+}
+
+void IRToolTracker::SetUnitPlaneLut(const float* lut_xy, uint32_t width, uint32_t height)
+{
+	auto lut = std::make_shared<const IRLutCameraIntrinsics>(lut_xy, width, height);
+	std::lock_guard<std::mutex> lock(m_MutexUnitPlaneLut);
+	m_pUnitPlaneLut = lut;
+}
+
+std::shared_ptr<const IRLutCameraIntrinsics> IRToolTracker::GetUnitPlaneLut()
+{
+	std::lock_guard<std::mutex> lock(m_MutexUnitPlaneLut);
+	return m_pUnitPlaneLut;
+}
+
+IRWorkerPool& IRToolTracker::GetSearchPool()
+{
+	uint32_t num_threads = m_iSearchThreads;
+	if (num_threads == 0)
+		num_threads = IRWorkerPool::NumPerformanceCores();
+	if (m_pSearchPool == nullptr || m_pSearchPool->NumWorkers() != num_threads) {
+		m_pSearchPool.reset();
+		m_pSearchPool = std::make_unique<IRWorkerPool>(num_threads);
+		m_SearchStacks.resize(m_pSearchPool->NumWorkers());
+	}
+	return *m_pSearchPool;
 }
 
-void IRToolTracker::TrackTool(IRTrackedTool &tool, ProcessedAHATFrame &frame, ToolResultContainer &result)
+void IRToolTracker::TrackTool(const IRTrackedTool& tool, const ProcessedAHATFrame& frame, SearchStack& stack, ToolResultContainer& result,
+	bool generic_kernels)
 {
-	tool.tracking_finished = false;
 #if DEBUG_OUTPUT
-	OutputDebugString(L"TrackTool\n");
+	IRDebugOutput("TrackTool\n");
 #endif
 	if (frame.num_spheres < tool.min_visible_spheres) {
 		//Not enough spheres for the tool are available
-		tool.tracking_finished = true;
 		return;
 	}
-	std::vector<Side> eligible_sides;
-	
-
-	auto it_sides = frame.ordered_sides_per_mm.find(tool.sphere_radius);
-	std::vector<Side> frame_ordered_sides = it_sides->second;
-
-	auto it_map = frame.map_per_mm.find(tool.sphere_radius);
-	cv::Mat frame_map = it_map->second;
-
-	//Find the set of eligible side to start with - aka sides that have similar length to first side of tool
+	if (tool.search_occluded) {
+		SearchOccluded(tool, frame, stack, result);
+		return;
+	}
+	//Indexed by IRToolSubModel::fixed_spheres
+	static const SearchKernel fixed_kernels[kMaxFixedKernelSpheres + 1] = { nullptr, nullptr, nullptr,
+		&IRToolTracker::SearchSubModel<3>, &IRToolTracker::SearchSubModel<4>, &IRToolTracker::SearchSubModel<5>, &IRToolTracker::SearchSubModel<6> };
+	//UnionSegmentation ranks candidates with fewer occluded spheres first, once a sub-model is found the smaller ones
+	//could only add candidates behind it
+	int found_spheres = 0;
+	for (const IRToolSubModel& sub_model : tool.sub_models) {
+		if (sub_model.num_spheres < found_spheres)
+			break;
+		const SideRange& range = frame.start_side_ranges[sub_model.start_side_range];
+		if (range.end <= range.begin)
+			continue;
+#if DEBUG_OUTPUT_OCCL
+		std::string my_str = "Searching Tool " + tool.identifier + " with " + std::to_string(tool.num_spheres - sub_model.num_spheres) + " occluded spheres\n";
+		IRDebugOutput(my_str);
+#endif
+		//The generic kernel with the smallest entries the sub-model fits into
+		SearchKernel kernel = sub_model.num_spheres <= kGenericSearchCapacity ? &IRToolTracker::SearchSubModel<0, kGenericSearchCapacity>
+			: &IRToolTracker::SearchSubModel<0, kMaxToolSpheres>;
+		if (!generic_kernels && sub_model.fixed_spheres > 0)
+			kernel = fixed_kernels[sub_model.fixed_spheres];
+		(this->*kernel)(tool, sub_model, frame, stack, result);
+		if (found_spheres == 0 && !result.candidates.empty())
+			found_spheres = sub_model.num_spheres;
+	}
+}
 
-	struct search_entry {
-		std::vector<int> visited_nodes_frame;
-		float combined_error{ 0 };
-		int num_sides{ 0 };
-		std::vector<int> occluded_nodes_tool;
+template<int Spheres, int Capacity>
+void IRToolTracker::SearchSubModel(const IRTrackedTool& tool, const IRToolSubModel& sub_model, const ProcessedAHATFrame& frame,
+	SearchStack& stack, ToolResultContainer& result)
+{
+	static_assert(Spheres <= Capacity, "the entries have to hold every sphere of the sub-model");
+	const RadiusFrameData& frame_data = frame.per_radius[tool.radius_class];
+	const std::vector<Side>& frame_ordered_sides = frame_data.ordered_sides;
+	const float* frame_map = frame_data.map.ptr<float>();
+	size_t frame_map_step = frame_data.map.step / sizeof(float);
+	const uint64_t* neighbours = frame_data.neighbours.data();
+	size_t neighbour_words = static_cast<size_t>(frame_data.neighbour_words);
+
+	//Entries are fixed size and the stack is kept by the caller, so steady state matching does not allocate
+	std::vector<SearchEntry<Capacity>>& search_list = stack.Entries<Capacity>();
+	search_list.clear();
+
+	//The fixed size kernels keep the sub-model's sides in an array of their size, so the side checks unroll
+	constexpr bool kFixed = Spheres > 0;
+	constexpr int kSidesSize = kFixed ? Spheres : 1;
+	float model_sides[kSidesSize][kSidesSize];
+	if constexpr (kFixed) {
+		for (int a = 0; a < Spheres; a++) {
+			for (int b = a + 1; b < Spheres; b++)
+				model_sides[a][b] = sub_model.map.at<float>(a, b);
+		}
+	}
+	auto model_side = [&](int a, int b) -> float {
+		if constexpr (kFixed)
+			return model_sides[a][b];
+		else
+			return sub_model.map.at<float>(a, b);
 	};
+	const int num_model_spheres = kFixed ? Spheres : sub_model.num_spheres;
+
+	//Frame sides within m_fToleranceSide of the side between the first two spheres, found by MatchStartSides
+	const SideRange& eligible_sides = frame.start_side_ranges[sub_model.start_side_range];
+	float start_side_length = model_side(0, 1);
+	SearchEntry<Capacity> start{};
+	start.num_sides = 1;
+	start.num_visited = 2;
+	//A symmetry swapping the start spheres makes the two directions equivalent, only the lower first frame sphere is kept
+	bool both_directions = (sub_model.symmetry_lower_spheres[1] & 1u) == 0;
+	//From the start sides, add each direction to search queue
+	for (int i = eligible_sides.begin; i < eligible_sides.end; i++)
+	{
+		const Side& s = frame_ordered_sides[i];
+		start.combined_error = cv::abs(s.distance - start_side_length);
+		start.visited_frame.Clear();
+		start.visited_frame.Insert(s.id_from);
+		start.visited_frame.Insert(s.id_to);
+		start.visited_nodes_frame[0] = static_cast<int16_t>(s.id_to);
+		start.visited_nodes_frame[1] = static_cast<int16_t>(s.id_from);
+		if (both_directions || s.id_to < s.id_from)
+			search_list.push_back(start);
+		if (!both_directions && s.id_from > s.id_to)
+			continue;
+		start.visited_nodes_frame[0] = static_cast<int16_t>(s.id_from);
+		start.visited_nodes_frame[1] = static_cast<int16_t>(s.id_to);
+		search_list.push_back(start);
+	}
 
-	std::vector<search_entry> search_list;
+	while (search_list.size() > 0) {
+		SearchEntry<Capacity> curr = search_list.back();
+		search_list.pop_back();
 
-	float cur_side_length = tool.map.at<float>(0, 1);
-	std::vector<int> hidden_nodes;
-	int max_occluded_spheres = tool.num_spheres - tool.min_visible_spheres;
-#if DEBUG_OUTPUT_OCCL
-	OutputDebugString(L"Searching Tool ");
-	//std::stringstream result_string;
-	//std::copy(curr.occluded_nodes_tool.begin(), curr.occluded_nodes_tool.end(), std::ostream_iterator<int>(result_string, " "));
-	std::string my_str = tool.identifier + ": Max occl " + std::to_string(max_occluded_spheres);
-	OutputDebugString(std::wstring(my_str.begin(), my_str.end()).c_str());
-	OutputDebugString(L"\n");
-#endif
-	for (int m = 0; m <= max_occluded_spheres; m++)
-	{
-		std::vector<int> hidden_nodes_inside;
-		for (int k = m+1; k <= max_occluded_spheres+1; k++)
-		{
-#if DEBUG_OUTPUT_OCCL
-			OutputDebugString(L"Checking Tool ");
-			std::string my_str = tool.identifier + " for eligible side: " + std::to_string(m) + " to " + std::to_string(k);
-			OutputDebugString(std::wstring(my_str.begin(), my_str.end()).c_str());
-			OutputDebugString(L"\n");
-#endif
-			
-			cur_side_length = tool.map.at<float>(m, k);
-			for (int i = 0; i < frame_ordered_sides.size(); i++) {
-				Side s = frame_ordered_sides.at(i);
-				if (cv::abs(s.distance - cur_side_length) < m_fToleranceSide) {
-					eligible_sides.push_back(s);
-#if DEBUG_OUTPUT_OCCL
-					OutputDebugString(L"Found Eligible side for Tool ");
-					std::string my_str = tool.identifier + ": " + std::to_string(m) + " to " + std::to_string(k);
-					OutputDebugString(std::wstring(my_str.begin(), my_str.end()).c_str());
-					OutputDebugString(L"\n");
-#endif
-				}
-			}
-			if (eligible_sides.size() == 0 && max_occluded_spheres == 0)
-			{
-				tool.tracking_finished = true;
-				return;
-			}
-			if (eligible_sides.size() != 0)
+		if (curr.num_visited == num_model_spheres) {
+			if ((curr.combined_error / (curr.num_sides))<m_fToleranceAvg)
 			{
-				for (int occl_nodes = m+1; occl_nodes < k; occl_nodes++)
-				{
-					hidden_nodes_inside.push_back(occl_nodes);
+				//Back to tool sphere order, the visible spheres get the frame spheres and the others are occluded
+				int16_t frame_spheres[kMaxToolSpheres];
+				for (int j = 0; j < num_model_spheres; j++)
+					frame_spheres[sub_model.spheres[j]] = curr.visited_nodes_frame[j];
+				ToolResult r{};
+				r.error = curr.combined_error;
+				r.sphere_ids.reserve(num_model_spheres);
+				for (int node = 0; node < static_cast<int>(tool.num_spheres); node++) {
+					if (sub_model.occluded & (1ull << node))
+						r.occluded_nodes.push_back(node);
+					else
+						r.sphere_ids.push_back(frame_spheres[node]);
 				}
-				break;
+				result.candidates.push_back(r);
 			}
-		}
-		if (eligible_sides.size() == 0 && max_occluded_spheres == 0)
-		{
-			tool.tracking_finished = true;
-			return;
+			continue;
 		}
 
-			
-		if (eligible_sides.size() != 0)
-		{
-			std::vector<int> all_hidden_nodes;
-			all_hidden_nodes.reserve(hidden_nodes.size() + hidden_nodes_inside.size());
-			all_hidden_nodes.insert(all_hidden_nodes.end(), hidden_nodes.begin(), hidden_nodes.end());
-			all_hidden_nodes.insert(all_hidden_nodes.end(), hidden_nodes_inside.begin(), hidden_nodes_inside.end());
-			if (!(all_hidden_nodes.size() > max_occluded_spheres))
-			{
-				//From the start sides, add each direction to search queue
-				for (Side s : eligible_sides)
-				{
-					search_entry forward{ std::vector<int>{s.id_from, s.id_to}, cv::abs(s.distance - cur_side_length), 1, std::vector<int>{all_hidden_nodes} };
-					search_entry backward{ std::vector<int>{s.id_to, s.id_from}, cv::abs(s.distance - cur_side_length), 1, std::vector<int>{all_hidden_nodes} };
-					search_list.push_back(backward);
-					search_list.push_back(forward);
+		//The sub-model sphere the next frame sphere is compared against
+		int next_node = curr.num_visited;
+		//Sides between the visited spheres and the next one, the same for every candidate
+		float next_sides[Capacity];
+		for (int j = 0; j < curr.num_visited; j++)
+			next_sides[j] = model_side(j, next_node);
+		int num_frame_spheres = std::min(static_cast<int>(frame.num_spheres), static_cast<int>(kMaxFrameSpheres));
+		//Symmetric sub-models only take frame spheres above those of the spheres that have to be lower
+		int lowest_frame_sphere = 0;
+		for (uint64_t lower = sub_model.symmetry_lower_spheres[next_node]; lower != 0; lower &= lower - 1)
+			lowest_frame_sphere = std::max(lowest_frame_sphere, curr.visited_nodes_frame[IRLowestBit(lower)] + 1);
+		for (int word = lowest_frame_sphere / 64; word * 64 < num_frame_spheres; word++) {
+			//Frame spheres that are not used yet and neighbours of all visited ones, the others exceed a side tolerance
+			uint64_t unvisited = ~curr.visited_frame.words[word] & IRLowBits(num_frame_spheres - word * 64);
+			if (word * 64 < lowest_frame_sphere)
+				unvisited &= ~IRLowBits(lowest_frame_sphere - word * 64);
+			for (int j = 0; j < curr.num_visited; j++)
+				unvisited &= neighbours[size_t(curr.visited_nodes_frame[j]) * neighbour_words + word];
+			for (; unvisited != 0; unvisited &= unvisited - 1) {
+				int candidate_node_id = word * 64 + static_cast<int>(IRLowestBit(unvisited));
+				bool exceeded_side_tolerance = false;
+				float error_new = 0.f;
+				int error_counter = 0;
+				//At most Spheres - 1 visited spheres, a loop the fixed size kernels can unroll
+				for (int j = 0; j < (kFixed ? Spheres - 1 : curr.num_visited); j++) {
+					if (kFixed && j >= curr.num_visited)
+						break;
+					int id1 = curr.visited_nodes_frame[j];
+					int id2 = candidate_node_id;
+
+					//Swap if id1 is bigger than id2 (we only build a triangular distance matrix)
+					if (id1 > id2)
+					{
+						int temp = id1;
+						id1 = id2;
+						id2 = temp;
+					}
+					float error_side = cv::abs(frame_map[id1 * frame_map_step + id2] - next_sides[j]);
+					if (error_side > m_fToleranceSide) {
+						exceeded_side_tolerance = true;
+						break;
+					}
+					error_new += error_side;
+					error_counter++;
 				}
+				if (exceeded_side_tolerance)
+					continue;
+
+				SearchEntry<Capacity> next = curr;
+				next.visited_frame.Insert(candidate_node_id);
+				next.visited_nodes_frame[next.num_visited++] = static_cast<int16_t>(candidate_node_id);
+				next.combined_error += error_new;
+				next.num_sides += error_counter;
+				search_list.push_back(next);
 			}
+		}
+	}
+	return;
+}
 
-			
-			eligible_sides.clear();
+
+
+template void IRToolTracker::SearchSubModel<0, IRToolTracker::kGenericSearchCapacity>(const IRTrackedTool&, const IRToolSubModel&, const ProcessedAHATFrame&, SearchStack&, ToolResultContainer&);
+template void IRToolTracker::SearchSubModel<0, kMaxToolSpheres>(const IRTrackedTool&, const IRToolSubModel&, const ProcessedAHATFrame&, SearchStack&, ToolResultContainer&);
+template void IRToolTracker::SearchSubModel<3>(const IRTrackedTool&, const IRToolSubModel&, const ProcessedAHATFrame&, SearchStack&, ToolResultContainer&);
+template void IRToolTracker::SearchSubModel<4>(const IRTrackedTool&, const IRToolSubModel&, const ProcessedAHATFrame&, SearchStack&, ToolResultContainer&);
+template void IRToolTracker::SearchSubModel<5>(const IRTrackedTool&, const IRToolSubModel&, const ProcessedAHATFrame&, SearchStack&, ToolResultContainer&);
+template void IRToolTracker::SearchSubModel<6>(const IRTrackedTool&, const IRToolSubModel&, const ProcessedAHATFrame&, SearchStack&, ToolResultContainer&);
+
+void IRToolTracker::SearchOccluded(const IRTrackedTool& tool, const ProcessedAHATFrame& frame, SearchStack& stack, ToolResultContainer& result)
+{
+	const RadiusFrameData& frame_data = frame.per_radius[tool.radius_class];
+	const std::vector<Side>& frame_ordered_sides = frame_data.ordered_sides;
+	const float* frame_map = frame_data.map.ptr<float>();
+	size_t frame_map_step = frame_data.map.step / sizeof(float);
+	const uint64_t* neighbours = frame_data.neighbours.data();
+	size_t neighbour_words = static_cast<size_t>(frame_data.neighbour_words);
+
+	std::vector<OccludedSearchEntry>& search_list = stack.occluded_entries;
+	search_list.clear();
+
+	int num_tool_spheres = static_cast<int>(tool.num_spheres);
+	int max_occluded_spheres = num_tool_spheres - static_cast<int>(tool.min_visible_spheres);
+	//Every visible subset has one start side, between its first two spheres
+	for (int m = 0; m <= max_occluded_spheres; m++) {
+		for (int k = m + 1; k <= max_occluded_spheres + 1; k++) {
+			const SideRange& eligible_sides = frame.start_side_ranges[tool.start_side_ranges[size_t(m) * num_tool_spheres + k]];
+			if (eligible_sides.end <= eligible_sides.begin)
+				continue;
+			float start_side_length = tool.map.at<float>(m, k);
+			OccludedSearchEntry start{};
+			//Spheres [0, k) except m are occluded
+			start.occluded_tool = IRLowBits(k) & ~(1ull << m);
+			start.num_occluded = static_cast<uint8_t>(k - 1);
+			start.num_sides = 1;
+			start.num_visited = 2;
+			//From the start sides, add each direction to search queue
+			for (int i = eligible_sides.begin; i < eligible_sides.end; i++) {
+				const Side& s = frame_ordered_sides[i];
+				start.combined_error = cv::abs(s.distance - start_side_length);
+				start.visited_frame.Clear();
+				start.visited_frame.Insert(s.id_from);
+				start.visited_frame.Insert(s.id_to);
+				start.visited_nodes_frame[0] = static_cast<int16_t>(s.id_to);
+				start.visited_nodes_frame[1] = static_cast<int16_t>(s.id_from);
+				search_list.push_back(start);
+				start.visited_nodes_frame[0] = static_cast<int16_t>(s.id_from);
+				start.visited_nodes_frame[1] = static_cast<int16_t>(s.id_to);
+				search_list.push_back(start);
+			}
 		}
-		hidden_nodes.push_back(m);
 	}
 
 	while (search_list.size() > 0) {
-		search_entry curr = search_entry{ search_list.back() };
+		OccludedSearchEntry curr = search_list.back();
 		search_list.pop_back();
 
-		if (curr.occluded_nodes_tool.size() <= (max_occluded_spheres) &&
-			 curr.visited_nodes_frame.size() == (tool.num_spheres - curr.occluded_nodes_tool.size())) {
-			ToolResult r{};
-			r.error = curr.combined_error;
-			r.sphere_ids = curr.visited_nodes_frame;
-			r.occluded_nodes = curr.occluded_nodes_tool;
-			if ((curr.combined_error / (curr.num_sides))<m_fToleranceAvg)
+		if (curr.num_visited + curr.num_occluded == num_tool_spheres) {
+			if ((curr.combined_error / (curr.num_sides)) < m_fToleranceAvg)
 			{
-#if DEBUG_OUTPUT_OCCL
-				OutputDebugString(L"Found Candidate for Tool ");
-				std::stringstream result_string;
-				std::copy(curr.occluded_nodes_tool.begin(), curr.occluded_nodes_tool.end(), std::ostream_iterator<int>(result_string, " "));
-				std::string my_str = tool.identifier + " with Occl Spheres: " + result_string.str();
-				OutputDebugString(std::wstring(my_str.begin(), my_str.end()).c_str());
-				OutputDebugString(L"\n");
-#endif
-				//r.dist_to_prev = 
+				//Visited spheres are in tool sphere order already
+				ToolResult r{};
+				r.error = curr.combined_error;
+				r.sphere_ids.assign(curr.visited_nodes_frame, curr.visited_nodes_frame + curr.num_visited);
+				for (uint64_t occluded = curr.occluded_tool; occluded != 0; occluded &= occluded - 1)
+					r.occluded_nodes.push_back(static_cast<int>(IRLowestBit(occluded)));
 				result.candidates.push_back(r);
 			}
 			continue;
 		}
 
-		for (int candidate_node_id = 0; candidate_node_id < frame.num_spheres; candidate_node_id++) {
-			if (std::find(curr.visited_nodes_frame.begin(), curr.visited_nodes_frame.end(), candidate_node_id) != curr.visited_nodes_frame.end()) {
-				//Already used this element
-				continue;
-			}
-			bool exceeded_side_tolerance = false;
-			float error_new = 0.f;
-			int error_counter = 0;
-			int tool_node_id = 0;
-			for (int j = 0; j < curr.visited_nodes_frame.size(); j++) {
-				//Account for occluded nodes
-				while (std::find(curr.occluded_nodes_tool.begin(), curr.occluded_nodes_tool.end(), tool_node_id) != curr.occluded_nodes_tool.end()) {
-					tool_node_id++;
-				}
-				int id1 = curr.visited_nodes_frame.at(j);
-				int id2 = candidate_node_id;
-
-				//Swap if id1 is bigger than id2 (we only build a triangular distance matrix)
-				if (id1 > id2)
-				{
-					int temp = id1;
-					id1 = id2;
-					id2 = temp;
-				}
-				float error_side = cv::abs(frame_map.at<float>(id1, id2) - tool.map.at<float>(tool_node_id, curr.visited_nodes_frame.size()+curr.occluded_nodes_tool.size()));
-				if (error_side > m_fToleranceSide) {
-					exceeded_side_tolerance = true;
-					break;
+		//The tool sphere the next frame sphere is compared against
+		int next_tool_node = curr.num_visited + curr.num_occluded;
+		//Sides between the visited tool spheres and the next one, the same for every candidate
+		float next_sides[kMaxToolSpheres];
+		uint64_t tool_nodes = IRLowBits(next_tool_node) & ~curr.occluded_tool;
+		for (int j = 0; j < curr.num_visited; j++, tool_nodes &= tool_nodes - 1)
+			next_sides[j] = tool.map.at<float>(static_cast<int>(IRLowestBit(tool_nodes)), next_tool_node);
+		int num_frame_spheres = std::min(static_cast<int>(frame.num_spheres), static_cast<int>(kMaxFrameSpheres));
+		//Unvisited frame spheres failing a side of the next tool sphere, if there are any the tool sphere may be occluded
+		int num_rejected = num_frame_spheres - curr.num_visited;
+		for (int word = 0; word * 64 < num_frame_spheres; word++) {
+			//Frame spheres that are not used yet and neighbours of all visited ones, the others exceed a side tolerance
+			uint64_t unvisited = ~curr.visited_frame.words[word] & IRLowBits(num_frame_spheres - word * 64);
+			for (int j = 0; j < curr.num_visited; j++)
+				unvisited &= neighbours[size_t(curr.visited_nodes_frame[j]) * neighbour_words + word];
+			for (; unvisited != 0; unvisited &= unvisited - 1) {
+				int candidate_node_id = word * 64 + static_cast<int>(IRLowestBit(unvisited));
+				bool exceeded_side_tolerance = false;
+				float error_new = 0.f;
+				for (int j = 0; j < curr.num_visited; j++) {
+					int id1 = std::min(static_cast<int>(curr.visited_nodes_frame[j]), candidate_node_id);
+					int id2 = std::max(static_cast<int>(curr.visited_nodes_frame[j]), candidate_node_id);
+					float error_side = cv::abs(frame_map[id1 * frame_map_step + id2] - next_sides[j]);
+					if (error_side > m_fToleranceSide) {
+						exceeded_side_tolerance = true;
+						break;
+					}
+					error_new += error_side;
 				}
-				error_new += error_side;
-				error_counter++;
-				tool_node_id++;
+				if (exceeded_side_tolerance)
+					continue;
+
+				OccludedSearchEntry next = curr;
+				next.visited_frame.Insert(candidate_node_id);
+				next.visited_nodes_frame[next.num_visited++] = static_cast<int16_t>(candidate_node_id);
+				next.combined_error += error_new;
+				next.num_sides += curr.num_visited;
+				search_list.push_back(next);
+				num_rejected--;
 			}
-			if (exceeded_side_tolerance)
-			{
-				if (curr.occluded_nodes_tool.size() < (max_occluded_spheres))
-				{
-					std::vector<int> occluded_nodes_new = std::vector<int>(curr.occluded_nodes_tool);
-					occluded_nodes_new.push_back(curr.visited_nodes_frame.size() + curr.occluded_nodes_tool.size());
-					search_list.push_back(search_entry{ curr.visited_nodes_frame, curr.combined_error, curr.num_sides, occluded_nodes_new});
-				}
-				continue;
+		}
+		//Once per entry, pushing it for every rejected frame sphere only repeated the same branch
+		if (num_rejected > 0 && curr.num_occluded < max_occluded_spheres)
+		{
+			OccludedSearchEntry occluded = curr;
+			occluded.occluded_tool |= 1ull << next_tool_node;
+			occluded.num_occluded++;
+			search_list.push_back(occluded);
+		}
+	}
+}
+
+bool IRToolTracker::MatchPredicted(const IRTrackedTool& tool, const ProcessedAHATFrame& frame, float gate, ToolResultContainer& result)
+{
+	const RadiusFrameData& frame_data = frame.per_radius[tool.radius_class];
+	const cv::Mat3f& frame_xyz = frame_data.spheres_xyz;
+	const cv::Mat& frame_map = frame_data.map;
+
+	//Constant velocity: extrapolate the motion from the previous to the current pose to the frame's timestamp
+	const cv::Mat& cur = tool.cur_transform;
+	cv::Vec3f position(cur.at<float>(0, 0), cur.at<float>(1, 0), cur.at<float>(2, 0));
+	cv::Vec4f rotation(cur.at<float>(3, 0), cur.at<float>(4, 0), cur.at<float>(5, 0), cur.at<float>(6, 0));
+	if (tool.prev_timestamp != 0 && tool.prev_timestamp < tool.timestamp && tool.timestamp < frame.timestamp) {
+		const cv::Mat& prev = tool.prev_transform;
+		float steps = static_cast<float>(frame.timestamp - tool.timestamp) / static_cast<float>(tool.timestamp - tool.prev_timestamp);
+		cv::Vec3f position_prev(prev.at<float>(0, 0), prev.at<float>(1, 0), prev.at<float>(2, 0));
+		cv::Vec4f rotation_prev(prev.at<float>(3, 0), prev.at<float>(4, 0), prev.at<float>(5, 0), prev.at<float>(6, 0));
+		cv::Vec4f rotation_inv(-rotation_prev[0], -rotation_prev[1], -rotation_prev[2], rotation_prev[3]);
+		cv::Vec4f step = QuaternionMultiply(rotation, rotation_inv);
+		step = QuaternionSlerp(cv::Vec4f(0.f, 0.f, 0.f, 1.f), step, steps);
+		position += (position - position_prev) * steps;
+		rotation = QuaternionMultiply(step, rotation);
+		rotation *= 1.f / static_cast<float>(cv::norm(rotation));
+	}
+	position *= 1000.f;
+	float x = rotation[0], y = rotation[1], z = rotation[2], w = rotation[3];
+	cv::Vec3f R[3] = { { 1.f - 2.f * (y * y + z * z), 2.f * (x * y - z * w), 2.f * (x * z + y * w) },
+		{ 2.f * (x * y + z * w), 1.f - 2.f * (x * x + z * z), 2.f * (y * z - x * w) },
+		{ 2.f * (x * z - y * w), 2.f * (y * z + x * w), 1.f - 2.f * (x * x + y * y) } };
+
+	//Closest unused frame sphere within the gate of every predicted sphere
+	int num_frame_spheres = std::min(static_cast<int>(frame.num_spheres), static_cast<int>(kMaxFrameSpheres));
+	int frame_ids[kMaxToolSpheres];
+	IRNodeSet<kMaxFrameSpheres> used;
+	used.Clear();
+	int num_found = 0;
+	for (int node = 0; node < static_cast<int>(tool.num_spheres); node++) {
+		const cv::Vec3f& sphere = tool.spheres_xyz.at<cv::Vec3f>(node, 0);
+		cv::Vec3f predicted = cv::Vec3f(R[0].dot(sphere), R[1].dot(sphere), R[2].dot(sphere)) + position;
+		float best_distance = gate * gate;
+		frame_ids[node] = -1;
+		for (int id = 0; id < num_frame_spheres; id++) {
+			cv::Vec3f offset = frame_xyz.at<cv::Vec3f>(id, 0) - predicted;
+			float distance = offset.dot(offset);
+			if (distance < best_distance && !used.Contains(id)) {
+				best_distance = distance;
+				frame_ids[node] = id;
 			}
-				
-			std::vector<int> searched_ids_new = std::vector<int>(curr.visited_nodes_frame);
-			searched_ids_new.push_back(candidate_node_id);
-			search_list.push_back(search_entry{ searched_ids_new, curr.combined_error + error_new, curr.num_sides + error_counter, curr.occluded_nodes_tool});
+		}
+		if (frame_ids[node] >= 0) {
+			used.Insert(frame_ids[node]);
+			num_found++;
 		}
 	}
-	tool.tracking_finished = true;
-	return;
+	if (num_found < static_cast<int>(tool.min_visible_spheres))
+		return false;
+	return AcceptMatch(tool, frame_map, frame_ids, result);
 }
 
+bool IRToolTracker::MatchAssociated(const IRTrackedTool& tool, const cv::Mat3f& prev_spheres_xyd, const ProcessedAHATFrame& frame, float gate, ToolResultContainer& result)
+{
+	//Spheres occluded in the previous frame have no blob to start from, the prediction can still find them
+	for (int node = 0; node < static_cast<int>(tool.num_spheres); node++) {
+		if (tool.frame_spheres[node] < 0 || tool.frame_spheres[node] >= prev_spheres_xyd.rows)
+			return false;
+	}
+	const RadiusFrameData& frame_data = frame.per_radius[tool.radius_class];
+	const cv::Mat3f& frame_xyz = frame_data.spheres_xyz;
+
+	//Closest unused frame sphere within the gate of every sphere's previous position
+	int num_frame_spheres = std::min(static_cast<int>(frame.num_spheres), static_cast<int>(kMaxFrameSpheres));
+	int frame_ids[kMaxToolSpheres];
+	int num_found = 0;
+	for (int node = 0; node < static_cast<int>(tool.num_spheres); node++) {
+		const cv::Vec3f& xyd = prev_spheres_xyd.at<cv::Vec3f>(tool.frame_spheres[node], 0);
+		float norm = std::sqrt(xyd[0] * xyd[0] + xyd[1] * xyd[1] + 1.f);
+		float range = xyd[2] + tool.sphere_radius;
+		cv::Vec3f previous(xyd[0] * range / norm, xyd[1] * range / norm, range / norm);
+		//Moving by up to gate from depth z changes the unit plane position by at most gate * (1 + |xy|) / (z - gate)
+		float radius = gate * (1.f + std::abs(xyd[0]) + std::abs(xyd[1])) / std::max(previous[2] - gate, 1.f);
+
+		float best_distance = gate * gate;
+		frame_ids[node] = -1;
+		m_BlobGrid.ForEachNear(xyd[0], xyd[1], radius, [&](int id) {
+			if (id >= num_frame_spheres)
+				return;
+			cv::Vec3f offset = frame_xyz.at<cv::Vec3f>(id, 0) - previous;
+			float distance = offset.dot(offset);
+			if (distance < best_distance && std::find(frame_ids, frame_ids + node, id) == frame_ids + node) {
+				best_distance = distance;
+				frame_ids[node] = id;
+			}
+		});
+		if (frame_ids[node] >= 0)
+			num_found++;
+	}
+	if (num_found < static_cast<int>(tool.min_visible_spheres))
+		return false;
+	return AcceptMatch(tool, frame_data.map, frame_ids, result);
+}
 
+bool IRToolTracker::AcceptMatch(const IRTrackedTool& tool, const cv::Mat& frame_map, const int* frame_ids, ToolResultContainer& result)
+{
+	//Same acceptance as the search: every side within the side tolerance, the mean within the average tolerance
+	ToolResult candidate{};
+	float error = 0.f;
+	int num_sides = 0;
+	for (int node = 0; node < static_cast<int>(tool.num_spheres); node++) {
+		int id = frame_ids[node];
+		if (id < 0) {
+			candidate.occluded_nodes.push_back(node);
+			continue;
+		}
+		for (int other = node + 1; other < static_cast<int>(tool.num_spheres); other++) {
+			int other_id = frame_ids[other];
+			if (other_id < 0)
+				continue;
+			float frame_side = id < other_id ? frame_map.at<float>(id, other_id) : frame_map.at<float>(other_id, id);
+			float error_side = cv::abs(frame_side - tool.map.at<float>(node, other));
+			if (error_side > m_fToleranceSide)
+				return false;
+			error += error_side;
+			num_sides++;
+		}
+		candidate.sphere_ids.push_back(id);
+	}
+	if (error / num_sides >= m_fToleranceAvg)
+		return false;
+	candidate.error = error;
+	result.candidates.push_back(candidate);
+	return true;
+}
 
-void IRToolTracker::UnionSegmentation(ToolResultContainer* raw_solutions, int num_tools, ProcessedAHATFrame frame) {
+void IRToolTracker::UnionSegmentation(ToolResultContainer* raw_solutions, int num_tools, const ProcessedAHATFrame& frame) {
 #if DEBUG_OUTPUT
-	OutputDebugString(L"UnionSegmentation\n");
+	IRDebugOutput("UnionSegmentation\n");
 #endif
+	uint64_t union_start = IRPipelineStats::Now();
+	uint64_t kabsch_ns = 0, publish_ns = 0;
 	int* tool_solutions = new int[num_tools];
 	std::vector<ToolResult> unique_solutions;
 	for (int i = 0; i < num_tools; i++)
@@ -357,12 +715,25 @@ void IRToolTracker::UnionSegmentation(ToolResultContainer* raw_solutions, int nu
 		ToolResult current = unique_solutions.front();
 		int cur_toolid = current.tool_id;
 		unique_solutions.erase(unique_solutions.begin());
+		uint64_t kabsch_start = IRPipelineStats::Now();
 		cv::Mat result = MatchPointsKabsch(m_Tools[cur_toolid], frame, current.sphere_ids, current.occluded_nodes);
+		uint64_t publish_start = IRPipelineStats::Now();
+		kabsch_ns += publish_start - kabsch_start;
 		if (result.at<float>(7, 0) == 1.f)
 		{
-			m_Tools.at(cur_toolid).cur_transform = result.clone();
-			m_Tools.at(cur_toolid).timestamp = frame.timestamp;
+			IRTrackedTool& tool = m_Tools.at(cur_toolid);
+			std::swap(tool.prev_transform, tool.cur_transform);
+			tool.prev_timestamp = tool.timestamp;
+			tool.cur_transform = result.clone();
+			tool.timestamp = frame.timestamp;
+			//Visible spheres are in tool sphere order, the next frame starts looking for them at these blobs
+			size_t visible = 0;
+			for (int node = 0; node < static_cast<int>(tool.num_spheres); node++) {
+				bool occluded = std::find(current.occluded_nodes.begin(), current.occluded_nodes.end(), node) != current.occluded_nodes.end();
+				tool.frame_spheres[node] = occluded || visible >= current.sphere_ids.size() ? -1 : static_cast<int16_t>(current.sphere_ids[visible++]);
+			}
 		}
+		publish_ns += IRPipelineStats::Now() - publish_start;
 
 		std::vector<ToolResult> remaining_unique_solutions;
 		for (ToolResult next_check : unique_solutions) {
@@ -399,12 +770,25 @@ void IRToolTracker::UnionSegmentation(ToolResultContainer* raw_solutions, int nu
 		unique_solutions = remaining_unique_solutions;
 	}
 	delete[] tool_solutions;
+
+	m_pStats->Record(IR_STAGE_KABSCH, kabsch_ns);
+	m_pStats->Record(IR_STAGE_PUBLISH, publish_ns);
+	m_pStats->Record(IR_STAGE_UNION, IRPipelineStats::Now() - union_start - kabsch_ns - publish_ns);
 	return;
 }
 
-cv::Mat IRToolTracker::MatchPointsKabsch(IRTrackedTool tool, ProcessedAHATFrame frame, std::vector<int> sphere_ids, std::vector<int> occluded_nodes) {
+cv::Mat IRToolTracker::MatchPointsKabsch(const IRTrackedTool& tool, const ProcessedAHATFrame& frame, const std::vector<int>& sphere_ids, const std::vector<int>& occluded_nodes)
+{
+	//Indexed by IRTrackedTool::fixed_spheres
+	static const KabschKernel kernels[kMaxFixedKernelSpheres + 1] = { &IRToolTracker::MatchPointsKabschGeneric, nullptr, nullptr,
+		&IRToolTracker::MatchPointsKabschFixed<3>, &IRToolTracker::MatchPointsKabschFixed<4>, &IRToolTracker::MatchPointsKabschFixed<5>,
+		&IRToolTracker::MatchPointsKabschFixed<6> };
+	return (this->*kernels[tool.fixed_spheres])(tool, frame, sphere_ids, occluded_nodes);
+}
+
+cv::Mat IRToolTracker::MatchPointsKabschGeneric(const IRTrackedTool& tool, const ProcessedAHATFrame& frame, const std::vector<int>& sphere_ids, const std::vector<int>& occluded_nodes) {
 #if DEBUG_OUTPUT
-	OutputDebugString(L"MatchPointsKabsch\n");
+	IRDebugOutput("MatchPointsKabsch\n");
 #endif
 	int num_points = tool.num_spheres-occluded_nodes.size();
 	cv::Mat p = cv::Mat(num_points, 3, CV_32F);
@@ -412,8 +796,7 @@ cv::Mat IRToolTracker::MatchPointsKabsch(IRTrackedTool tool, ProcessedAHATFrame
 	cv::Vec3f p_center = cv::Vec3f(0.f);
 	cv::Vec3f q_center = cv::Vec3f(0.f);
 
-	auto it_spheres_xyz = frame.spheres_xyz_per_mm.find(tool.sphere_radius);
-	cv::Mat3f frame_spheres_xyz = it_spheres_xyz->second;
+	const cv::Mat3f& frame_spheres_xyz = frame.per_radius[tool.radius_class].spheres_xyz;
 
 	cv::Mat hololens_pose_mm = frame.hololens_pose.clone();
 	
@@ -421,7 +804,7 @@ cv::Mat IRToolTracker::MatchPointsKabsch(IRTrackedTool tool, ProcessedAHATFrame
 	//depthToWorldPose = hololens_pose_mm;
 
 	//std::string funcoutput = "Depth To World X Pos:" + std::to_string(depthToWorldPose.at<float>(0,3)) + "\n";
-	//OutputDebugString(std::wstring(funcoutput.begin(), funcoutput.end()).c_str());
+	//IRDebugOutput(funcoutput);
 
 
 
@@ -433,11 +816,12 @@ cv::Mat IRToolTracker::MatchPointsKabsch(IRTrackedTool tool, ProcessedAHATFrame
 	hololens_pose_mm.at<float>(2, 3) = hololens_pose_mm.at<float>(2, 3) * 1000.f;
 
 
-	int tool_node_id = 0;
-	for (int i = 0; i < num_points; i++) {
-		while (std::find(occluded_nodes.begin(), occluded_nodes.end(), tool_node_id) != occluded_nodes.end()) {
-			tool_node_id++;
-		}
+	//Tool spheres matched to sphere_ids, in the same order
+	uint64_t visible_nodes = IRLowBits(tool.num_spheres);
+	for (int occluded : occluded_nodes)
+		visible_nodes &= ~(1ull << occluded);
+	for (int i = 0; i < num_points; i++, visible_nodes &= visible_nodes - 1) {
+		int tool_node_id = static_cast<int>(IRLowestBit(visible_nodes));
 		cv::Vec3f sphere = tool.spheres_xyz.at<cv::Vec3f>(tool_node_id, 0);
 		
 
@@ -464,9 +848,9 @@ cv::Mat IRToolTracker::MatchPointsKabsch(IRTrackedTool tool, ProcessedAHATFrame
 
 		//Filter the resulting world position
 #if !DEBUG_NO_FILTER && !DISABLE_KALMAN
-		sphere_world = tool.sphere_kalman_filters.at(tool_node_id).FilterData(sphere_world);
+		IRToolKalmanFilter filter = tool.sphere_kalman_filters.at(tool_node_id);
+		sphere_world = filter.FilterData(sphere_world);
 #endif
-		tool_node_id++;
 
 
 		q.at<float>(i, 0) = sphere_world[0];
@@ -521,16 +905,170 @@ cv::Mat IRToolTracker::MatchPointsKabsch(IRTrackedTool tool, ProcessedAHATFrame
 
 	cv::Mat t = q_avgMat - (R * p_avgMat);
 
+	float rotation_matrix[3][3], translation_mm[3];
+	for (int r = 0; r < 3; r++) {
+		for (int c = 0; c < 3; c++)
+			rotation_matrix[r][c] = R.at<float>(r, c);
+		translation_mm[r] = t.at<float>(r, 0);
+	}
+	return ToolPose(tool, rotation_matrix, translation_mm);
+}
 
+//Eigenvector of the largest eigenvalue of the symmetric 4x4 matrix n, with cyclic Jacobi rotations
+static void LargestEigenvector4(double n[4][4], double result[4])
+{
+	double v[4][4] = { { 1, 0, 0, 0 }, { 0, 1, 0, 0 }, { 0, 0, 1, 0 }, { 0, 0, 0, 1 } };
+	double norm = 0.0;
+	for (int r = 0; r < 4; r++) {
+		for (int c = 0; c < 4; c++)
+			norm += n[r][c] * n[r][c];
+	}
+	for (int sweep = 0; sweep < 16; sweep++) {
+		double off = 0.0;
+		for (int r = 0; r < 3; r++) {
+			for (int c = r + 1; c < 4; c++)
+				off += n[r][c] * n[r][c];
+		}
+		if (off <= 1e-24 * norm)
+			break;
+		for (int p = 0; p < 3; p++) {
+			for (int q = p + 1; q < 4; q++) {
+				if (n[p][q] == 0.0)
+					continue;
+				//Rotation in the p, q plane that zeroes n[p][q], the smaller of the two angles
+				double theta = (n[q][q] - n[p][p]) / (2.0 * n[p][q]);
+				double t = (theta >= 0.0 ? 1.0 : -1.0) / (std::abs(theta) + std::sqrt(theta * theta + 1.0));
+				double c = 1.0 / std::sqrt(t * t + 1.0);
+				double s = t * c;
+				for (int k = 0; k < 4; k++) {
+					double kp = n[k][p], kq = n[k][q];
+					n[k][p] = c * kp - s * kq;
+					n[k][q] = s * kp + c * kq;
+				}
+				for (int k = 0; k < 4; k++) {
+					double pk = n[p][k], qk = n[q][k];
+					n[p][k] = c * pk - s * qk;
+					n[q][k] = s * pk + c * qk;
+				}
+				for (int k = 0; k < 4; k++) {
+					double kp = v[k][p], kq = v[k][q];
+					v[k][p] = c * kp - s * kq;
+					v[k][q] = s * kp + c * kq;
+				}
+			}
+		}
+	}
+	int largest = 0;
+	for (int i = 1; i < 4; i++) {
+		if (n[i][i] > n[largest][largest])
+			largest = i;
+	}
+	for (int k = 0; k < 4; k++)
+		result[k] = v[k][largest];
+}
+
+//Rotation taking the centered tool spheres to the centered frame spheres, cov[a][b] summing tool coordinate a times
+//frame coordinate b. Horn's closed form: the rotation is the unit quaternion maximizing the match, the eigenvector of
+//the largest eigenvalue of a symmetric 4x4 matrix of cov. Unlike the SVD it is always a proper rotation.
+static void HornRotation(const double cov[3][3], float rotation_matrix[3][3])
+{
+	double sxx = cov[0][0], sxy = cov[0][1], sxz = cov[0][2];
+	double syx = cov[1][0], syy = cov[1][1], syz = cov[1][2];
+	double szx = cov[2][0], szy = cov[2][1], szz = cov[2][2];
+	double n[4][4] = {
+		{ sxx + syy + szz, syz - szy, szx - sxz, sxy - syx },
+		{ syz - szy, sxx - syy - szz, sxy + syx, szx + sxz },
+		{ szx - sxz, sxy + syx, -sxx + syy - szz, syz + szy },
+		{ sxy - syx, szx + sxz, syz + szy, -sxx - syy + szz } };
+	double quat[4];
+	LargestEigenvector4(n, quat);
+	double w = quat[0], x = quat[1], y = quat[2], z = quat[3];
+	rotation_matrix[0][0] = static_cast<float>(w * w + x * x - y * y - z * z);
+	rotation_matrix[0][1] = static_cast<float>(2.0 * (x * y - w * z));
+	rotation_matrix[0][2] = static_cast<float>(2.0 * (x * z + w * y));
+	rotation_matrix[1][0] = static_cast<float>(2.0 * (x * y + w * z));
+	rotation_matrix[1][1] = static_cast<float>(w * w - x * x + y * y - z * z);
+	rotation_matrix[1][2] = static_cast<float>(2.0 * (y * z - w * x));
+	rotation_matrix[2][0] = static_cast<float>(2.0 * (x * z - w * y));
+	rotation_matrix[2][1] = static_cast<float>(2.0 * (y * z + w * x));
+	rotation_matrix[2][2] = static_cast<float>(w * w - x * x - y * y + z * z);
+}
+
+template<int Spheres>
+cv::Mat IRToolTracker::MatchPointsKabschFixed(const IRTrackedTool& tool, const ProcessedAHATFrame& frame, const std::vector<int>& sphere_ids, const std::vector<int>& occluded_nodes)
+{
+#if DEBUG_OUTPUT
+	IRDebugOutput("MatchPointsKabschFixed\n");
+#endif
+	const cv::Mat3f& frame_spheres_xyz = frame.per_radius[tool.radius_class].spheres_xyz;
+
+	//Tool spheres matched to sphere_ids, in the same order. The pose is relative to the camera, so the frame spheres
+	//are taken as they are, like the identity hololens pose of MatchPointsKabschGeneric does
+	uint64_t visible_nodes = IRLowBits(Spheres);
+	for (int occluded : occluded_nodes)
+		visible_nodes &= ~(1ull << occluded);
+	int num_points = Spheres - static_cast<int>(occluded_nodes.size());
+	double p[Spheres][3], q[Spheres][3];
+	double p_center[3] = { 0.0, 0.0, 0.0 }, q_center[3] = { 0.0, 0.0, 0.0 };
+	for (int i = 0; i < num_points; i++, visible_nodes &= visible_nodes - 1) {
+		int tool_node_id = static_cast<int>(IRLowestBit(visible_nodes));
+		cv::Vec3f sphere = tool.spheres_xyz.at<cv::Vec3f>(tool_node_id, 0);
+		cv::Vec3f sphere_world = frame_spheres_xyz.at<cv::Vec3f>(sphere_ids[i], 0);
+
+		//Filter the resulting world position
+#if !DEBUG_NO_FILTER && !DISABLE_KALMAN
+		IRToolKalmanFilter filter = tool.sphere_kalman_filters.at(tool_node_id);
+		sphere_world = filter.FilterData(sphere_world);
+#endif
+		for (int c = 0; c < 3; c++) {
+			p[i][c] = sphere[c];
+			q[i][c] = sphere_world[c];
+			p_center[c] += sphere[c];
+			q_center[c] += sphere_world[c];
+		}
+	}
+	for (int c = 0; c < 3; c++) {
+		p_center[c] /= num_points;
+		q_center[c] /= num_points;
+	}
+
+	double cov[3][3] = {};
+	for (int i = 0; i < num_points; i++) {
+		for (int a = 0; a < 3; a++) {
+			for (int b = 0; b < 3; b++)
+				cov[a][b] += (p[i][a] - p_center[a]) * (q[i][b] - q_center[b]);
+		}
+	}
+	float rotation_matrix[3][3];
+	HornRotation(cov, rotation_matrix);
+
+	float translation_mm[3];
+	for (int r = 0; r < 3; r++) {
+		translation_mm[r] = static_cast<float>(q_center[r] - (rotation_matrix[r][0] * p_center[0] + rotation_matrix[r][1] * p_center[1]
+			+ rotation_matrix[r][2] * p_center[2]));
+	}
+	return ToolPose(tool, rotation_matrix, translation_mm);
+}
+
+template cv::Mat IRToolTracker::MatchPointsKabschFixed<3>(const IRTrackedTool&, const ProcessedAHATFrame&, const std::vector<int>&, const std::vector<int>&);
+template cv::Mat IRToolTracker::MatchPointsKabschFixed<4>(const IRTrackedTool&, const ProcessedAHATFrame&, const std::vector<int>&, const std::vector<int>&);
+template cv::Mat IRToolTracker::MatchPointsKabschFixed<5>(const IRTrackedTool&, const ProcessedAHATFrame&, const std::vector<int>&, const std::vector<int>&);
+template cv::Mat IRToolTracker::MatchPointsKabschFixed<6>(const IRTrackedTool&, const ProcessedAHATFrame&, const std::vector<int>&, const std::vector<int>&);
+
+cv::Mat IRToolTracker::ToolPose([[maybe_unused]] const IRTrackedTool& tool, const float rotation_matrix[3][3], const float translation_mm[3])
+{
 	//Build transformation matrix
 	cv::Mat transform_matrix = cv::Mat::zeros(4, 4, CV_32F);
 
-	R.copyTo(transform_matrix(cv::Rect_<float>(0, 0, 3, 3)));
+	for (int r = 0; r < 3; r++) {
+		for (int c = 0; c < 3; c++)
+			transform_matrix.at<float>(r, c) = rotation_matrix[r][c];
+	}
 
 
-	transform_matrix.at<float>(0, 3) = t.at<float>(0, 0) / 1000.f;
-	transform_matrix.at<float>(1, 3) = t.at<float>(1, 0) / 1000.f;
-	transform_matrix.at<float>(2, 3) = t.at<float>(2, 0) / 1000.f;
+	transform_matrix.at<float>(0, 3) = translation_mm[0] / 1000.f;
+	transform_matrix.at<float>(1, 3) = translation_mm[1] / 1000.f;
+	transform_matrix.at<float>(2, 3) = translation_mm[2] / 1000.f;
 	transform_matrix.at<float>(3, 3) = 1.f;
 
 	// Concatenate at end instead for testing
@@ -556,13 +1094,13 @@ cv::Mat IRToolTracker::MatchPointsKabsch(IRTrackedTool tool, ProcessedAHATFrame
 	quat[1] *= (quat[1] * (transform_matrix.at<float>(0, 2) - transform_matrix.at<float>(2, 0))) >= 0.f ? 1.f : -1.f;
 	quat[2] *= (quat[2] * (transform_matrix.at<float>(1, 0) - transform_matrix.at<float>(0, 1))) >= 0.f ? 1.f : -1.f;
 
-	DirectX::XMVECTOR rotation{ quat[0], quat[1], quat[2], quat[3] };
+	cv::Vec4f rotation{ quat[0], quat[1], quat[2], quat[3] };
 
 #if !DISABLE_LOWPASS && !DEBUG_NO_FILTER
 	{
 		
-		DirectX::XMVECTOR rotation_old{ tool.cur_transform.at<float>(3, 0), tool.cur_transform.at<float>(4, 0), tool.cur_transform.at<float>(5, 0), tool.cur_transform.at<float>(6, 0) };
-		rotation = DirectX::XMQuaternionSlerp(rotation_old, rotation, tool.lowpass_factor_rotation);
+		cv::Vec4f rotation_old{ tool.cur_transform.at<float>(3, 0), tool.cur_transform.at<float>(4, 0), tool.cur_transform.at<float>(5, 0), tool.cur_transform.at<float>(6, 0) };
+		rotation = QuaternionSlerp(rotation_old, rotation, tool.lowpass_factor_rotation);
 		
 		cv::Vec3f position_old{ tool.cur_transform.at<float>(0, 0) ,tool.cur_transform.at<float>(1, 0) ,tool.cur_transform.at<float>(2, 0) };
 		position = tool.lowpass_factor_position*position+(1-tool.lowpass_factor_position)*position_old;
@@ -578,10 +1116,10 @@ cv::Mat IRToolTracker::MatchPointsKabsch(IRTrackedTool tool, ProcessedAHATFrame
 	position_rotation.at<float>(1, 0) = position[1];
 	position_rotation.at<float>(2, 0) = position[2];
 	//Quaternion
-	position_rotation.at<float>(3, 0) = rotation.vector4_f32[0];
-	position_rotation.at<float>(4, 0) = rotation.vector4_f32[1];
-	position_rotation.at<float>(5, 0) = rotation.vector4_f32[2];
-	position_rotation.at<float>(6, 0) = rotation.vector4_f32[3];
+	position_rotation.at<float>(3, 0) = rotation[0];
+	position_rotation.at<float>(4, 0) = rotation[1];
+	position_rotation.at<float>(5, 0) = rotation[2];
+	position_rotation.at<float>(6, 0) = rotation[3];
 	//Last float is used to determine visibility of the tool
 	position_rotation.at<float>(7, 0) = 1.f;
 
@@ -590,6 +1128,34 @@ cv::Mat IRToolTracker::MatchPointsKabsch(IRTrackedTool tool, ProcessedAHATFrame
 
 }
 
+cv::Vec4f IRToolTracker::QuaternionSlerp(cv::Vec4f from, cv::Vec4f to, float t)
+{
+	//Shortest path spherical interpolation, same behaviour as XMQuaternionSlerp
+	float cos_omega = from.dot(to);
+	if (cos_omega < 0.f) {
+		cos_omega = -cos_omega;
+		to = -to;
+	}
+	float scale_from = 1.f - t;
+	float scale_to = t;
+	if (cos_omega < 1.f - 0.00001f) {
+		float omega = std::acos(cos_omega);
+		float sin_omega = std::sin(omega);
+		scale_from = std::sin((1.f - t) * omega) / sin_omega;
+		scale_to = std::sin(t * omega) / sin_omega;
+	}
+	return from * scale_from + to * scale_to;
+}
+
+cv::Vec4f IRToolTracker::QuaternionMultiply(cv::Vec4f a, cv::Vec4f b)
+{
+	//Hamilton product of (x, y, z, w) quaternions, rotates by b first
+	return cv::Vec4f(a[3] * b[0] + a[0] * b[3] + a[1] * b[2] - a[2] * b[1],
+		a[3] * b[1] - a[0] * b[2] + a[1] * b[3] + a[2] * b[0],
+		a[3] * b[2] + a[0] * b[1] - a[1] * b[0] + a[2] * b[3],
+		a[3] * b[3] - a[0] * b[0] - a[1] * b[1] - a[2] * b[2]);
+}
+
 cv::Mat IRToolTracker::FlipTransformRightLeft(cv::Mat transform_rhs)
 {
 	//Bring to unity coordinate system
@@ -603,39 +1169,235 @@ cv::Mat IRToolTracker::FlipTransformRightLeft(cv::Mat transform_rhs)
 	return transform_lhs;
 }
 
-void IRToolTracker::ConstructMap(cv::Mat3f spheres_xyz, int num_spheres, cv::Mat& map, std::vector<Side>& ordered_sides)
+void IRToolTracker::ConstructMap(const cv::Mat3f& spheres_xyz, int num_spheres, cv::Mat& map, std::vector<Side>& ordered_sides)
 {
 #if DEBUG_OUTPUT
-	OutputDebugString(L"ConstructMap\n");
+	IRDebugOutput("ConstructMap\n");
 #endif
+	//Structure of arrays copy of the sphere centers for the vectorized distance kernel
+	m_MapPoints.resize(3 * size_t(num_spheres));
+	float* x = m_MapPoints.data();
+	float* y = x + num_spheres;
+	float* z = y + num_spheres;
 	for (int i = 0; i < num_spheres; i++) {
-		for (int j = i; j < num_spheres; j++) {
-			float distance = cv::norm(spheres_xyz.at<cv::Vec3f>(i, 0) - spheres_xyz.at<cv::Vec3f>(j, 0));
-			map.at<float>(i, j) = distance;
-			if (i == j)
-				continue;
-			Side s{};
-			s.distance = distance;
-			s.id_from = i;
-			s.id_to = j;
-			if (ordered_sides.size() < 1)
-				ordered_sides.push_back(s);
-			else {
-				if (distance >= ordered_sides.back().distance)
-					ordered_sides.push_back(s);
-				else if (distance <= ordered_sides.front().distance)
-					ordered_sides.insert(ordered_sides.begin(), s);
-				else {
-					auto it = std::upper_bound(ordered_sides.cbegin(), ordered_sides.cend(), s, &Side::compare);
-					ordered_sides.insert(it, s);
-				}
+		const cv::Vec3f& sphere = spheres_xyz.at<cv::Vec3f>(i, 0);
+		x[i] = sphere[0];
+		y[i] = sphere[1];
+		z[i] = sphere[2];
+	}
+	IRDistanceMatrix(x, y, z, num_spheres, map.ptr<float>(), map.step / sizeof(float));
+	OrderSides(map, num_spheres, std::numeric_limits<float>::infinity(), ordered_sides);
+}
+
+void IRToolTracker::OrderSides(const cv::Mat& map, int num_spheres, float max_side_length, std::vector<Side>& ordered_sides)
+{
+	ordered_sides.clear();
+	ordered_sides.reserve(size_t(num_spheres) * (num_spheres - 1) / 2);
+	for (int i = 0; i < num_spheres; i++) {
+		const float* row = map.ptr<float>(i);
+		for (int j = i + 1; j < num_spheres; j++) {
+			if (row[j] <= max_side_length)
+				ordered_sides.push_back(Side{ i, j, row[j] });
+		}
+	}
+	IRSortSides(ordered_sides, m_SideScratch);
+}
+
+void IRToolTracker::OptimizeSearchOrders()
+{
+	std::vector<const cv::Mat*> model_maps;
+	for (IRTrackedTool& tool : m_Tools) {
+		//Only spheres of the same radius end up in the same frame map
+		model_maps.clear();
+		for (const IRTrackedTool& other : m_Tools) {
+			if (other.sphere_radius == tool.sphere_radius)
+				model_maps.push_back(&other.map);
+		}
+		IRSearchOrder order = IROptimizeSearchOrder(tool.map, model_maps, m_fToleranceSide);
+		tool.branching_factor = order.branching_factor;
+
+		int num_spheres = static_cast<int>(tool.num_spheres);
+		bool unchanged = true;
+		for (int i = 0; i < num_spheres; i++)
+			unchanged &= order.spheres[i] == i;
+		if (unchanged)
+			continue;
+
+		//Everything indexed by tool sphere follows the new order, the pose does not depend on it
+		cv::Mat3f spheres(num_spheres, 1);
+		std::vector<int> search_order(num_spheres);
+		std::vector<IRToolKalmanFilter> filters;
+		std::vector<int16_t> frame_spheres(num_spheres);
+		for (int i = 0; i < num_spheres; i++) {
+			int node = order.spheres[i];
+			spheres.at<cv::Vec3f>(i, 0) = tool.spheres_xyz.at<cv::Vec3f>(node, 0);
+			search_order[i] = tool.search_order[node];
+			frame_spheres[i] = tool.frame_spheres[node];
+			filters.push_back(tool.sphere_kalman_filters.at(node));
+		}
+		tool.spheres_xyz = spheres;
+		tool.search_order = search_order;
+		tool.sphere_kalman_filters = filters;
+		tool.frame_spheres = frame_spheres;
+		cv::Mat map(cv::Size(num_spheres, num_spheres), CV_32F);
+		ConstructMap(spheres, num_spheres, map, tool.ordered_sides);
+		tool.map = map;
+	}
+}
+
+void IRToolTracker::BuildSideIndex()
+{
+	OptimizeSearchOrders();
+
+	m_SphereRadii.clear();
+	m_MaxSideLengths.clear();
+	m_SideIndexPerRadius.clear();
+	m_iNumStartSides = 0;
+	std::vector<const cv::Mat*> model_maps;
+	int num_tools = static_cast<int>(m_Tools.size());
+	for (int i = 0; i < num_tools; i++) {
+		IRTrackedTool& tool = m_Tools[i];
+		tool.fixed_spheres = tool.num_spheres >= 3 && tool.num_spheres <= kMaxFixedKernelSpheres ? static_cast<int>(tool.num_spheres) : 0;
+		tool.num_symmetries = static_cast<int>(IRFindToolSymmetries(tool.map).permutations.size());
+		//Few distinct radii, a linear search is enough
+		auto it_radius = std::find(m_SphereRadii.begin(), m_SphereRadii.end(), tool.sphere_radius);
+		tool.radius_class = static_cast<int>(it_radius - m_SphereRadii.begin());
+		if (it_radius == m_SphereRadii.end()) {
+			m_SphereRadii.push_back(tool.sphere_radius);
+			m_MaxSideLengths.push_back(0.f);
+			m_SideIndexPerRadius.emplace_back();
+		}
+		//The tool's sides are sorted, the last one is the longest
+		if (!tool.ordered_sides.empty())
+			m_MaxSideLengths[tool.radius_class] = std::max(m_MaxSideLengths[tool.radius_class], tool.ordered_sides.back().distance + m_fToleranceSide);
+
+		model_maps.clear();
+		for (const IRTrackedTool& other : m_Tools) {
+			if (other.sphere_radius == tool.sphere_radius)
+				model_maps.push_back(&other.map);
+		}
+		BuildSubModels(tool, model_maps);
+
+		//Sub-models starting at the same tool side share its frame sides
+		int num_spheres = static_cast<int>(tool.num_spheres);
+		std::vector<int> side_ranges(size_t(num_spheres) * num_spheres, -1);
+		std::vector<IndexedSide>& index = m_SideIndexPerRadius[tool.radius_class];
+		auto start_side_range = [&](int a, int b) {
+			int& range = side_ranges[size_t(a) * num_spheres + b];
+			if (range < 0) {
+				range = m_iNumStartSides++;
+				index.push_back(IndexedSide{ tool.map.at<float>(a, b), i, range });
+			}
+			return range;
+		};
+		for (IRToolSubModel& sub_model : tool.sub_models)
+			sub_model.start_side_range = start_side_range(std::min(sub_model.spheres[0], sub_model.spheres[1]), std::max(sub_model.spheres[0], sub_model.spheres[1]));
+		tool.start_side_ranges.clear();
+		if (tool.search_occluded) {
+			//The first two visible spheres of every subset SearchOccluded may find
+			int max_occluded_spheres = num_spheres - static_cast<int>(tool.min_visible_spheres);
+			for (int m = 0; m <= max_occluded_spheres; m++) {
+				for (int k = m + 1; k <= max_occluded_spheres + 1; k++)
+					start_side_range(m, k);
+			}
+			tool.start_side_ranges = side_ranges;
+		}
+	}
+	for (auto& index : m_SideIndexPerRadius) {
+		std::sort(index.begin(), index.end(), [](const IndexedSide& a, const IndexedSide& b) { return a.distance < b.distance; });
+	}
+	m_TriangleMatcher.Build(m_Tools, m_fToleranceSide);
+}
+
+size_t IRToolTracker::NumSubModels(uint num_spheres, uint min_visible_spheres)
+{
+	//Sum of the binomial coefficients over the number of occluded spheres, they overflow for large tools so the sum
+	//stops once it exceeds kMaxToolSubModels
+	size_t total = 0, subsets = 1;
+	for (uint num_occluded = 0; num_occluded + min_visible_spheres <= num_spheres && total <= kMaxToolSubModels; num_occluded++) {
+		total += subsets;
+		subsets = subsets * (num_spheres - num_occluded) / (num_occluded + 1);
+	}
+	return total;
+}
+
+void IRToolTracker::BuildSubModels(IRTrackedTool& tool, const std::vector<const cv::Mat*>& model_maps)
+{
+	tool.sub_models.clear();
+	tool.search_occluded = NumSubModels(tool.num_spheres, tool.min_visible_spheres) > kMaxToolSubModels;
+	if (tool.search_occluded)
+		return;
+	int num_spheres = static_cast<int>(tool.num_spheres);
+	int max_occluded_spheres = num_spheres - static_cast<int>(tool.min_visible_spheres);
+	auto side_length = [](const cv::Mat& map, int a, int b) { return a < b ? map.at<float>(a, b) : map.at<float>(b, a); };
+	//Every sub-model of every tool of the radius class is reordered whenever a tool is added, beyond this many the
+	//sub-models keep the tool's order
+	constexpr size_t kMaxOptimizedSubModels = 256;
+	bool optimize = NumSubModels(tool.num_spheres, tool.min_visible_spheres) <= kMaxOptimizedSubModels;
+	int visible[kMaxToolSpheres];
+	//By growing number of occluded spheres, so the largest sub-models come first
+	for (int num_occluded = 0; num_occluded <= max_occluded_spheres; num_occluded++) {
+		uint64_t occluded = IRLowBits(num_occluded);
+		while (true) {
+			IRToolSubModel sub_model;
+			sub_model.occluded = occluded;
+			sub_model.num_spheres = num_spheres - num_occluded;
+			for (int node = 0, j = 0; node < num_spheres; node++) {
+				if ((occluded & (1ull << node)) == 0)
+					visible[j++] = node;
+			}
+			cv::Mat map = cv::Mat::zeros(sub_model.num_spheres, sub_model.num_spheres, CV_32F);
+			for (int a = 0; a < sub_model.num_spheres; a++) {
+				for (int b = a + 1; b < sub_model.num_spheres; b++)
+					map.at<float>(a, b) = tool.map.at<float>(visible[a], visible[b]);
+			}
+			//The tool's spheres are in search order already, a sub-model keeping its start side keeps that order
+			std::vector<int> order(sub_model.num_spheres);
+			std::iota(order.begin(), order.end(), 0);
+			if (optimize && (occluded & 3ull) != 0)
+				order = IROptimizeSearchOrder(map, model_maps, m_fToleranceSide).spheres;
+			sub_model.map = cv::Mat::zeros(sub_model.num_spheres, sub_model.num_spheres, CV_32F);
+			sub_model.spheres.resize(sub_model.num_spheres);
+			for (int a = 0; a < sub_model.num_spheres; a++) {
+				sub_model.spheres[a] = static_cast<int8_t>(visible[order[a]]);
+				for (int b = a + 1; b < sub_model.num_spheres; b++)
+					sub_model.map.at<float>(a, b) = side_length(map, order[a], order[b]);
 			}
+			sub_model.fixed_spheres = sub_model.num_spheres >= 3 && sub_model.num_spheres <= static_cast<int>(kMaxFixedKernelSpheres) ? sub_model.num_spheres : 0;
+			IRToolSymmetries symmetries = IRFindToolSymmetries(sub_model.map);
+			sub_model.symmetry_lower_spheres = symmetries.lower_spheres;
+			tool.sub_models.push_back(sub_model);
 
+			if (occluded == 0)
+				break;
+			//Next larger mask with as many bits set, done once it would need a bit above the tool's spheres
+			uint64_t lowest = occluded & (~occluded + 1);
+			uint64_t ripple = occluded + lowest;
+			if (ripple == 0 || (ripple & ~IRLowBits(num_spheres)) != 0)
+				break;
+			occluded = (((ripple ^ occluded) >> 2) / lowest) | ripple;
 		}
 	}
 }
 
-void IRToolTracker::AddEnvFrame(void* pLFImage, void* pRFImage, size_t LFOutBufferCount, INT64 tsLF, INT64 tsRF, float* pLFExtr, float* pRFExtr)
+void IRToolTracker::MatchStartSides(const std::vector<Side>& frame_sides, const std::vector<IndexedSide>& index, std::vector<SideRange>& ranges, std::vector<uint8_t>& tool_has_start_side)
+{
+	//Both lists are sorted by length, so the window of frame sides within the tolerance only moves forward
+	int begin = 0, end = 0;
+	int num_frame_sides = static_cast<int>(frame_sides.size());
+	for (const IndexedSide& side : index) {
+		while (begin < num_frame_sides && frame_sides[begin].distance - side.distance <= -m_fToleranceSide)
+			begin++;
+		end = std::max(end, begin);
+		while (end < num_frame_sides && frame_sides[end].distance - side.distance < m_fToleranceSide)
+			end++;
+		ranges[side.range] = SideRange{ begin, end };
+		if (end > begin)
+			tool_has_start_side[side.tool] = 1;
+	}
+}
+
+void IRToolTracker::AddEnvFrame(void* pLFImage, void* pRFImage, size_t LFOutBufferCount, int64_t tsLF, int64_t tsRF, float* pLFExtr, float* pRFExtr)
 {
 	m_MutexCurEnvFrame.lock();
 
@@ -644,9 +1406,9 @@ void IRToolTracker::AddEnvFrame(void* pLFImage, void* pRFImage, size_t LFOutBuff
 		m_CurEnvFrameBuffer.pop_back();
 	}
 
-	EnvFrame* newFrame = new EnvFrame{new UINT8[LFOutBufferCount], new UINT8[LFOutBufferCount], new float[12], new float[12], tsLF, tsRF};
-	memcpy(newFrame->pLFImage, pLFImage, LFOutBufferCount * sizeof(UINT8));
-	memcpy(newFrame->pRFImage, pRFImage, LFOutBufferCount * sizeof(UINT8));
+	EnvFrame* newFrame = new EnvFrame{new uint8_t[LFOutBufferCount], new uint8_t[LFOutBufferCount], new float[12], new float[12], tsLF, tsRF};
+	memcpy(newFrame->pLFImage, pLFImage, LFOutBufferCount * sizeof(uint8_t));
+	memcpy(newFrame->pRFImage, pRFImage, LFOutBufferCount * sizeof(uint8_t));
 	memcpy(newFrame->pLFExtr, pLFExtr, 12 * sizeof(float));
 	memcpy(newFrame->pRFExtr, pRFExtr, 12 * sizeof(float));
 	m_CurEnvFrameBuffer.insert(m_CurEnvFrameBuffer.begin(), newFrame);
@@ -654,9 +1416,7 @@ void IRToolTracker::AddEnvFrame(void* pLFImage, void* pRFImage, size_t LFOutBuff
 #if DEBUG_OUTPUT
 	std::string my_str = "Add Env Frame: \nTS Left = ";
 	my_str += (std::to_string(m_curEnvFrame->tsLF) + "; TS Right = " + std::to_string(m_curEnvFrame->tsRF) + "; Difference = " + std::to_string(m_curEnvFrame->tsLF-m_curEnvFrame->tsRF) + ";\n");
-	std::wstring stemp = std::wstring(my_str.begin(), my_str.end());
-	LPCWSTR my2 = stemp.c_str();
-	OutputDebugString(my2);
+	IRDebugOutput(my_str);
 #endif 
 
 	m_MutexCurEnvFrame.unlock();
@@ -664,79 +1424,122 @@ void IRToolTracker::AddEnvFrame(void* pLFImage, void* pRFImage, size_t LFOutBuff
 	
 }
 
-void IRToolTracker::AddFrame(void* pAbImage, void* pDepth, UINT32 depthWidth, UINT32 depthHeight, cv::Mat _pose, INT64 _timestamp) {
+void IRToolTracker::AddFrame(void* pAbImage, void* pDepth, uint32_t depthWidth, uint32_t depthHeight, cv::Mat _pose, int64_t _timestamp) {
 
 #if DEBUG_OUTPUT
-	OutputDebugString(L"Add Frame\n");
+	IRDebugOutput("Add Frame\n");
 #endif 
-	cv::Mat cvAbImage_origin(512, 512, CV_16UC1, (void*)pAbImage);
-	cv::Mat cvAbImage = cvAbImage_origin.clone();
-
-	m_MutexCurFrame.lock();
-
-	if (m_CurrentFrame != nullptr) {
-		delete[] m_CurrentFrame->pDepth;
-		delete m_CurrentFrame;
-	}
-
-	m_CurrentFrame = new AHATFrame { _timestamp, _pose, cvAbImage,  new UINT16[depthWidth * depthHeight], depthWidth, depthHeight };
-	memcpy(m_CurrentFrame->pDepth, pDepth, depthWidth * depthHeight * sizeof(UINT16));
+	//Fill a preallocated slot, an older frame the tracker did not pick up yet is dropped on publish
+	AHATFrame* frame = CopyToPool(pAbImage, pDepth, depthWidth, depthHeight, _pose, _timestamp);
+	if (frame == nullptr)
+		return;
+	m_FramePool.Publish(frame);
 
 
 #if DEBUG_OUTPUT
 	std::string my_str = "Add Frame: \nTS = ";
 	my_str += (std::to_string(_timestamp) + ";\n");
-	std::wstring stemp = std::wstring(my_str.begin(), my_str.end());
-	LPCWSTR my2 = stemp.c_str();
-	OutputDebugString(my2);
+	IRDebugOutput(my_str);
 #endif 
 
-	m_MutexCurFrame.unlock();
-
-	
-	
-
 }
 
 bool IRToolTracker::ProcessFrame(AHATFrame* rawFrame, ProcessedAHATFrame &result) {
 #if DEBUG_OUTPUT
-	OutputDebugString(L"ProcessFrame\n");
+	IRDebugOutput("ProcessFrame\n");
 #endif
 
+	uint64_t stage_start = IRPipelineStats::Now();
+	ThresholdAbImage(rawFrame->cvAbImage, rawFrame->cvMask);
+	m_pStats->RecordSince(IR_STAGE_THRESHOLD, stage_start);
+
+	//cv::imshow("TEST", rawFrame->cvMask);
+
+	stage_start = IRPipelineStats::Now();
+	cv::Mat3f spheres = ExtractBlobs(rawFrame->cvMask, rawFrame->pDepth, rawFrame->depthWidth);
+	m_pStats->RecordSince(IR_STAGE_CCL, stage_start);
+
+	int num_spheres = spheres.size().height;
+
+	if (num_spheres < 3) {
+		//If theres less than 3 points visible, theres no tool to track
+		return false;
+	}
+
+	//Create 3d coordinates for every sphere size, into the buffers of the previous frame
+	stage_start = IRPipelineStats::Now();
+	ProjectRays(spheres);
+	int num_classes = static_cast<int>(m_SphereRadii.size());
+	result.per_radius.resize(num_classes);
+	result.start_side_ranges.assign(m_iNumStartSides, SideRange{});
+	result.tool_has_start_side.assign(m_Tools.size(), 0);
+	for (int radius_class = 0; radius_class < num_classes; radius_class++)
+	{
+		RadiusFrameData& data = result.per_radius[radius_class];
+		BackProjectSpheres(spheres, m_SphereRadii[radius_class], m_MaxSideLengths[radius_class], data);
+		MatchStartSides(data.ordered_sides, m_SideIndexPerRadius[radius_class], result.start_side_ranges, result.tool_has_start_side);
+	}
+	m_pStats->RecordSince(IR_STAGE_MAP_BUILD, stage_start);
+
+
+	result.timestamp = rawFrame->timestamp;
+	result.hololens_pose = rawFrame->hololens_pose;
+	result.num_spheres = static_cast<uint>(num_spheres);
+	//ExtractBlobs returns a new matrix every frame
+	result.spheres_xyd = spheres;
+
+	return true;
+}
 
+void IRToolTracker::ThresholdAbImage(const cv::Mat& abImage, cv::Mat& mask)
+{
 	ushort lowerLimit = 256 * 5;
 	ushort upperLimit = lowerLimit + 1;// 256 * 20;
+
+	//No-op if the mask is preallocated
+	mask.create(abImage.rows, abImage.cols, CV_8UC1);
+
+	//With upperLimit = lowerLimit + 1 the clamp formula is a binary threshold at upperLimit
+	if (abImage.isContinuous() && mask.isContinuous()) {
+		IRThresholdAbImage(abImage.ptr<uint16_t>(), mask.ptr<uint8_t>(), abImage.total(), upperLimit);
+		return;
+	}
+	for (int y = 0; y < abImage.rows; y++) {
+		IRThresholdAbImage(abImage.ptr<uint16_t>(y), mask.ptr<uint8_t>(y), abImage.cols, upperLimit);
+	}
+}
+
+cv::Mat3f IRToolTracker::ExtractBlobs(const cv::Mat& mask, const uint16_t* pDepth, uint32_t depthWidth)
+{
 	int minSize = 10, maxSize = 180;
-	cv::Mat labels, stats, centroids;
 	std::vector<float> irToolCenters;
-	
-	rawFrame->cvAbImage.forEach<ushort>(
-		[&](ushort& ir, const int* position) -> void {
-			ir = (std::clamp(ir, lowerLimit, upperLimit) - lowerLimit) / (upperLimit - lowerLimit)*255;
-		}
-	);
-	
-	rawFrame->cvAbImage.convertTo(rawFrame->cvAbImage, CV_8UC1);
-
 
-	//cv::imshow("TEST", rawFrame->cvAbImage);
+	const std::vector<IRBlob>& blobs = m_BlobLabeller.Label(mask);
 
-	int areaCount = cv::connectedComponentsWithStats(rawFrame->cvAbImage, labels, stats, centroids, 8);
-	
+	//Set by CopyToPool before the frame was handed over, the camera model is only a fallback for masks of another size
+	std::shared_ptr<const IRLutCameraIntrinsics> lut = GetUnitPlaneLut();
+	if (lut != nullptr && (lut->GetWidth() != static_cast<uint32_t>(mask.cols) || lut->GetHeight() != static_cast<uint32_t>(mask.rows)))
+		lut = nullptr;
 
-	for (int i = 1; i < areaCount; ++i)
+	//UnionSegmentation indexes m_prime_numbers with blob ids and TrackTool keeps them in sets of kMaxFrameSpheres,
+	//blobs beyond that cannot be used
+	const size_t max_blobs = std::min(sizeof(m_prime_numbers) / sizeof(m_prime_numbers[0]), size_t(kMaxFrameSpheres));
+	for (size_t i = 0; i < blobs.size() && irToolCenters.size() / 3 < max_blobs; ++i)
 	{
-		auto area = stats.at<int32_t>(i, cv::CC_STAT_AREA);
+		int area = blobs[i].area;
 		if (area <= maxSize && area >= minSize)
 		{
-			double _u = centroids.at<double>(i, 0);
-			double _v = centroids.at<double>(i, 1);
-			float uv[2] = { _u + 0.5, _v + 0.5 };
+			double _u = blobs[i].centroid_x;
+			double _v = blobs[i].centroid_y;
+			float uv[2] = { static_cast<float>(_u + 0.5), static_cast<float>(_v + 0.5) };
 			float xy[2] = { 0, 0 };
 
-			float depth = (static_cast<float>(rawFrame->pDepth[rawFrame->depthWidth * (UINT16)_v + (UINT16)_u]));
+			float depth = (static_cast<float>(pDepth[depthWidth * (uint16_t)_v + (uint16_t)_u]));
 
-			m_pResearchMode->DepthMapImagePointToCameraUnitPlane(uv, xy);
+			if (lut != nullptr)
+				lut->Interpolate(uv[0], uv[1], xy);
+			else
+				m_pIntrinsics->MapImagePointToCameraUnitPlane(uv, xy);
 			irToolCenters.push_back(xy[0]);
 			irToolCenters.push_back(xy[1]);
 			irToolCenters.push_back(depth);
@@ -752,79 +1555,81 @@ bool IRToolTracker::ProcessFrame(AHATFrame* rawFrame, ProcessedAHATFrame &result
 		spheres.at<cv::Vec3f>(j_sphere, 0) = cv::Vec3f(irToolCenters.at(i_sphere), irToolCenters.at(i_sphere + 1), irToolCenters.at(i_sphere + 2));
 		j_sphere++;
 	}
+	return spheres;
+}
 
-	int num_spheres = spheres.size().height;
-
-	if (num_spheres < 3) {
-		//If theres less than 3 points visible, theres no tool to track
-		//Free memory
-		delete[] rawFrame->pDepth;
-		delete rawFrame;
-		return false;
+void IRToolTracker::ProjectRays(const cv::Mat3f& spheres_xyd)
+{
+	int num_spheres = spheres_xyd.rows;
+	m_Rays.resize(3 * size_t(num_spheres));
+	float* x = m_Rays.data();
+	float* y = x + num_spheres;
+	float* z = y + num_spheres;
+	for (int i = 0; i < num_spheres; i++) {
+		const cv::Vec3f& xyd = spheres_xyd.at<cv::Vec3f>(i, 0);
+		float norm = std::sqrt(xyd[0] * xyd[0] + xyd[1] * xyd[1] + 1.f);
+		x[i] = xyd[0] / norm;
+		y[i] = xyd[1] / norm;
+		z[i] = 1.f / norm;
 	}
+}
 
-	//Create 3d coordinates for every possible sphere size
-	std::map<float, std::vector<Side>> ordered_sides_per_mm;
-	std::map<float, cv::Mat> map_per_mm;
-	std::map<float, cv::Mat3f> spheres_xyz_per_mm;
-
-	for (IRTrackedTool tool : m_Tools)
-	{
-		float cur_radius = tool.sphere_radius;
-		if (!(spheres_xyz_per_mm.find(cur_radius) == spheres_xyz_per_mm.end())) {
-			//We already created this map
-			continue;
-		}
-
-
-		cv::Mat3f spheres_xyz = spheres.clone();
-
-
-		spheres_xyz.forEach(
-			[&](cv::Vec3f& xyz, const int* position) -> void {
-				xyz[2] = xyz[2] + cur_radius;
-				cv::Vec3f temp_vec(xyz[0], xyz[1], 1);
-				xyz = cv::Vec3f((temp_vec / cv::norm(temp_vec)) * xyz[2]);
-			}
-		);
-
-		//Construct map
-		cv::Mat map(cv::Size(num_spheres, num_spheres), CV_32F);
-		std::vector<Side> ordered_sides;
-
-		ConstructMap(spheres_xyz, num_spheres, map, ordered_sides);
-
-		ordered_sides_per_mm.insert({ cur_radius, ordered_sides });
-		map_per_mm.insert({ cur_radius, map });
-		spheres_xyz_per_mm.insert({ cur_radius, spheres_xyz });
-
+void IRToolTracker::BackProjectSpheres(const cv::Mat3f& spheres_xyd, float sphere_radius, float max_side_length, RadiusFrameData& result)
+{
+	//The depth image measures the sphere surface, the center lies one radius further along the ray
+	int num_spheres = spheres_xyd.rows;
+	const float* ray_x = m_Rays.data();
+	const float* ray_y = ray_x + num_spheres;
+	const float* ray_z = ray_y + num_spheres;
+	m_MapPoints.resize(3 * size_t(num_spheres));
+	float* x = m_MapPoints.data();
+	float* y = x + num_spheres;
+	float* z = y + num_spheres;
+	result.sphere_radius = sphere_radius;
+	result.spheres_xyz.create(num_spheres, 1);
+	for (int i = 0; i < num_spheres; i++) {
+		float depth = spheres_xyd.at<cv::Vec3f>(i, 0)[2] + sphere_radius;
+		x[i] = ray_x[i] * depth;
+		y[i] = ray_y[i] * depth;
+		z[i] = ray_z[i] * depth;
+		result.spheres_xyz.at<cv::Vec3f>(i, 0) = cv::Vec3f(x[i], y[i], z[i]);
 	}
 
-
-	result.timestamp = rawFrame->timestamp;
-	result.hololens_pose = rawFrame->hololens_pose;
-	result.num_spheres = static_cast<uint>(num_spheres);
-	result.spheres_xyd = spheres.clone();
-	result.spheres_xyz_per_mm = spheres_xyz_per_mm;
-	result.ordered_sides_per_mm = ordered_sides_per_mm;
-	result.map_per_mm = map_per_mm;
-
-
-	//Free memory
-	delete[] rawFrame->pDepth;
-	delete rawFrame;
-
-	return true;
+	result.map.create(num_spheres, num_spheres, CV_32F);
+	IRDistanceMatrix(x, y, z, num_spheres, result.map.ptr<float>(), result.map.step / sizeof(float));
+	OrderSides(result.map, num_spheres, max_side_length, result.ordered_sides);
+
+	//Spheres further apart than max_side_length cannot both be on a tool, TrackTool only extends a match by neighbours
+	int words = (num_spheres + 63) / 64;
+	result.neighbour_words = words;
+	result.neighbours.assign(size_t(num_spheres) * words, 0);
+	uint64_t* neighbours = result.neighbours.data();
+	for (const Side& s : result.ordered_sides) {
+		neighbours[size_t(s.id_from) * words + (s.id_to >> 6)] |= 1ull << (s.id_to & 63);
+		neighbours[size_t(s.id_to) * words + (s.id_from >> 6)] |= 1ull << (s.id_from & 63);
+	}
 }
 
-bool IRToolTracker::AddTool(cv::Mat3f spheres, float sphere_radius, std::string identifier, uint min_visible_spheres, float lowpass_rotation, float lowpass_position)
+bool IRToolTracker::AddTool(cv::Mat3f spheres, float sphere_radius, std::string identifier, uint min_visible_spheres, float lowpass_rotation, float lowpass_position,
+	IRAddToolError* pError)
 {
 #if DEBUG_OUTPUT
-	OutputDebugString(L"AddTool\n");
+	IRDebugOutput("AddTool\n");
 #endif
+	IRAddToolError error = IR_ADD_TOOL_OK;
 	//Do we already have this tool?
 	if (m_ToolIndexMapping.count(identifier) > 0)
+		error = IR_ADD_TOOL_DUPLICATE_IDENTIFIER;
+	else if (spheres.size().height > static_cast<int>(kMaxToolSpheres))
+		error = IR_ADD_TOOL_TOO_MANY_SPHERES;
+	if (pError != nullptr)
+		*pError = error;
+	if (error != IR_ADD_TOOL_OK) {
+		std::string reason = error == IR_ADD_TOOL_DUPLICATE_IDENTIFIER ? std::string("the identifier is in use")
+			: "it has more than " + std::to_string(kMaxToolSpheres) + " spheres";
+		IRDebugOutput("AddTool: " + identifier + " was not added, " + reason + "\n");
 		return false;
+	}
 
 	bool restartTracking = false;
 	if (m_bIsCurrentlyTracking) {
@@ -837,6 +1642,9 @@ bool IRToolTracker::AddTool(cv::Mat3f spheres, float sphere_radius, std::string
 	tool.identifier = identifier;
 	tool.num_spheres = spheres.size().height;
 	tool.spheres_xyz = spheres;
+	tool.search_order.resize(tool.num_spheres);
+	std::iota(tool.search_order.begin(), tool.search_order.end(), 0);
+	tool.frame_spheres.assign(tool.num_spheres, -1);
 	tool.sphere_radius = sphere_radius;
 	tool.min_visible_spheres = std::max((uint)3, std::min(min_visible_spheres, tool.num_spheres));
 	tool.lowpass_factor_position = lowpass_position;
@@ -855,24 +1663,25 @@ bool IRToolTracker::AddTool(cv::Mat3f spheres, float sphere_radius, std::string
 	//Add to map so we can find the tool with name
 	m_ToolIndexMapping.insert({ identifier, m_Tools.size() });
 	m_Tools.push_back(tool);
-	OutputDebugString(L"On Device Tracking Added Tool\n");
+	BuildSideIndex();
+	{
+		std::lock_guard<std::mutex> lock(m_MutexToolDefinitions);
+		m_ToolDefinitions.push_back(IRToolDefinition{ identifier, spheres.clone(), sphere_radius, tool.min_visible_spheres, lowpass_rotation, lowpass_position });
+	}
 
 #if DEBUG_OUTPUT
-	OutputDebugString(L"New Tool Added:\n");
+	IRDebugOutput("On Device Tracking Added Tool\n");
+	IRDebugOutput("New Tool Added:\n");
 	std::string my_str = "Spheres:\n";
 	my_str << tool.spheres_xyz;
-	std::wstring stemp = std::wstring(my_str.begin(), my_str.end());
-	LPCWSTR my2 = stemp.c_str();
-	OutputDebugString(my2);
-	OutputDebugString(L"\n");
+	IRDebugOutput(my_str);
+	IRDebugOutput("\n");
 
-	OutputDebugString(L"Tool Map Added:\n");
+	IRDebugOutput("Tool Map Added:\n");
 	my_str = "Map:\n";
 	my_str << tool.map;
-	stemp = std::wstring(my_str.begin(), my_str.end());
-	my2 = stemp.c_str();
-	OutputDebugString(my2);
-	OutputDebugString(L"\n");
+	IRDebugOutput(my_str);
+	IRDebugOutput("\n");
 #endif
 
 	if (restartTracking) {
@@ -884,7 +1693,7 @@ bool IRToolTracker::AddTool(cv::Mat3f spheres, float sphere_radius, std::string
 bool IRToolTracker::RemoveTool(std::string identifier)
 {
 #if DEBUG_OUTPUT
-	OutputDebugString(L"RemoveTool\n");
+	IRDebugOutput("RemoveTool\n");
 #endif
 	//Do we even have this tool?
 	if (m_ToolIndexMapping.count(identifier) == 0)
@@ -910,6 +1719,12 @@ bool IRToolTracker::RemoveTool(std::string identifier)
 		m_ToolIndexMapping.insert({ pair.first, m_Tools.size() });
 		m_Tools.push_back(oldTools.at(pair.second));
 	}
+	BuildSideIndex();
+	{
+		std::lock_guard<std::mutex> lock(m_MutexToolDefinitions);
+		m_ToolDefinitions.erase(std::find_if(m_ToolDefinitions.begin(), m_ToolDefinitions.end(),
+			[&](const IRToolDefinition& definition) { return definition.identifier == identifier; }));
+	}
 
 
 	if (restartTracking) {
@@ -922,20 +1737,36 @@ bool IRToolTracker::RemoveTool(std::string identifier)
 bool IRToolTracker::RemoveAllTools()
 {
 #if DEBUG_OUTPUT
-	OutputDebugString(L"RemoveAllTools\n");
+	IRDebugOutput("RemoveAllTools\n");
 #endif
+	bool restartTracking = false;
+	if (m_bIsCurrentlyTracking) {
+		restartTracking = true;
+		StopTracking();
+	}
+
 	m_Tools.clear();
 	m_ToolIndexMapping.clear();
+	BuildSideIndex();
+	{
+		std::lock_guard<std::mutex> lock(m_MutexToolDefinitions);
+		m_ToolDefinitions.clear();
+	}
+
+	if (restartTracking) {
+		StartTracking();
+	}
 	return true;
 }
 
 bool IRToolTracker::StartTracking() {
 #if DEBUG_OUTPUT
-	OutputDebugString(L"StartTracking\n");
+	IRDebugOutput("StartTracking\n");
 #endif
 	if (m_bIsCurrentlyTracking || m_Tools.size() == 0)
 		return false;
 	m_bShouldStop = false;
+	m_bIsCurrentlyTracking = true;
 	m_TrackingThread = std::thread(&IRToolTracker::TrackTools, this);
 	return true;
 }
@@ -943,9 +1774,10 @@ bool IRToolTracker::StartTracking() {
 void IRToolTracker::StopTracking()
 {
 #if DEBUG_OUTPUT
-	OutputDebugString(L"StopTracking\n");
+	IRDebugOutput("StopTracking\n");
 #endif
 	m_bShouldStop = true;
+	m_FramePool.Interrupt();
 	//Wait until thread shuts down
 	m_TrackingThread.join();
 }
\ No newline at end of file
@@ -2,35 +2,60 @@
 
 #include <vector>
 #include <map>
+#include <memory>
+#include <atomic>
+#include <mutex>
+#include <string>
 #include <thread>
+#include <tuple>
 #include <cstdint>
-#include <wrl.h>
 
 #include <opencv2/core.hpp>
 #include <opencv2/video/tracking.hpp>
 
-#include <DirectXMath.h>
-
 #include "IRStructs.h"
-
-//Forward Decl
-namespace winrt::HL2IRToolTracking::implementation
+#include "IRCameraIntrinsics.h"
+#include "IRPlatform.h"
+#include "IRPipelineStats.h"
+#include "IRFramePool.h"
+#include "IRBlobLabeller.h"
+#include "IRTriangleMatcher.h"
+#include "IRBitSet.h"
+#include "IRWorkerPool.h"
+#include "IRBlobGrid.h"
+#include "IRSearchOrder.h"
+
+
+//Why AddTool did not add a tool
+enum IRAddToolError : uint32_t
 {
-	struct HL2IRTracking;
-}
+	IR_ADD_TOOL_OK = 0,
+	IR_ADD_TOOL_DUPLICATE_IDENTIFIER,	//A tool with the identifier is registered already
+	IR_ADD_TOOL_TOO_MANY_SPHERES,		//More than kMaxToolSpheres spheres
+};
 
+//How TrackFrame finds tool candidates among the frame's spheres
+enum IRMatcherType : uint32_t
+{
+	IR_MATCHER_SEARCH = 0,		//Depth first search over the frame sides, TrackTool
+	IR_MATCHER_TRIANGLE_HASHING,	//Geometric hashing of sphere triplets, IRTriangleMatcher
+};
 
 class IRToolTracker
 {
 public:
-	IRToolTracker(winrt::HL2IRToolTracking::implementation::HL2IRTracking* pResearchMode) {
-		m_pResearchMode = pResearchMode;
+	//Stage timings are recorded into pStats if given, so the caller can add its own stages, otherwise into the tracker's own instance
+	IRToolTracker(IRCameraIntrinsics* pIntrinsics, IRPipelineStats* pStats = nullptr) {
+		m_pIntrinsics = pIntrinsics;
+		m_pStats = pStats != nullptr ? pStats : &m_OwnStats;
 	}
 
 
-	void AddFrame(void* pAbImage, void* pDepth, UINT32 depthWidth, UINT32 depthHeight, cv::Mat _pose, INT64 _timestamp);
-	void AddEnvFrame(void* pLFImage, void* pRFImage, size_t LFOutBufferCount, INT64 tsLF, INT64 tsRF, float* pLFExtr, float* pRFExtr);
-	bool AddTool(cv::Mat3f spheres, float sphere_radius, std::string identifier, uint min_visible_spheres, float lowpass_rotation, float lowpass_position);
+	void AddFrame(void* pAbImage, void* pDepth, uint32_t depthWidth, uint32_t depthHeight, cv::Mat _pose, int64_t _timestamp);
+	void AddEnvFrame(void* pLFImage, void* pRFImage, size_t LFOutBufferCount, int64_t tsLF, int64_t tsRF, float* pLFExtr, float* pRFExtr);
+	//Tools have at most kMaxToolSpheres spheres. Returns false and sets pError (if given) to the reason if the tool was not added
+	bool AddTool(cv::Mat3f spheres, float sphere_radius, std::string identifier, uint min_visible_spheres, float lowpass_rotation, float lowpass_position,
+		IRAddToolError* pError = nullptr);
 	bool RemoveTool(std::string identifier);
 	bool RemoveAllTools();
 	bool StartTracking();
@@ -40,48 +65,237 @@ public:
 	inline bool IsTracking() { return m_bIsCurrentlyTracking; }
 
 	cv::Mat GetToolTransform(std::string identifier);
+	//Partial matches per step the search for the tool is estimated to go through when all registered tools are in view,
+	//about 1 for a tool no other tool or symmetry can be confused with, 0 for an unknown identifier
+	float GetToolBranchingFactor(std::string identifier);
 	cv::Mat GetDepthToWorldTransform();
 	void TrackTools();
 
+	//Runs detection and tool tracking for one frame on the calling thread, only while the tracking thread is not running.
+	//Returns false if the frame did not contain enough blobs for any tool.
+	bool TrackFrameSync(void* pAbImage, void* pDepth, uint32_t depthWidth, uint32_t depthHeight, cv::Mat _pose, int64_t _timestamp);
+
+	inline const std::vector<IRTrackedTool>& GetTools() { return m_Tools; }
+	//Copy of the tools added so far, safe to call while the tracking thread runs
+	std::vector<IRToolDefinition> GetToolDefinitions();
+	//Number of frames the tracking thread has consumed so far, whether tools were found or not
+	inline uint64_t GetProcessedFrameCount() { return m_iProcessedFrames; }
+
+	inline const IRPipelineStats& GetPipelineStats() { return *m_pStats; }
+
+	//Unit plane xy of every depth pixel center (see IRLutCameraIntrinsics), blobs are back-projected by interpolating
+	//this table instead of calling the camera model. Without a table of the frame's size AddFrame samples the camera model once.
+	void SetUnitPlaneLut(const float* lut_xy, uint32_t width, uint32_t height);
+
+	//Takes effect with the next frame, both matchers produce candidates for the same union segmentation
+	inline void SetMatcher(IRMatcherType matcher) { m_Matcher = matcher; }
+	inline IRMatcherType GetMatcher() { return m_Matcher; }
+
+	//Threads the depth first search of the tools runs on, including the tracking thread. 0 (default) uses one per big core,
+	//1 searches all tools on the tracking thread. Takes effect with the next frame.
+	inline void SetSearchThreads(uint32_t num_threads) { m_iSearchThreads = num_threads; }
+	inline uint32_t GetSearchThreads() { return m_iSearchThreads; }
+
+	//Tools found in the previous frame are first looked for around their pose predicted with constant velocity: every
+	//sphere takes the closest frame sphere within gate_mm of its predicted position, the full search only runs if that
+	//does not give a valid match. 0 disables the prediction. Takes effect with the next frame.
+	inline void SetPredictionGate(float gate_mm) { m_fPredictionGate = gate_mm; }
+	inline float GetPredictionGate() { return m_fPredictionGate; }
+
+	//Before the prediction, tools found in the previous frame without occluded spheres take the closest blob within
+	//gate_mm of each of their previous blobs. The match is accepted with the same side tolerances as the search.
+	//0 disables it. Takes effect with the next frame.
+	inline void SetAssociationGate(float gate_mm) { m_fAssociationGate = gate_mm; }
+	inline float GetAssociationGate() { return m_fAssociationGate; }
+
 
 private:
 
+	//Copies a sensor frame into a pool slot, returns nullptr if no slot is available
+	AHATFrame* CopyToPool(void* pAbImage, void* pDepth, uint32_t depthWidth, uint32_t depthHeight, cv::Mat _pose, int64_t _timestamp);
+
+	//Does not take ownership of rawFrame
+	bool TrackFrame(AHATFrame* rawFrame);
+
+	//Per stage benchmarks (Benchmarks/IRStageBench.cpp) drive the pipeline stages below directly
+	friend class IRStageBenchmark;
+	friend class IRSphereCountBenchmark;
+
 	bool ProcessFrame(AHATFrame* rawFrame, ProcessedAHATFrame& result);
+
+	//Stages of ProcessFrame: AB thresholding to an 8 bit mask, blob detection returning unit plane xy + depth
+	//per blob, the unit rays of the blobs, which all sphere radii share, and back-projection of the blobs along their
+	//rays to sphere centers with distance map and ordered sides for one sphere radius
+	void ThresholdAbImage(const cv::Mat& abImage, cv::Mat& mask);
+
+	cv::Mat3f ExtractBlobs(const cv::Mat& mask, const uint16_t* pDepth, uint32_t depthWidth);
+
+	void ProjectRays(const cv::Mat3f& spheres_xyd);
+
+	//Only sides up to max_side_length are ordered, longer ones cannot match a side of the radius' tools
+	void BackProjectSpheres(const cv::Mat3f& spheres_xyd, float sphere_radius, float max_side_length, RadiusFrameData& result);
+	//Unit ray of every blob as separate x, y and z arrays, written by ProjectRays
+	std::vector<float> m_Rays;
 	
 	bool ProcessEnvFrame(ProcessedAHATFrame& ahat_frame, ToolResult& best_candidate);
 
-	void TrackTool(IRTrackedTool &tool, ProcessedAHATFrame &frame, ToolResultContainer &result);
+	//Partial match of the depth first search in SearchSubModel, for sub-models of up to Capacity spheres
+	template<int Capacity>
+	struct SearchEntry {
+		IRNodeSet<kMaxFrameSpheres> visited_frame;		//Frame spheres in visited_nodes_frame
+		int16_t visited_nodes_frame[Capacity];			//Frame sphere per sub-model sphere, in search order
+		uint8_t num_visited{ 0 };
+		float combined_error{ 0 };
+		int num_sides{ 0 };
+	};
+	//Generic search entries hold this many spheres, larger sub-models take entries of kMaxToolSpheres
+	static constexpr int kGenericSearchCapacity = 16;
+	//Partial match of SearchOccluded, which also decides during the search which tool spheres are occluded
+	struct OccludedSearchEntry : SearchEntry<kMaxToolSpheres> {
+		uint64_t occluded_tool{ 0 };		//Tool spheres before the next one that are occluded
+		uint8_t num_occluded{ 0 };
+	};
+	//Explicit stack of TrackTool per search worker, one list per entry size, kept between frames so their capacity is
+	//only grown once
+	struct alignas(64) SearchStack {
+		std::tuple<std::vector<SearchEntry<3>>, std::vector<SearchEntry<4>>, std::vector<SearchEntry<5>>, std::vector<SearchEntry<6>>,
+			std::vector<SearchEntry<kGenericSearchCapacity>>, std::vector<SearchEntry<kMaxToolSpheres>>> entries;
+
+		template<int Capacity>
+		inline std::vector<SearchEntry<Capacity>>& Entries() { return std::get<std::vector<SearchEntry<Capacity>>>(entries); }
+		std::vector<OccludedSearchEntry> occluded_entries;
+	};
+	//Thread safe for different search stacks, the tool and the frame are only read. Searches the sub-models of the tool
+	//largest first with the SearchSubModel kernel of their sphere count (the generic one for all if generic_kernels),
+	//sub-models smaller than one that was found are skipped. Tools without sub-models go to SearchOccluded
+	void TrackTool(const IRTrackedTool& tool, const ProcessedAHATFrame& frame, SearchStack& stack, ToolResultContainer& result,
+		bool generic_kernels = false);
+	//Matches all spheres of the sub-model, for sub-models of exactly Spheres spheres the loops over them get constant
+	//bounds and their sides are kept in a local array. Spheres 0 searches sub-models of up to Capacity spheres
+	template<int Spheres, int Capacity = Spheres>
+	void SearchSubModel(const IRTrackedTool& tool, const IRToolSubModel& sub_model, const ProcessedAHATFrame& frame,
+		SearchStack& stack, ToolResultContainer& result);
+	using SearchKernel = void (IRToolTracker::*)(const IRTrackedTool&, const IRToolSubModel&, const ProcessedAHATFrame&, SearchStack&,
+		ToolResultContainer&);
+	//Matches the whole tool in its search order, a tool sphere without a fitting frame sphere may be occluded until
+	//min_visible_spheres are left. Starts at every side of IRTrackedTool::start_side_ranges, the spheres before its second
+	//one except its first one are occluded. For IRTrackedTool::search_occluded, no symmetry pruning
+	void SearchOccluded(const IRTrackedTool& tool, const ProcessedAHATFrame& frame, SearchStack& stack, ToolResultContainer& result);
+
+	//Match of a tool found in the previous frame around its predicted pose, false if the full search has to run
+	bool MatchPredicted(const IRTrackedTool& tool, const ProcessedAHATFrame& frame, float gate, ToolResultContainer& result);
+
+	//Match of a tool found in the previous frame from the blobs close to its previous blobs, found with m_BlobGrid
+	bool MatchAssociated(const IRTrackedTool& tool, const cv::Mat3f& prev_spheres_xyd, const ProcessedAHATFrame& frame, float gate, ToolResultContainer& result);
+	//Blobs of the frame, built by TrackFrame if the association is enabled
+	IRBlobGrid m_BlobGrid;
+
+	//Adds the candidate with frame sphere frame_ids[node] per tool sphere (-1 if occluded) to result if it passes the
+	//side tolerances of the search
+	bool AcceptMatch(const IRTrackedTool& tool, const cv::Mat& frame_map, const int* frame_ids, ToolResultContainer& result);
+
+	std::vector<SearchStack> m_SearchStacks;
+
+	//Created on the tracking thread for the number of threads requested by SetSearchThreads
+	IRWorkerPool& GetSearchPool();
+	std::unique_ptr<IRWorkerPool> m_pSearchPool;
+	std::atomic<uint32_t> m_iSearchThreads{ 0 };
+
+	void UnionSegmentation(ToolResultContainer* raw_solutions, int num_tools, const ProcessedAHATFrame& frame);
+
+	//Pose of the tool from the frame spheres sphere_ids of its visible spheres, runs the kernel of IRTrackedTool::fixed_spheres
+	cv::Mat MatchPointsKabsch(const IRTrackedTool& tool, const ProcessedAHATFrame& frame, const std::vector<int>& sphere_ids, const std::vector<int>& occluded_nodes);
+	//Rotation from the SVD of the covariance, any sphere count
+	cv::Mat MatchPointsKabschGeneric(const IRTrackedTool& tool, const ProcessedAHATFrame& frame, const std::vector<int>& sphere_ids, const std::vector<int>& occluded_nodes);
+	//Rotation from the quaternion of Horn's method on fixed size arrays, for tools of exactly Spheres spheres
+	template<int Spheres>
+	cv::Mat MatchPointsKabschFixed(const IRTrackedTool& tool, const ProcessedAHATFrame& frame, const std::vector<int>& sphere_ids, const std::vector<int>& occluded_nodes);
+	using KabschKernel = cv::Mat (IRToolTracker::*)(const IRTrackedTool&, const ProcessedAHATFrame&, const std::vector<int>&, const std::vector<int>&);
+	//8x1 pose of MatchPointsKabsch (position in m, quaternion, valid flag) from the rotation and translation in mm,
+	//low pass filtered against the tool's current pose unless DISABLE_LOWPASS
+	cv::Mat ToolPose(const IRTrackedTool& tool, const float rotation_matrix[3][3], const float translation_mm[3]);
 
-	void UnionSegmentation(ToolResultContainer* raw_solutions, int num_tools, ProcessedAHATFrame frame);
+	cv::Mat FlipTransformRightLeft(cv::Mat hololens_transform);
 
-	cv::Mat MatchPointsKabsch(IRTrackedTool tool, ProcessedAHATFrame frame, std::vector<int> sphere_ids, std::vector<int> occluded_nodes);
+	static cv::Vec4f QuaternionSlerp(cv::Vec4f from, cv::Vec4f to, float t);
 
-	cv::Mat FlipTransformRightLeft(cv::Mat hololens_transform);
+	static cv::Vec4f QuaternionMultiply(cv::Vec4f a, cv::Vec4f b);
+
+	void ConstructMap(const cv::Mat3f& spheres_xyz, int num_spheres, cv::Mat& result_map, std::vector<Side>& result_ordered_sides);
+	//Sides above the diagonal of map no longer than max_side_length, sorted by length
+	void OrderSides(const cv::Mat& map, int num_spheres, float max_side_length, std::vector<Side>& result_ordered_sides);
+	//Scratch space of ConstructMap and OrderSides
+	std::vector<float> m_MapPoints;
+	std::vector<Side> m_SideScratch;
 
-	void ConstructMap(cv::Mat3f spheres_xyz, int num_spheres, cv::Mat& result_map, std::vector<Side>& result_ordered_sides);
+	//Puts the spheres of every tool into the search order IROptimizeSearchOrder finds against all tools of its radius
+	//class, called by BuildSideIndex since the order of one tool depends on the others
+	void OptimizeSearchOrders();
+	//The search of every sub-model starts at the frame sides matching the tool side between its first two spheres. These
+	//tool sides of all tools are kept sorted by length per radius class, so a single merge pass with the frame's sorted
+	//sides finds all of them. Also assigns the radius classes, search orders and sub-models, so it runs whenever the
+	//tools change.
+	void BuildSideIndex();
+	//Sub-models of the tool for every subset of the spheres that may be occluded, in their own search order against the
+	//distance maps of model_maps (see IROptimizeSearchOrder)
+	void BuildSubModels(IRTrackedTool& tool, const std::vector<const cv::Mat*>& model_maps);
+	//Visible subsets BuildSubModels makes for a tool, exact up to kMaxToolSubModels
+	static size_t NumSubModels(uint num_spheres, uint min_visible_spheres);
+	void MatchStartSides(const std::vector<Side>& frame_sides, const std::vector<IndexedSide>& index, std::vector<SideRange>& ranges, std::vector<uint8_t>& tool_has_start_side);
 
 
-	bool m_bShouldStop = false;
+	std::atomic_bool m_bShouldStop = false;
 
 	std::vector<IRTrackedTool> m_Tools;
 
-	AHATFrame* m_CurrentFrame = nullptr;
+	IRFramePool m_FramePool;
+	//Only used by the tracking thread
+	IRBlobLabeller m_BlobLabeller;
+	ProcessedAHATFrame m_ProcessedFrame;
 	std::vector<EnvFrame*> m_CurEnvFrameBuffer;
 	int m_iCurEnvFrameBufferMaxSize = 3;
 
-	std::mutex m_MutexCurFrame;
 	std::mutex m_MutexCurEnvFrame;
 
 	std::map<std::string, int> m_ToolIndexMapping;
+	//Tools as they were added, in the order of AddTool. Read by other threads than the one changing the tools
+	std::vector<IRToolDefinition> m_ToolDefinitions;
+	std::mutex m_MutexToolDefinitions;
+
+	//Sphere radius of every radius class, in order of the first tool using it
+	std::vector<float> m_SphereRadii;
+	//Longest side of the tools of every radius class plus the side tolerance, frame sides above are not ordered
+	std::vector<float> m_MaxSideLengths;
+	//Start sides of all tools sorted by length, per radius class
+	std::vector<std::vector<IndexedSide>> m_SideIndexPerRadius;
+	int m_iNumStartSides = 0;
+
+	std::atomic<IRMatcherType> m_Matcher{ IR_MATCHER_SEARCH };
+	//Built with the side index, only used by the tracking thread otherwise
+	IRTriangleMatcher m_TriangleMatcher;
 
 	float m_fToleranceSide = 4.0f;
 	float m_fToleranceAvg = 4.0f;
 
-	bool m_bIsCurrentlyTracking = false;
+	std::atomic<float> m_fPredictionGate{ 10.0f };
+	std::atomic<float> m_fAssociationGate{ 10.0f };
+	//Timestamp of the last frame TrackFrame searched, tools with this timestamp were found in it
+	long long m_iLastSearchedTimestamp = 0;
+
+	std::atomic_bool m_bIsCurrentlyTracking = false;
+	std::atomic<uint64_t> m_iProcessedFrames = 0;
 
 	std::thread m_TrackingThread{};
 
-	winrt::HL2IRToolTracking::implementation::HL2IRTracking* m_pResearchMode;
+	IRCameraIntrinsics* m_pIntrinsics;
+
+	std::shared_ptr<const IRLutCameraIntrinsics> GetUnitPlaneLut();
+	//Replaced as a whole, so the tracking thread can keep using the table it picked up for a frame
+	std::shared_ptr<const IRLutCameraIntrinsics> m_pUnitPlaneLut;
+	std::mutex m_MutexUnitPlaneLut;
+
+	IRPipelineStats m_OwnStats;
+	IRPipelineStats* m_pStats;
 
 
 	cv::Mat depthToWorldPose = cv::Mat(4,4,CV_32F);
@@ -0,0 +1,246 @@
+#include "IRTriangleMatcher.h"
+
+#include <algorithm>
+#include <cmath>
+
+//Distance between two spheres, the distance maps are only filled above the diagonal
+static inline float SideLength(const cv::Mat& map, int a, int b)
+{
+	return a < b ? map.at<float>(a, b) : map.at<float>(b, a);
+}
+
+void IRTriangleMatcher::Build(const std::vector<IRTrackedTool>& tools, float tolerance_side)
+{
+	m_IndexPerRadius.clear();
+	m_fToleranceSide = tolerance_side;
+	//With bins twice the tolerance, a side can only fall into its own bin or one neighbour
+	m_fBinSize = 2.f * tolerance_side;
+
+	for (int t = 0; t < static_cast<int>(tools.size()); t++) {
+		const IRTrackedTool& tool = tools[t];
+		if (tool.radius_class >= static_cast<int>(m_IndexPerRadius.size()))
+			m_IndexPerRadius.resize(tool.radius_class + 1);
+		RadiusIndex& index = m_IndexPerRadius[tool.radius_class];
+		int n = static_cast<int>(tool.num_spheres);
+		for (int a = 0; a < n; a++) {
+			for (int b = a + 1; b < n; b++) {
+				index.max_side = std::max(index.max_side, SideLength(tool.map, a, b));
+				for (int c = b + 1; c < n; c++) {
+					ModelTriangle triangle{ t, { a, b, c }, { SideLength(tool.map, b, c), SideLength(tool.map, a, c), SideLength(tool.map, a, b) } };
+					//Sort the nodes by the length of their opposite side
+					for (int i = 0; i < 3; i++) {
+						for (int j = i + 1; j < 3; j++) {
+							if (triangle.sides[j] < triangle.sides[i]) {
+								std::swap(triangle.sides[i], triangle.sides[j]);
+								std::swap(triangle.nodes[i], triangle.nodes[j]);
+							}
+						}
+					}
+					index.bins[Key(Quantize(triangle.sides[0]), Quantize(triangle.sides[1]), Quantize(triangle.sides[2]))].push_back(static_cast<int>(index.triangles.size()));
+					index.triangles.push_back(triangle);
+				}
+			}
+		}
+	}
+}
+
+void IRTriangleMatcher::Match(const ProcessedAHATFrame& frame, const std::vector<IRTrackedTool>& tools, float tolerance_avg, ToolResultContainer* results)
+{
+	int num_tools = static_cast<int>(tools.size());
+	for (int t = 0; t < num_tools; t++)
+		results[t] = ToolResultContainer{ t, std::vector<ToolResult>() };
+	m_KnownTriplets.clear();
+
+	int n = static_cast<int>(frame.num_spheres);
+	static const int permutations[6][3] = { { 0, 1, 2 }, { 0, 2, 1 }, { 1, 0, 2 }, { 1, 2, 0 }, { 2, 0, 1 }, { 2, 1, 0 } };
+
+	int num_classes = std::min(static_cast<int>(m_IndexPerRadius.size()), static_cast<int>(frame.per_radius.size()));
+	for (int radius_class = 0; radius_class < num_classes; radius_class++) {
+		const RadiusIndex& index = m_IndexPerRadius[radius_class];
+		const RadiusFrameData& frame_data = frame.per_radius[radius_class];
+		const cv::Mat& frame_map = frame_data.map;
+
+		//Spheres close enough to be on one tool, the sides are ordered so only the short ones are visited
+		float max_side = index.max_side + m_fToleranceSide;
+		m_Neighbours.resize(n);
+		for (auto& neighbours : m_Neighbours)
+			neighbours.clear();
+		for (const Side& side : frame_data.ordered_sides) {
+			if (side.distance > max_side)
+				break;
+			m_Neighbours[side.id_from].push_back(side.id_to);
+			m_Neighbours[side.id_to].push_back(side.id_from);
+		}
+		for (auto& neighbours : m_Neighbours)
+			std::sort(neighbours.begin(), neighbours.end());
+
+		for (int a = 0; a < n; a++) {
+			const std::vector<int>& neighbours = m_Neighbours[a];
+			for (size_t ib = 0; ib < neighbours.size(); ib++) {
+				int b = neighbours[ib];
+				if (b < a)
+					continue;
+				for (size_t ic = ib + 1; ic < neighbours.size(); ic++) {
+					int c = neighbours[ic];
+					float side_bc = SideLength(frame_map, b, c);
+					if (side_bc > max_side)
+						continue;
+					int vertices[3] = { a, b, c };
+					float sides[3] = { side_bc, SideLength(frame_map, a, c), SideLength(frame_map, a, b) };
+					float sorted[3] = { sides[0], sides[1], sides[2] };
+					std::sort(sorted, sorted + 3);
+
+					int lo[3], hi[3];
+					for (int i = 0; i < 3; i++) {
+						lo[i] = Quantize(std::max(0.f, sorted[i] - m_fToleranceSide));
+						hi[i] = Quantize(sorted[i] + m_fToleranceSide);
+					}
+					for (int q0 = lo[0]; q0 <= hi[0]; q0++) {
+						for (int q1 = lo[1]; q1 <= hi[1]; q1++) {
+							for (int q2 = lo[2]; q2 <= hi[2]; q2++) {
+								auto it_bin = index.bins.find(Key(q0, q1, q2));
+								if (it_bin == index.bins.end())
+									continue;
+								for (int triangle_id : it_bin->second) {
+									const ModelTriangle& triangle = index.triangles[triangle_id];
+									for (const auto& permutation : permutations) {
+										//Frame vertex permutation[i] takes the place of triangle.nodes[i]
+										bool matches = true;
+										for (int i = 0; i < 3 && matches; i++)
+											matches = std::abs(sides[permutation[i]] - triangle.sides[i]) < m_fToleranceSide;
+										if (!matches)
+											continue;
+										int frame_nodes[3] = { vertices[permutation[0]], vertices[permutation[1]], vertices[permutation[2]] };
+
+										//Skip triplets a verified hypothesis already explains
+										TripletKey key{ triangle.tool, { triangle.nodes[0], triangle.nodes[1], triangle.nodes[2] }, { frame_nodes[0], frame_nodes[1], frame_nodes[2] } };
+										for (int i = 0; i < 3; i++) {
+											for (int j = i + 1; j < 3; j++) {
+												if (key.nodes[j] < key.nodes[i]) {
+													std::swap(key.nodes[i], key.nodes[j]);
+													std::swap(key.frame_ids[i], key.frame_ids[j]);
+												}
+											}
+										}
+										if (m_KnownTriplets.count(key) == 0)
+											Verify(triangle, frame_nodes, tools[triangle.tool], frame_data.spheres_xyz, frame_map, tolerance_avg, results[triangle.tool]);
+									}
+								}
+							}
+						}
+					}
+				}
+			}
+		}
+	}
+}
+
+void IRTriangleMatcher::Verify(const ModelTriangle& triangle, const int (&frame_nodes)[3], const IRTrackedTool& tool,
+	const cv::Mat3f& frame_xyz, const cv::Mat& frame_map, float tolerance_avg, ToolResultContainer& result)
+{
+	int num_spheres = static_cast<int>(tool.num_spheres);
+	//Frame sphere per tool sphere, -1 if occluded
+	std::vector<int>& frame_ids = m_FrameIds;
+	frame_ids.assign(num_spheres, -1);
+	for (int i = 0; i < 3; i++)
+		frame_ids[triangle.nodes[i]] = frame_nodes[i];
+
+	if (num_spheres > 3) {
+		//Orthonormal bases spanned by the triplet in tool and camera space, the pose maps one onto the other
+		cv::Vec3f model[3], observed[3];
+		for (int i = 0; i < 3; i++) {
+			model[i] = tool.spheres_xyz.at<cv::Vec3f>(triangle.nodes[i], 0);
+			observed[i] = frame_xyz.at<cv::Vec3f>(frame_nodes[i], 0);
+		}
+		cv::Vec3f model_basis[3], observed_basis[3];
+		cv::Vec3f* points[2] = { model, observed };
+		cv::Vec3f* bases[2] = { model_basis, observed_basis };
+		for (int s = 0; s < 2; s++) {
+			cv::Vec3f e1 = points[s][1] - points[s][0];
+			cv::Vec3f e3 = e1.cross(points[s][2] - points[s][0]);
+			float length1 = static_cast<float>(cv::norm(e1));
+			float length3 = static_cast<float>(cv::norm(e3));
+			if (length1 < 1e-3f || length3 < 1e-3f * length1 * length1) {
+				//Degenerate triplet, other triplets of the tool have to find it
+				return;
+			}
+			bases[s][0] = e1 * (1.f / length1);
+			bases[s][2] = e3 * (1.f / length3);
+			bases[s][1] = bases[s][2].cross(bases[s][0]);
+		}
+
+		//Predicted positions of the other spheres, the closest frame sphere near the triplet whose sides to the spheres
+		//matched so far fit is taken. Without one the sphere is occluded, a blob of clutter does not reject the hypothesis
+		const std::vector<int>& candidates = m_Neighbours[frame_nodes[0]];
+		float max_distance = 2.f * m_fToleranceSide;
+		for (int node = 0; node < num_spheres; node++) {
+			if (frame_ids[node] >= 0)
+				continue;
+			cv::Vec3f offset = tool.spheres_xyz.at<cv::Vec3f>(node, 0) - model[0];
+			cv::Vec3f predicted = observed[0] + observed_basis[0] * offset.dot(model_basis[0]) + observed_basis[1] * offset.dot(model_basis[1])
+				+ observed_basis[2] * offset.dot(model_basis[2]);
+			float best_distance = max_distance;
+			int best_id = -1;
+			for (int id : candidates) {
+				float distance = static_cast<float>(cv::norm(frame_xyz.at<cv::Vec3f>(id, 0) - predicted));
+				if (distance >= best_distance || std::find(frame_ids.begin(), frame_ids.end(), id) != frame_ids.end())
+					continue;
+				bool sides_fit = true;
+				for (int other = 0; other < num_spheres && sides_fit; other++) {
+					if (frame_ids[other] >= 0)
+						sides_fit = std::abs(SideLength(frame_map, id, frame_ids[other]) - SideLength(tool.map, node, other)) <= m_fToleranceSide;
+				}
+				if (sides_fit) {
+					best_distance = distance;
+					best_id = id;
+				}
+			}
+			frame_ids[node] = best_id;
+		}
+	}
+
+	//Same acceptance as the search: every side within the side tolerance, the mean within the average tolerance
+	ToolResult candidate{};
+	float error = 0.f;
+	int num_sides = 0;
+	for (int node = 0; node < num_spheres; node++) {
+		int id = frame_ids[node];
+		if (id < 0) {
+			candidate.occluded_nodes.push_back(node);
+			continue;
+		}
+		for (int other = node + 1; other < num_spheres; other++) {
+			int other_id = frame_ids[other];
+			if (other_id < 0)
+				continue;
+			float error_side = std::abs(SideLength(frame_map, id, other_id) - tool.map.at<float>(node, other));
+			if (error_side > m_fToleranceSide)
+				return;
+			error += error_side;
+			num_sides++;
+		}
+		candidate.sphere_ids.push_back(id);
+	}
+	if (candidate.sphere_ids.size() >= tool.min_visible_spheres && num_sides > 0 && error / num_sides < tolerance_avg) {
+		candidate.error = error;
+		result.candidates.push_back(candidate);
+		AddKnownTriplets(triangle.tool, frame_ids);
+	}
+}
+
+void IRTriangleMatcher::AddKnownTriplets(int tool, const std::vector<int>& frame_ids)
+{
+	int num_spheres = static_cast<int>(frame_ids.size());
+	for (int a = 0; a < num_spheres; a++) {
+		if (frame_ids[a] < 0)
+			continue;
+		for (int b = a + 1; b < num_spheres; b++) {
+			if (frame_ids[b] < 0)
+				continue;
+			for (int c = b + 1; c < num_spheres; c++) {
+				if (frame_ids[c] >= 0)
+					m_KnownTriplets.insert(TripletKey{ tool, { a, b, c }, { frame_ids[a], frame_ids[b], frame_ids[c] } });
+			}
+		}
+	}
+}
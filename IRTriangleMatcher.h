@@ -0,0 +1,94 @@
+#pragma once
+
+#include <vector>
+#include <map>
+#include <unordered_map>
+#include <unordered_set>
+#include <cstdint>
+
+#include <opencv2/core.hpp>
+
+#include "IRStructs.h"
+
+/*
+ * Geometric hashing alternative to the depth first search in IRToolTracker::TrackTool.
+ *
+ * Build stores every sphere triplet of every tool in a hash table, keyed by its three side lengths sorted and quantized
+ * to twice the side tolerance, which makes the key independent of rotation and of the order of the spheres.
+ * Match enumerates the frame triplets whose sides are not longer than the longest tool side, looks up the up to 8 bins
+ * their sides could fall into and tries every vertex assignment that matches the model triangle within the tolerance.
+ * Every new assignment is a hypothesis: the tool pose is solved from the three spheres and the other spheres are looked
+ * up at their predicted positions. A sphere without a frame sphere there whose sides to the found ones pass the side
+ * tolerance is occluded, and the hypothesis becomes a candidate if enough spheres are found and their mean side error
+ * passes, the same tolerances as in the search. Every triplet of a candidate is kept in a hash set keyed by the tool
+ * and the triplet's sphere correspondences, triplets found there are skipped, so every tool instance is verified once.
+ * Candidates have the same format as the ones of TrackTool.
+ */
+class IRTriangleMatcher
+{
+public:
+	void Build(const std::vector<IRTrackedTool>& tools, float tolerance_side);
+
+	//Fills results[i] with the candidates of tools[i], tools must be the ones passed to Build
+	void Match(const ProcessedAHATFrame& frame, const std::vector<IRTrackedTool>& tools, float tolerance_avg, ToolResultContainer* results);
+
+private:
+	struct ModelTriangle
+	{
+		int tool;
+		int nodes[3];
+		float sides[3];		//Side opposite of nodes[i], ascending
+	};
+
+	struct RadiusIndex
+	{
+		std::unordered_map<uint64_t, std::vector<int>> bins;
+		std::vector<ModelTriangle> triangles;
+		float max_side{ 0 };
+	};
+
+	//Three tool spheres of one tool, ascending, and the frame spheres assigned to them
+	struct TripletKey
+	{
+		int tool;
+		int nodes[3];
+		int frame_ids[3];
+
+		bool operator==(const TripletKey& other) const {
+			return tool == other.tool && nodes[0] == other.nodes[0] && nodes[1] == other.nodes[1] && nodes[2] == other.nodes[2]
+				&& frame_ids[0] == other.frame_ids[0] && frame_ids[1] == other.frame_ids[1] && frame_ids[2] == other.frame_ids[2];
+		}
+	};
+
+	struct TripletKeyHash
+	{
+		size_t operator()(const TripletKey& key) const {
+			uint64_t hash = uint64_t(uint32_t(key.tool));
+			for (int i = 0; i < 3; i++) {
+				hash = hash * 0x9E3779B97F4A7C15ull + (uint64_t(uint32_t(key.nodes[i])) << 32 | uint32_t(key.frame_ids[i]));
+				hash ^= hash >> 29;
+			}
+			return static_cast<size_t>(hash);
+		}
+	};
+
+	inline uint64_t Key(int q0, int q1, int q2) const {
+		return (uint64_t(uint32_t(q0)) << 42) | (uint64_t(uint32_t(q1)) << 21) | uint64_t(uint32_t(q2));
+	}
+	inline int Quantize(float length) const { return static_cast<int>(length / m_fBinSize); }
+
+	void Verify(const ModelTriangle& triangle, const int (&frame_nodes)[3], const IRTrackedTool& tool,
+		const cv::Mat3f& frame_xyz, const cv::Mat& frame_map, float tolerance_avg, ToolResultContainer& result);
+	//Marks every triplet of an accepted candidate as explained
+	void AddKnownTriplets(int tool, const std::vector<int>& frame_ids);
+
+	//Indexed by the tools' radius class
+	std::vector<RadiusIndex> m_IndexPerRadius;
+	float m_fToleranceSide = 4.0f;
+	float m_fBinSize = 8.0f;
+
+	//Per frame scratch space, kept to avoid allocations
+	std::vector<std::vector<int>> m_Neighbours;
+	std::unordered_set<TripletKey, TripletKeyHash> m_KnownTriplets;
+	std::vector<int> m_FrameIds;
+};
@@ -0,0 +1,159 @@
+#include "IRWorkerPool.h"
+
+#include <algorithm>
+
+#include "IRBitSet.h"
+#include "IRPlatform.h"
+
+IRWorkerPool::IRWorkerPool(uint32_t num_workers)
+	: m_Ranges(std::max(1u, num_workers))
+{
+	for (uint32_t worker = 1; worker < NumWorkers(); worker++)
+		m_Threads.emplace_back(&IRWorkerPool::WorkerLoop, this, worker);
+}
+
+IRWorkerPool::~IRWorkerPool()
+{
+	{
+		std::lock_guard<std::mutex> lock(m_Mutex);
+		m_bStop = true;
+	}
+	m_Start.notify_all();
+	for (auto& thread : m_Threads)
+		thread.join();
+}
+
+void IRWorkerPool::Run(int count, const std::function<void(int, int)>& task)
+{
+	if (count <= 0)
+		return;
+	uint32_t num_workers = NumWorkers();
+	if (num_workers == 1 || count == 1) {
+		for (int i = 0; i < count; i++)
+			task(i, 0);
+		return;
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(m_Mutex);
+		for (uint32_t worker = 0; worker < num_workers; worker++) {
+			uint32_t front = static_cast<uint32_t>(uint64_t(count) * worker / num_workers);
+			uint32_t back = static_cast<uint32_t>(uint64_t(count) * (worker + 1) / num_workers);
+			m_Ranges[worker].front_back.store(Pack(front, back), std::memory_order_relaxed);
+		}
+		m_pTask = &task;
+		m_iGeneration++;
+		m_iBusy++;
+	}
+	m_Start.notify_all();
+
+	Work(0, task);
+
+	//Every index is taken once the own loop is done, wait for the workers still processing theirs.
+	//Workers that did not wake up in time see no task and keep sleeping until the next loop.
+	std::unique_lock<std::mutex> lock(m_Mutex);
+	m_iBusy--;
+	m_Done.wait(lock, [this]() { return m_iBusy == 0; });
+	m_pTask = nullptr;
+}
+
+uint32_t IRWorkerPool::NumPerformanceCores()
+{
+	uint32_t num_logical = std::max(1u, std::thread::hardware_concurrency());
+#ifdef _WIN32
+	DWORD length = 0;
+	GetLogicalProcessorInformationEx(RelationProcessorCore, nullptr, &length);
+	if (GetLastError() != ERROR_INSUFFICIENT_BUFFER || length == 0)
+		return num_logical;
+	std::vector<uint8_t> buffer(length);
+	auto* info = reinterpret_cast<SYSTEM_LOGICAL_PROCESSOR_INFORMATION_EX*>(buffer.data());
+	if (!GetLogicalProcessorInformationEx(RelationProcessorCore, info, &length))
+		return num_logical;
+
+	//Cores with a higher efficiency class are faster, count the logical processors of the fastest class
+	int best_class = -1;
+	uint32_t num_best = 0;
+	for (DWORD offset = 0; offset < length;) {
+		auto* entry = reinterpret_cast<SYSTEM_LOGICAL_PROCESSOR_INFORMATION_EX*>(buffer.data() + offset);
+		const PROCESSOR_RELATIONSHIP& core = entry->Processor;
+		uint32_t num_threads = 0;
+		for (WORD group = 0; group < core.GroupCount; group++)
+			num_threads += IRBitCount(static_cast<uint64_t>(core.GroupMask[group].Mask));
+		if (core.EfficiencyClass > best_class) {
+			best_class = core.EfficiencyClass;
+			num_best = 0;
+		}
+		if (core.EfficiencyClass == best_class)
+			num_best += num_threads;
+		offset += entry->Size;
+	}
+	return num_best > 0 ? num_best : num_logical;
+#else
+	return num_logical;
+#endif
+}
+
+bool IRWorkerPool::PopFront(Range& range, int& index)
+{
+	uint64_t value = range.front_back.load(std::memory_order_relaxed);
+	for (;;) {
+		uint32_t front = static_cast<uint32_t>(value), back = static_cast<uint32_t>(value >> 32);
+		if (front >= back)
+			return false;
+		if (range.front_back.compare_exchange_weak(value, Pack(front + 1, back), std::memory_order_acq_rel)) {
+			index = static_cast<int>(front);
+			return true;
+		}
+	}
+}
+
+bool IRWorkerPool::PopBack(Range& range, int& index)
+{
+	uint64_t value = range.front_back.load(std::memory_order_relaxed);
+	for (;;) {
+		uint32_t front = static_cast<uint32_t>(value), back = static_cast<uint32_t>(value >> 32);
+		if (front >= back)
+			return false;
+		if (range.front_back.compare_exchange_weak(value, Pack(front, back - 1), std::memory_order_acq_rel)) {
+			index = static_cast<int>(back - 1);
+			return true;
+		}
+	}
+}
+
+void IRWorkerPool::Work(uint32_t worker, const std::function<void(int, int)>& task)
+{
+	int index;
+	while (PopFront(m_Ranges[worker], index))
+		task(index, static_cast<int>(worker));
+	//Steal from the other workers, starting with the next one so thieves spread over the victims
+	uint32_t num_workers = NumWorkers();
+	for (uint32_t i = 1; i < num_workers; i++) {
+		Range& victim = m_Ranges[(worker + i) % num_workers];
+		while (PopBack(victim, index))
+			task(index, static_cast<int>(worker));
+	}
+}
+
+void IRWorkerPool::WorkerLoop(uint32_t worker)
+{
+	uint64_t generation = 0;
+	for (;;) {
+		const std::function<void(int, int)>* task;
+		{
+			std::unique_lock<std::mutex> lock(m_Mutex);
+			m_Start.wait(lock, [&]() { return m_bStop || (m_iGeneration != generation && m_pTask != nullptr); });
+			if (m_bStop)
+				return;
+			generation = m_iGeneration;
+			task = m_pTask;
+			m_iBusy++;
+		}
+
+		Work(worker, *task);
+
+		std::lock_guard<std::mutex> lock(m_Mutex);
+		if (--m_iBusy == 0)
+			m_Done.notify_all();
+	}
+}
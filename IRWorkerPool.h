@@ -0,0 +1,65 @@
+#pragma once
+
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <cstdint>
+
+/*
+ * Persistent worker threads for data parallel loops of the tracking thread.
+ *
+ * Run splits the indices [0, count) into one contiguous range per worker. Every worker takes indices from the front
+ * of its own range and, once that is empty, steals from the back of the other workers' ranges, so a few expensive
+ * indices (e.g. a tool searched with many occluded spheres) do not leave the other workers idle behind them.
+ * The calling thread is worker 0 and works on the loop too, Run returns when every index has been processed.
+ * Which worker processes an index is not deterministic, callers write results per index and merge them afterwards.
+ * Only one thread may call Run at a time.
+ */
+class IRWorkerPool
+{
+public:
+	//num_workers includes the calling thread, so num_workers - 1 threads are started
+	explicit IRWorkerPool(uint32_t num_workers);
+	~IRWorkerPool();
+
+	IRWorkerPool(const IRWorkerPool&) = delete;
+	IRWorkerPool& operator=(const IRWorkerPool&) = delete;
+
+	inline uint32_t NumWorkers() const { return static_cast<uint32_t>(m_Ranges.size()); }
+
+	//Calls task(index, worker) for every index in [0, count), worker is in [0, NumWorkers())
+	void Run(int count, const std::function<void(int, int)>& task);
+
+	//Logical processors of the fastest core type (the big cores of a big.LITTLE SoC), all logical processors if
+	//the platform does not tell them apart
+	static uint32_t NumPerformanceCores();
+
+private:
+	//Front in the low, back in the high 32 bits, so both ends are updated with one compare exchange
+	struct alignas(64) Range
+	{
+		std::atomic<uint64_t> front_back{ 0 };
+	};
+
+	static inline uint64_t Pack(uint32_t front, uint32_t back) { return (uint64_t(back) << 32) | front; }
+	bool PopFront(Range& range, int& index);
+	bool PopBack(Range& range, int& index);
+
+	void WorkerLoop(uint32_t worker);
+	void Work(uint32_t worker, const std::function<void(int, int)>& task);
+
+	std::vector<Range> m_Ranges;
+	std::vector<std::thread> m_Threads;
+
+	std::mutex m_Mutex;
+	std::condition_variable m_Start;
+	std::condition_variable m_Done;
+	const std::function<void(int, int)>* m_pTask = nullptr;
+	uint64_t m_iGeneration = 0;
+	uint32_t m_iBusy = 0;
+	bool m_bStop = false;
+};
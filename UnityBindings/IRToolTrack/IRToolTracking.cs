@@ -35,6 +35,18 @@ public class IRToolTracking : MonoBehaviour
 
     }
 
+    // Estimated partial matches per step of the tool's search, about 1 for a tool that cannot be confused with another
+    public float GetToolBranchingFactor(string identifier)
+    {
+#if ENABLE_WINMD_SUPPORT
+        if (toolTracking != null)
+        {
+            return toolTracking.GetToolBranchingFactor(identifier);
+        }
+#endif
+        return 0;
+    }
+
     public float[] GetDepthToWorldTransform()
     {
         var depthToWorldTransform = Enumerable.Repeat<float>(0, 8).ToArray();
@@ -54,6 +66,44 @@ public class IRToolTracking : MonoBehaviour
 #endif
     }
 
+    public bool StartSessionRecording(string path)
+    {
+#if ENABLE_WINMD_SUPPORT
+        if (toolTracking != null)
+        {
+            return toolTracking.StartSessionRecording(path);
+        }
+#endif
+        return false;
+    }
+
+    public void StopSessionRecording()
+    {
+#if ENABLE_WINMD_SUPPORT
+        if (toolTracking != null)
+        {
+            toolTracking.StopSessionRecording();
+        }
+#endif
+    }
+
+    // Pipeline stages in the order GetPipelineStats reports them
+    public static readonly string[] PipelineStageNames = { "sensor_acquire", "texture_conversion", "addframe_copy", "handoff", "threshold", "ccl",
+        "map_build", "search", "union", "kabsch", "publish", "frame" };
+    public const int PipelineStatsValuesPerStage = 5;
+
+    // Per stage latency statistics: for every stage in PipelineStageNames the sample count, mean, p50, p99 and max in ms
+    public float[] GetPipelineStats()
+    {
+#if ENABLE_WINMD_SUPPORT
+        if (toolTracking != null)
+        {
+            return toolTracking.GetPipelineStats();
+        }
+#endif
+        return new float[PipelineStageNames.Length * PipelineStatsValuesPerStage];
+    }
+
     public void Start()
     {
         DepthImagePreviewTexture = new Texture2D(512, 512, TextureFormat.Alpha8, false);